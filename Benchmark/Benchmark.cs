@@ -0,0 +1,357 @@
+﻿/*
+    This file is part of libCanopenSimple.
+    libCanopenSimple is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    libCanopenSimple is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with libCanopenSimple.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright(c) 2017 Robin Cornelius <robin.cornelius@gmail.com>
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Globalization;
+using System.Threading;
+using libCanopenSimple;
+
+namespace Benchmark
+{
+    /// <summary>
+    /// Throughput, latency and allocation benchmarks for libCanopenSimple. They run against the null driver's
+    /// synthetic traffic and scripted SDO server so no hardware is needed, eg
+    ///   Benchmark interop
+    ///   Benchmark sdo -nodes 127
+    ///   Benchmark nodes -nodes 100 -order node -inflight 32
+    ///   Benchmark block -size 4096 -delay 1
+    ///   Benchmark timeouts -delay 5 -drop 20 -retries 2
+    ///   Benchmark overflow -queue 1024 -work 2000
+    /// -driver loads another build of the null driver (default can_null_win32)
+    /// </summary>
+    class Benchmark
+    {
+        static string driver = "can_null_win32";
+        static Dictionary<string, string> options = new Dictionary<string, string>();
+
+        static void Main(string[] args)
+        {
+            for (int i = 1; i + 1 < args.Length; i += 2)
+                options[args[i].TrimStart('-')] = args[i + 1];
+
+            if (options.ContainsKey("driver"))
+                driver = options["driver"];
+
+            AppDomain.MonitoringIsEnabled = true;
+
+            switch (args.Length > 0 ? args[0] : "")
+            {
+                case "interop":
+                    interop();
+                    break;
+
+                case "sdo":
+                    sdo(option("nodes", 127));
+                    break;
+
+                case "nodes":
+                    nodes(option("nodes", 100), options.ContainsKey("order") && options["order"] == "node", option("inflight", 32));
+                    break;
+
+                case "block":
+                    block(option("size", 4096), option("delay", 1), option("count", 20));
+                    break;
+
+                case "timeouts":
+                    timeouts(option("delay", 5), option("drop", 20), option("retries", 2), option("count", 200));
+                    break;
+
+                case "overflow":
+                    overflow(option("queue", 1024), option("work", 2000));
+                    break;
+
+                default:
+                    Console.WriteLine("usage: Benchmark interop|sdo|nodes|block|timeouts|overflow [-nodes n] [-order node|interleaved] [-inflight n] [-size bytes] [-delay ms] [-count n] [-drop percent] [-retries n] [-queue frames] [-work spins] [-driver name]");
+                    break;
+            }
+
+            // the drivers' receive threads are not background threads
+            Environment.Exit(0);
+        }
+
+        static int option(string name, int def)
+        {
+            string v;
+            return options.TryGetValue(name, out v) ? int.Parse(v) : def;
+        }
+
+        static long allocated()
+        {
+            return AppDomain.CurrentDomain.MonitoringTotalAllocatedMemorySize;
+        }
+
+        /// <summary>
+        /// Cost of one receive poll and one send through the driver interop, and of frames delivered by the
+        /// receive thread, in time and in bytes allocated. Both should allocate nothing in steady state
+        /// </summary>
+        static void interop()
+        {
+            const int N = 5000000;
+            DriverLoader dl = new DriverLoader();
+
+            // a silent bus, polled and sent to from this thread
+            DriverInstance d = dl.loaddriver(driver);
+            d.open("null://null1", BUSSPEED.BUS_1Mbit);
+            Thread.Sleep(200);
+
+            DriverInstance.Message m = new DriverInstance.Message();
+            for (int pass = 0; pass < 2; pass++)
+            {
+                long b0 = allocated();
+                Stopwatch sw = Stopwatch.StartNew();
+                for (int i = 0; i < N; i++)
+                    d.canreceive(ref m);
+                double rns = sw.Elapsed.TotalMilliseconds * 1e6 / N;
+                long rb = allocated() - b0;
+
+                m.cob_id = 0x181;
+                m.len = 8;
+                b0 = allocated();
+                sw.Restart();
+                for (int i = 0; i < N; i++)
+                    d.cansend(ref m);
+                double sns = sw.Elapsed.TotalMilliseconds * 1e6 / N;
+                long sb = allocated() - b0;
+
+                // the first pass is the warm up
+                if (pass == 1)
+                    Console.WriteLine("empty poll {0:F0}ns {1:F1}B/call, send {2:F0}ns {3:F1}B/call", rns, (double)rb / N, sns, (double)sb / N);
+            }
+            d.close();
+
+            // a frame on every poll, delivered by the driver's own receive thread
+            DriverInstance g = dl.loaddriver(driver);
+            long frames = 0;
+            g.rxmessage += (msg, bridge) => frames++;
+            g.open("null://gen?rate=max&cob=0x181-0x1ff", BUSSPEED.BUS_1Mbit);
+            Thread.Sleep(500);
+
+            long f0 = Interlocked.Read(ref frames), a0 = allocated();
+            Stopwatch w = Stopwatch.StartNew();
+            Thread.Sleep(3000);
+            long f1 = Interlocked.Read(ref frames), a1 = allocated();
+            double s = w.Elapsed.TotalSeconds;
+
+            Console.WriteLine("receive thread {0:F2} Mframes/s, {1:F1}B/frame", (f1 - f0) / s / 1e6, (double)(a1 - a0) / Math.Max(1, f1 - f0));
+        }
+
+        /// <summary>
+        /// Every node keeps one SDO read going all the time, a new one is queued from the completion of the last,
+        /// reports the completed transfers per second and the bytes allocated per transfer
+        /// </summary>
+        static void sdo(int nodes)
+        {
+            libCanopenSimple.libCanopenSimple lco = new libCanopenSimple.libCanopenSimple();
+            lco.open("null://gen?nodes=" + nodes + "&sdo=1", BUSSPEED.BUS_1Mbit, driver);
+
+            long done = 0, failed = 0;
+            bool run = true;
+            Action<byte> issue = null;
+            issue = node =>
+            {
+                if (!Volatile.Read(ref run))
+                    return;
+
+                lco.SDOread(node, 0x1000, 0, x =>
+                {
+                    if (x.state == SDO.SDO_STATE.SDO_FINISHED)
+                        Interlocked.Increment(ref done);
+                    else
+                        Interlocked.Increment(ref failed);
+                    issue(node);
+                });
+            };
+
+            for (int n = 1; n <= nodes; n++)
+                issue((byte)n);
+
+            Thread.Sleep(1000);
+
+            long d0 = Interlocked.Read(ref done), a0 = allocated();
+            Stopwatch sw = Stopwatch.StartNew();
+            Thread.Sleep(5000);
+            long d1 = Interlocked.Read(ref done), a1 = allocated();
+            double s = sw.Elapsed.TotalSeconds;
+            Volatile.Write(ref run, false);
+
+            Console.WriteLine("{0} nodes: {1:F0} SDO/s, {2:F0}B/SDO, {3} failed", nodes, (d1 - d0) / s, (double)(a1 - a0) / Math.Max(1, d1 - d0), Interlocked.Read(ref failed));
+        }
+
+        /// <summary>
+        /// Reads 4 subindexes of 0x1018 from every node, all queued up front, with a 5ms one way link delay so
+        /// the time taken shows how many nodes are served side by side. node order queues each node's reads
+        /// together, the case a single FIFO serialises, interleaved queues them round the nodes
+        /// </summary>
+        static void nodes(int nodes, bool nodemajor, int inflight)
+        {
+            const int per = 4;
+
+            libCanopenSimple.libCanopenSimple lco = new libCanopenSimple.libCanopenSimple();
+            lco.sdomaxinflight = inflight;
+            lco.open("null://gen?nodes=" + nodes + "&sdo=1&delay=5", BUSSPEED.BUS_1Mbit, driver);
+            Thread.Sleep(300);
+
+            int left = nodes * per, failed = 0;
+            ManualResetEvent all = new ManualResetEvent(false);
+            Stopwatch sw = Stopwatch.StartNew();
+
+            for (int i = 0; i < nodes * per; i++)
+            {
+                int node = nodemajor ? 1 + i / per : 1 + i % nodes;
+                int sub = nodemajor ? i % per : i / nodes;
+
+                lco.SDOread((byte)node, 0x1018, (byte)(1 + sub), x =>
+                {
+                    if (x.state != SDO.SDO_STATE.SDO_FINISHED)
+                        Interlocked.Increment(ref failed);
+                    if (Interlocked.Decrement(ref left) == 0)
+                        all.Set();
+                });
+            }
+
+            all.WaitOne();
+            double ms = sw.Elapsed.TotalMilliseconds;
+
+            Console.WriteLine("{0} nodes x {1} reads, {2} order, {3} in flight: {4:F0}ms, {5:F0} SDO/s, {6} failed",
+                nodes, per, nodemajor ? "node" : "interleaved", inflight, ms, nodes * per / ms * 1000, failed);
+        }
+
+        /// <summary>
+        /// Uploads and downloads of one object size from a single node, one transfer at a time, first as segmented
+        /// and then as block transfers, over a link with the given one way delay. Segmented transfers wait a round
+        /// trip for every 7 bytes, block transfers for every sub-block of up to sdoblocksize segments
+        /// </summary>
+        static void block(int size, int delay, int count)
+        {
+            byte[] payload = new byte[size];
+            for (int x = 0; x < size; x++)
+                payload[x] = (byte)x;
+
+            foreach (bool useblock in new bool[] { false, true })
+            {
+                libCanopenSimple.libCanopenSimple lco = new libCanopenSimple.libCanopenSimple();
+                lco.sdoblock = useblock;
+                lco.open("null://gen?nodes=1&sdo=1&sdoblock=1&blob=" + size + "&delay=" + delay, BUSSPEED.BUS_1Mbit, driver);
+                Thread.Sleep(300);
+
+                foreach (bool upload in new bool[] { true, false })
+                {
+                    int failed = 0;
+                    Stopwatch sw = Stopwatch.StartNew();
+
+                    for (int i = 0; i < count; i++)
+                    {
+                        ManualResetEvent done = new ManualResetEvent(false);
+                        Action<SDO> completed = x =>
+                        {
+                            if (x.state != SDO.SDO_STATE.SDO_FINISHED || (upload && (x.databuffer == null || x.databuffer.Length != size)))
+                                Interlocked.Increment(ref failed);
+                            done.Set();
+                        };
+
+                        if (upload)
+                            lco.SDOread(1, 0x2000, 1, completed);
+                        else
+                            lco.SDOwrite(1, 0x2000, 1, payload, completed);
+
+                        done.WaitOne();
+                    }
+
+                    double s = sw.Elapsed.TotalSeconds;
+                    Console.WriteLine("{0} {1}: {2} x {3} bytes, {4:F1}ms each, {5:F1} kB/s, {6} failed", useblock ? "block    " : "segmented",
+                        upload ? "upload  " : "download", count, size, s * 1000 / count, (double)count * size / s / 1000, failed);
+                }
+
+                lco.close();
+            }
+        }
+
+        /// <summary>
+        /// SDO reads from a single node, one at a time, over a link with the given one way delay that loses drop
+        /// percent of frames. Reports the reads that finished, the time each took and the node's timeout figures
+        /// </summary>
+        static void timeouts(int delay, int drop, int retries, int count)
+        {
+            libCanopenSimple.libCanopenSimple lco = new libCanopenSimple.libCanopenSimple();
+            lco.sdoretries = retries;
+            lco.open("null://gen?nodes=1&sdo=1&delay=" + delay + "&jitter=1&drop=" + (drop / 100.0).ToString(CultureInfo.InvariantCulture), BUSSPEED.BUS_1Mbit, driver);
+            Thread.Sleep(300);
+
+            int failed = 0;
+            Stopwatch sw = Stopwatch.StartNew();
+
+            for (int i = 0; i < count; i++)
+            {
+                ManualResetEvent done = new ManualResetEvent(false);
+                lco.SDOread(1, 0x1000, 0, x =>
+                {
+                    if (x.state != SDO.SDO_STATE.SDO_FINISHED)
+                        Interlocked.Increment(ref failed);
+                    done.Set();
+                });
+                done.WaitOne();
+            }
+
+            double ms = sw.Elapsed.TotalMilliseconds;
+            SDOnodestats st = lco.getSDOstats(1);
+            lco.close();
+
+            Console.WriteLine("{0} reads, {1}ms delay, {2}% lost, {3} retries: {4} failed, {5:F1}ms each, srtt {6:F1}ms rttvar {7:F1}ms timeout {8:F0}ms, {9} samples {10} timeouts {11} retried",
+                count, delay, drop, retries, failed, ms / count, st.srtt.TotalMilliseconds, st.rttvar.TotalMilliseconds, st.timeout.TotalMilliseconds, st.samples, st.timeouts, st.retries);
+        }
+
+        /// <summary>
+        /// Floods a receive queue of the given size from the generator while every frame handler spins for work
+        /// iterations, once for each overflow policy. Reports how full the queue got, the frames dropped (and how
+        /// many of those were NMT, heartbeat or EMCY) or held up, and the heartbeats that still got handled
+        /// </summary>
+        static void overflow(int queue, int work)
+        {
+            foreach (overflowpolicy policy in Enum.GetValues(typeof(overflowpolicy)))
+            {
+                libCanopenSimple.libCanopenSimple lco = new libCanopenSimple.libCanopenSimple();
+                lco.rxqueuesize = queue;
+                lco.rxoverflow = policy;
+
+                long frames = 0, heartbeats = 0;
+                lco.frameevent += (f, dt) =>
+                {
+                    frames++;
+                    Thread.SpinWait(work);
+                };
+                lco.nmtecevent += (p, dt) => heartbeats++;
+
+                // 32 nodes with a 10ms heartbeat, 3200 heartbeats a second among the flood
+                lco.open("null://gen?rate=max&cob=0x181-0x1ff&nodes=32&hb=10", BUSSPEED.BUS_1Mbit, driver);
+                Thread.Sleep(300);
+                lco.resetRxQueueStats();
+                long f0 = Interlocked.Read(ref frames), h0 = Interlocked.Read(ref heartbeats);
+
+                Stopwatch sw = Stopwatch.StartNew();
+                Thread.Sleep(3000);
+                rxqueuestats st = lco.getRxQueueStats();
+                long f1 = Interlocked.Read(ref frames), h1 = Interlocked.Read(ref heartbeats);
+                double s = sw.Elapsed.TotalSeconds;
+                lco.close();
+
+                Console.WriteLine("{0,-22}: queue {1} high water {2}, dropped {3} ({4} NMT/heartbeat/EMCY), held up {5}, handled {6:F0} frames/s {7:F0} heartbeats/s",
+                    policy, st.capacity, st.highwater, st.dropped, st.droppedpriority, st.blocked, (f1 - f0) / s, (h1 - h0) / s);
+            }
+        }
+    }
+}
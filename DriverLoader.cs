@@ -19,6 +19,7 @@ using System;
 using System.Collections.Generic;
 using System.Linq;
 using System.Runtime.InteropServices;
+using System.Security;
 using System.Text;
 
 namespace libCanopenSimple
@@ -135,7 +136,19 @@ namespace libCanopenSimple
             funcaddr = GetProcAddress(Handle, "canEnumerate2_driver");
             DriverInstance.canEnumerate_T canEnumerate = Marshal.GetDelegateForFunctionPointer(funcaddr, typeof(DriverInstance.canEnumerate_T)) as DriverInstance.canEnumerate_T; ;
 
-            driver = new DriverInstance(canReceive, canSend, canOpen, canClose, canChangeBaudRate,canEnumerate);
+            // optional, only drivers that can follow simulated time have these
+            DriverInstance.canSetTime_T canSetTime = null;
+            DriverInstance.canNextEvent_T canNextEvent = null;
+
+            funcaddr = GetProcAddress(Handle, "canSetTime_driver");
+            if (funcaddr != IntPtr.Zero)
+                canSetTime = Marshal.GetDelegateForFunctionPointer(funcaddr, typeof(DriverInstance.canSetTime_T)) as DriverInstance.canSetTime_T;
+
+            funcaddr = GetProcAddress(Handle, "canNextEvent_driver");
+            if (funcaddr != IntPtr.Zero)
+                canNextEvent = Marshal.GetDelegateForFunctionPointer(funcaddr, typeof(DriverInstance.canNextEvent_T)) as DriverInstance.canNextEvent_T;
+
+            driver = new DriverInstance(canReceive, canSend, canOpen, canClose, canChangeBaudRate,canEnumerate, canSetTime, canNextEvent);
 
             return driver;
         }
@@ -195,10 +208,22 @@ namespace libCanopenSimple
             funcaddr = dlsym(Handle, "canChangeBaudRate_driver");
             DriverInstance.canChangeBaudRate_T canChangeBaudRate = Marshal.GetDelegateForFunctionPointer(funcaddr, typeof(DriverInstance.canChangeBaudRate_T)) as DriverInstance.canChangeBaudRate_T; ;
 
-            funcaddr = dlsym(Handle, "canEnumerate_driver");
+            funcaddr = dlsym(Handle, "canEnumerate2_driver");
             DriverInstance.canEnumerate_T canEnumerate = Marshal.GetDelegateForFunctionPointer(funcaddr, typeof(DriverInstance.canEnumerate_T)) as DriverInstance.canEnumerate_T; ;
 
-            driver = new DriverInstance(canReceive, canSend, canOpen, canClose, canChangeBaudRate,canEnumerate);
+            // optional, only drivers that can follow simulated time have these
+            DriverInstance.canSetTime_T canSetTime = null;
+            DriverInstance.canNextEvent_T canNextEvent = null;
+
+            funcaddr = dlsym(Handle, "canSetTime_driver");
+            if (funcaddr != IntPtr.Zero)
+                canSetTime = Marshal.GetDelegateForFunctionPointer(funcaddr, typeof(DriverInstance.canSetTime_T)) as DriverInstance.canSetTime_T;
+
+            funcaddr = dlsym(Handle, "canNextEvent_driver");
+            if (funcaddr != IntPtr.Zero)
+                canNextEvent = Marshal.GetDelegateForFunctionPointer(funcaddr, typeof(DriverInstance.canNextEvent_T)) as DriverInstance.canNextEvent_T;
+
+            driver = new DriverInstance(canReceive, canSend, canOpen, canClose, canChangeBaudRate,canEnumerate, canSetTime, canNextEvent);
 
 
 
@@ -229,8 +254,10 @@ namespace libCanopenSimple
         /// <summary>
         /// CanFestival message packet. Note we set data to be a UInt64 as inside canfestival its a fixed char[8] array
         /// we cannout use fixed arrays in C# without UNSAFE so instead we just use a UInt64
+        /// The layout must match the 14 byte packed Message in can.h, all fields are blittable so the
+        /// marshaller passes a ref Message straight through as a pointer with no copying
         /// </summary>
-        [StructLayout(LayoutKind.Sequential, Size = 12, Pack = 1)]
+        [StructLayout(LayoutKind.Sequential, Size = 14, Pack = 1)]
         public struct Message
         {
             public UInt16 cob_source_id; /**< message's ID */
@@ -283,10 +310,13 @@ namespace libCanopenSimple
 
         UnmanagedStruct enumerationresult;
 
-        public delegate byte canReceive_T(IntPtr handle, IntPtr msg);
+        // Message is blittable so ref is pinned and passed as Message* without an intermediate buffer
+        [SuppressUnmanagedCodeSecurity]
+        public delegate byte canReceive_T(IntPtr handle, ref Message msg);
         private canReceive_T canReceive;
 
-        public delegate byte canSend_T(IntPtr handle, IntPtr msg);
+        [SuppressUnmanagedCodeSecurity]
+        public delegate byte canSend_T(IntPtr handle, ref Message msg);
         private canSend_T canSend;
 
         public delegate IntPtr canOpen_T(IntPtr brd);
@@ -308,6 +338,19 @@ namespace libCanopenSimple
         public delegate void canEnumerate_T(canEnumerateDelegate_T callback);
         private canEnumerate_T canEnumerate;
 
+        // ns counts from any origin the caller likes, UInt64.MaxValue goes back to the real clock
+        [SuppressUnmanagedCodeSecurity]
+        public delegate void canSetTime_T(IntPtr handle, UInt64 ns);
+        private canSetTime_T canSetTime;
+
+        // time the driver next has a frame for canReceive, UInt64.MaxValue if nothing is scheduled
+        [SuppressUnmanagedCodeSecurity]
+        public delegate UInt64 canNextEvent_T(IntPtr handle);
+        private canNextEvent_T canNextEvent;
+
+        // receive thread's part in simulated time, frames sent hold it busy until it has polled again
+        private volatile SimClock.Participant rxclock;
+
         private IntPtr instancehandle = IntPtr.Zero;
         IntPtr brdptr;
 
@@ -323,7 +366,9 @@ namespace libCanopenSimple
         /// <param name="canOpen">pInvoked delegate for canOpen function</param>
         /// <param name="canClose">pInvoked delegate for canClose function</param>
         /// <param name="canChangeBaudrate">pInvoked delegate for canChangeBaudrate functipn</param>
-        public DriverInstance(canReceive_T canReceive, canSend_T canSend, canOpen_T canOpen, canClose_T canClose, canChangeBaudRate_T canChangeBaudrate, canEnumerate_T canEnumerate)
+        /// <param name="canSetTime">Optional pInvoked delegate for canSetTime, for drivers that can follow simulated time</param>
+        /// <param name="canNextEvent">Optional pInvoked delegate for canNextEvent, required with canSetTime</param>
+        public DriverInstance(canReceive_T canReceive, canSend_T canSend, canOpen_T canOpen, canClose_T canClose, canChangeBaudRate_T canChangeBaudrate, canEnumerate_T canEnumerate, canSetTime_T canSetTime = null, canNextEvent_T canNextEvent = null)
         {
             this.canReceive = canReceive;
             this.canSend = canSend;
@@ -331,6 +376,8 @@ namespace libCanopenSimple
             this.canClose = canClose;
             this.canChangeBaudrate = canChangeBaudrate;
             this.canEnumerate = canEnumerate;
+            this.canNextEvent = canNextEvent;
+            this.canSetTime = canNextEvent != null ? canSetTime : null;
 
 
             StringBuilder[] b = new StringBuilder[2];
@@ -468,21 +515,22 @@ namespace libCanopenSimple
         /// <returns></returns>
         public Message canreceive()
         {
-
-            // I think we can do better here and not allocated/deallocate to heap every pump loop
             Message msg = new Message();
-
-            IntPtr msgptr = Marshal.AllocHGlobal(Marshal.SizeOf(msg));
-            Marshal.StructureToPtr(msg, msgptr, false);
-
-            byte status = canReceive(instancehandle, msgptr);
-
-            msg = (Message)Marshal.PtrToStructure(msgptr, typeof(Message));
-
-            Marshal.FreeHGlobal(msgptr);
-
+            canreceive(ref msg);
             return msg;
+        }
 
+        /// <summary>
+        /// Message pump function, fills in the callers message so nothing is allocated per poll
+        /// </summary>
+        /// <param name="msg">Receives the next message, len is 0 if there was nothing to read</param>
+        /// <returns>False if the driver reported an error</returns>
+        public bool canreceive(ref Message msg)
+        {
+            // start from a clean message every poll, a reused one would hand the last frame's
+            // cob_source_id back to drivers that echo on an empty poll when it is set (nanomsg)
+            msg = default(Message);
+            return canReceive(instancehandle, ref msg) == 0;
         }
 
         /// <summary>
@@ -491,16 +539,65 @@ namespace libCanopenSimple
         /// <param name="msg">CanOpen message to be sent</param>
         public void cansend(Message msg)
         {
+            cansend(ref msg);
+        }
+
+        /// <summary>
+        /// Send a CanOpen mesasge to the hardware device without copying it
+        /// </summary>
+        /// <param name="msg">CanOpen message to be sent</param>
+        public void cansend(ref Message msg)
+        {
+            if (instancehandle == IntPtr.Zero)
+                return;
 
+            canSend(instancehandle, ref msg);
 
-            IntPtr msgptr = Marshal.AllocHGlobal(Marshal.SizeOf(msg));
-            Marshal.StructureToPtr(msg, msgptr, false);
+            SimClock.Participant clock = rxclock;
+            if (clock != null)
+                SimClock.Kick(clock);
+        }
 
-            if(instancehandle!=null)
-               canSend(instancehandle, msgptr);
+        /// <summary>
+        /// Hand simulated time to a driver that can follow it, or give it back the real clock
+        /// </summary>
+        /// <param name="origin">Simulated time in ticks the driver's clock counts from, 0 while it runs on real time</param>
+        private void followclock(ref long origin)
+        {
+            if (SimClock.simulated)
+            {
+                long now = SimClock.Now.Ticks;
 
-            Marshal.FreeHGlobal(msgptr);
+                if (origin == 0)
+                    origin = now;
 
+                canSetTime(instancehandle, (UInt64)(now - origin) * 100);
+            }
+            else if (origin != 0)
+            {
+                origin = 0;
+                canSetTime(instancehandle, UInt64.MaxValue);
+            }
+        }
+
+        /// <summary>
+        /// Simulated time the driver next has a frame due
+        /// </summary>
+        /// <param name="origin">As passed to followclock()</param>
+        private DateTime nextevent(long origin)
+        {
+            UInt64 ns = canNextEvent(instancehandle);
+
+            if (ns == UInt64.MaxValue)
+                return DateTime.MaxValue;
+
+            // round up to whole ticks, jumping to just short of the frame would never reach it
+            UInt64 ticks = ns / 100 + (ns % 100 != 0 ? 1UL : 0UL);
+
+            if (ticks > (UInt64)(DateTime.MaxValue.Ticks - origin))
+                return DateTime.MaxValue;
+
+            return new DateTime(origin + (long)ticks);
         }
 
         /// <summary>
@@ -508,18 +605,37 @@ namespace libCanopenSimple
         /// </summary>
         private void rxthreadworker()
         {
+            // The bus counts as idle to the simulated clock when a poll comes back empty, until the driver's
+            // next frame is due if it can follow simulated time, otherwise once it has been quiet for a while
+            SimClock.Participant clock = SimClock.Join(null, canSetTime == null);
+            rxclock = clock;
+            long origin = 0;
+
+            // one message for the life of the thread, the driver writes straight into it
+            DriverInstance.Message rxmsg = new DriverInstance.Message();
+
             try
             {
                 while (threadrun)
                 {
+                    int kicks = clock.kicks;
+
+                    if (canSetTime != null)
+                        followclock(ref origin);
 
-                    DriverInstance.Message rxmsg = canreceive();
+                    canreceive(ref rxmsg);
 
                     if (rxmsg.len != 0)
                     {
+                        SimClock.Busy(clock);
+
                         if (rxmessage != null)
                             rxmessage(rxmsg);
                     }
+                    else
+                    {
+                        SimClock.Idle(clock, origin != 0 ? nextevent(origin) : DateTime.MaxValue, kicks);
+                    }
 
                     //System.Threading.Thread.Sleep(0);
                 }
@@ -528,6 +644,9 @@ namespace libCanopenSimple
             {
 
             }
+
+            rxclock = null;
+            SimClock.Leave(clock);
         }
     }
 }
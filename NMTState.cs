@@ -48,7 +48,7 @@ namespace libCanopenSimple
         {
             laststate = state;
             state = newstate;
-            lastping = DateTime.Now;
+            lastping = SimClock.Now;
 
             if (newstate == e_NMTState.BOOT)
             {
@@ -65,8 +65,6 @@ namespace libCanopenSimple
 
         public int returnlen = 0;
 
-        static List<SDO> activeSDO = new List<SDO>();
-
         private Action<SDO> completedcallback;
       
       
@@ -75,10 +73,44 @@ namespace libCanopenSimple
         private UInt32 totaldata;
         private libCanopenSimple can;
         private bool lasttoggle = false;
-        private DateTime timeout;
-        private ManualResetEvent finishedevent;
+        internal DateTime timeout;
+        private DateTime sent = DateTime.MinValue;   // when the request now awaiting a reply went out, MinValue if it is not an RTT sample
+        private int retries = 0;
+        private ManualResetEvent finishedevent;    // only made if someone waits with WaitOne()
+        private int finishedflag = 0;
         private debuglevel dbglevel;
 
+        // Called once from SDOFinish(), used by the Task based API
+        internal Action<SDO> onfinish;
+
+        // Cancelled through a CancellationToken or flushSDOqueue(), only set by the worker or before the SDO is started
+        internal bool cancelled = false;
+
+        // Handed to the owning libCanopenSimple, set under its sdolock
+        internal bool queued = false;
+
+        /// <summary>
+        /// Steps of a block transfer, the public state stays SDO_HANDSHAKE throughout
+        /// </summary>
+        private enum blockphase
+        {
+            NONE,
+            DL_INIT,
+            DL_BLOCK,
+            DL_END,
+            UL_INIT,
+            UL_BLOCK,
+            UL_END,
+        }
+
+        private blockphase phase = blockphase.NONE;
+        private byte blksize;
+        private byte blocksent;     // download, segments sent in the current sub-block
+        private UInt32 blockstart;  // download, first byte of the current sub-block
+        private byte ackseq;        // upload, last segment of the current sub-block taken in order
+        private bool blocklast;     // upload, the final segment has been taken
+        private bool blockcrc;      // upload, the server sends a CRC
+
 
         /// <summary>
         /// Construct a new SDO object
@@ -100,141 +132,234 @@ namespace libCanopenSimple
             this.completedcallback = completedcallback;
             this.databuffer = databuffer;
 
-            finishedevent = new ManualResetEvent(false);
             state = SDO_STATE.SDO_INIT;
             dbglevel = can.dbglevel;
 
         }
 
         /// <summary>
-        /// Add this SDO object to the active list
+        /// Has the SDO transfer finished?
+        /// </summary>
+        /// <returns>True if the SDO has finished and fired its finished event</returns>
+        public bool WaitOne()
+        {
+            if (Volatile.Read(ref finishedflag) != 0)
+                return true;
+
+            ManualResetEvent ev = Volatile.Read(ref finishedevent);
+            if (ev == null)
+            {
+                ev = new ManualResetEvent(false);
+                ManualResetEvent other = Interlocked.CompareExchange(ref finishedevent, ev, null);
+                if (other != null)
+                {
+                    ev.Dispose();
+                    ev = other;
+                }
+            }
+
+            // SDOFinish() may have looked for the event before it existed
+            if (Volatile.Read(ref finishedflag) != 0)
+                return true;
+
+            return ev.WaitOne();
+        }
+
+        /// <summary>
+        /// Queue this SDO on its libCanopenSimple if that has not been done already
         /// </summary>
+        [Obsolete("SDOread() and SDOwrite() and their Async forms queue the SDO themselves")]
         public void sendSDO()
         {
-            lock (activeSDO)
-                activeSDO.Add(this);
+            if (!queued)
+                can.sdoenqueue(this);
         }
 
+        /// <summary>
+        /// True if no SDO transfer is in progress on any libCanopenSimple
+        /// </summary>
+        [Obsolete("Each libCanopenSimple tracks its own SDOs, use getSDOstats() or the SDO itself")]
         public static bool isEmpty()
         {
-            return activeSDO.Count == 0;
+            return Volatile.Read(ref libCanopenSimple.sdoactive) == 0;
         }
 
         /// <summary>
-        /// Has the SDO transfer finished?
+        /// Does nothing, SDOs are driven by the worker of their libCanopenSimple
         /// </summary>
-        /// <returns>True if the SDO has finished and fired its finished event</returns>
-        public bool WaitOne()
+        [Obsolete("SDOs are driven by the worker of their libCanopenSimple, there is nothing to pump")]
+        public static void kick_SDO()
         {
-            return finishedevent.WaitOne();
         }
 
+        /// <summary>
+        /// True once SDOFinish() has run
+        /// </summary>
+        internal bool isfinished
+        {
+            get { return Volatile.Read(ref finishedflag) != 0; }
+        }
 
         /// <summary>
-        /// SDO pump, call this often
+        /// True once the transfer has completed or failed
         /// </summary>
-        public static void kick_SDO()
+        public bool done
         {
-            List<SDO> tokill = new List<SDO>();
+            get { return state == SDO_STATE.SDO_FINISHED || state == SDO_STATE.SDO_ERROR; }
+        }
 
-            lock (activeSDO)
-            {
-                foreach (SDO s in activeSDO)
-                {
-                    s.kick_SDOp();
-                    if (s.state == SDO_STATE.SDO_FINISHED || s.state == SDO_STATE.SDO_ERROR)
-                    {
-                        tokill.Add(s);
-                    }
-                }
-            }
+        /// <summary>
+        /// Stop the transfer as the caller no longer wants it, called by the owning libCanopenSimple
+        /// </summary>
+        internal void cancel()
+        {
+            // tell the node if it is part way through the transfer
+            if (state != SDO_STATE.SDO_INIT)
+                sendpacket(0x80, BitConverter.GetBytes((UInt32)0x08000000));
 
-            foreach (SDO s in tokill)
-            {
-                lock (activeSDO)
-                    activeSDO.Remove(s);
-                s.SDOFinish();
-            }
+            phase = blockphase.NONE;
+            cancelled = true;
+            state = SDO_STATE.SDO_ERROR;
         }
 
         /// <summary>
-        /// State machine for a specific SDO instance
+        /// Give up on the transfer as the node has not answered in time, called by the owning libCanopenSimple
         /// </summary>
-        private void kick_SDOp()
+        internal void expire()
         {
+            state = SDO_STATE.SDO_ERROR;
 
-            if (state != SDO_STATE.SDO_INIT && DateTime.Now > timeout)
-            {
-                state = SDO_STATE.SDO_ERROR;
-
+            if (dbglevel == debuglevel.DEBUG_ALL)
                 Console.WriteLine("SDO Timeout Error on {0:x4}/{1:x2} {2:x8}", this.index, this.subindex, expitideddata);
 
-                if (completedcallback != null)
-                    completedcallback(this);
+            if (completedcallback != null)
+                completedcallback(this);
+        }
 
-                return;
-            }
+        /// <summary>
+        /// The node has not answered in time, start a read again from the beginning if it has retries left,
+        /// called by the owning libCanopenSimple
+        /// </summary>
+        /// <returns>True if the transfer was restarted, false if it should be given up</returns>
+        internal bool retry()
+        {
+            if (dir != direction.SDO_READ || retries >= can.sdoretries)
+                return false;
 
-            if (state == SDO_STATE.SDO_INIT)
+            retries++;
+            can.sdoretried(node);
+
+            // the node may be part way through the old transfer, SDO protocol timed out resets it
+            sendpacket(0x80, BitConverter.GetBytes((UInt32)0x05040000));
+            start();
+            return true;
+        }
+
+        /// <summary>
+        /// Send the first request of the transfer, called by the owning libCanopenSimple once the node's slot is free
+        /// </summary>
+        internal void start()
+        {
+            state = SDO_STATE.SDO_SENT;
+            phase = blockphase.NONE;
+            lasttoggle = false;
+            settimeout();
+
+            if (can.sdoblockallowed(node))
             {
-                timeout = DateTime.Now + new TimeSpan(0, 0, 1);
-                state = SDO_STATE.SDO_SENT;
+                blksize = can.sdoblocksize < 1 ? (byte)1 : can.sdoblocksize > 127 ? (byte)127 : can.sdoblocksize;
 
                 if (dir == direction.SDO_READ)
                 {
-                    byte cmd = 0x40;
-                    byte[] payload = new byte[4];
-                    sendpacket(cmd, payload);
+                    //Block upload, CRC supported, the server may answer small objects expedited (pst 4)
+                    phase = blockphase.UL_INIT;
+                    sendpacket(0xA4, new byte[] { blksize, 4 });
+                    return;
                 }
 
-                if (dir == direction.SDO_WRITE)
+                if (databuffer.Length > 4)
                 {
-                    bool wpsent = false;
-                    byte cmd = 0;
+                    //Block download, CRC supported, size indicated
+                    phase = blockphase.DL_INIT;
+                    expitided = false;
+                    expitideddata = (UInt32)databuffer.Length;
+                    totaldata = 0;
+                    sendpacket(0xC6, BitConverter.GetBytes(expitideddata));
+                    return;
+                }
+            }
 
-                    expitided = true;
+            if (dir == direction.SDO_READ)
+            {
+                byte cmd = 0x40;
+                byte[] payload = new byte[4];
+                sendpacket(cmd, payload);
+            }
 
-                    switch (databuffer.Length)
-                    {
-                        case 1:
-                            cmd = 0x2f;
-                            break;
-                        case 2:
-                            cmd = 0x2b;
-                            break;
-                        case 3:
-                            cmd = 0x27;
-                            break;
-                        case 4:
-                            cmd = 0x23;
-                            break;
-                        default:
-                            //Bigger than 4 bytes we use segmented transfer
-                            cmd = 0x21;
-                            expitided = false;
-
-                            byte[] payload = new byte[4];
-                            payload[0] = (byte)databuffer.Length;
-                            payload[1] = (byte)(databuffer.Length >> 8);
-                            payload[2] = (byte)(databuffer.Length >> 16);
-                            payload[3] = (byte)(databuffer.Length >> 24);
-
-                            expitideddata = (UInt32)databuffer.Length;
-                            totaldata = 0;
-
-                            wpsent = true;
-                            sendpacket(cmd, payload);
-                            break;
+            if (dir == direction.SDO_WRITE)
+            {
+                bool wpsent = false;
+                byte cmd = 0;
 
-                    }
+                expitided = true;
 
-                    if (wpsent == false)
-                        sendpacket(cmd, databuffer);
+                switch (databuffer.Length)
+                {
+                    case 1:
+                        cmd = 0x2f;
+                        break;
+                    case 2:
+                        cmd = 0x2b;
+                        break;
+                    case 3:
+                        cmd = 0x27;
+                        break;
+                    case 4:
+                        cmd = 0x23;
+                        break;
+                    default:
+                        //Bigger than 4 bytes we use segmented transfer
+                        cmd = 0x21;
+                        expitided = false;
+
+                        byte[] payload = new byte[4];
+                        payload[0] = (byte)databuffer.Length;
+                        payload[1] = (byte)(databuffer.Length >> 8);
+                        payload[2] = (byte)(databuffer.Length >> 16);
+                        payload[3] = (byte)(databuffer.Length >> 24);
+
+                        expitideddata = (UInt32)databuffer.Length;
+                        totaldata = 0;
+
+                        wpsent = true;
+                        sendpacket(cmd, payload);
+                        break;
 
                 }
+
+                if (wpsent == false)
+                    sendpacket(cmd, databuffer);
+
             }
         }
 
+        /// <summary>
+        /// Restart the response timer for a request just sent, the owner is told so it can track the new deadline.
+        /// Reads wait for the node's measured response time, writes (which the node may take a while to apply)
+        /// and whole blocks wait for sdotimeout.
+        /// </summary>
+        /// <param name="block">The reply waits on a block of segments rather than one request</param>
+        private void settimeout(bool block = false)
+        {
+            DateTime now = SimClock.Now;
+            bool measured = dir == direction.SDO_READ && !block && phase != blockphase.UL_BLOCK;
+
+            // a reply after a retry may answer the earlier request, so it says nothing about the round trip (Karn)
+            sent = measured && retries == 0 ? now : DateTime.MinValue;
+            timeout = now + (measured ? can.sdonodetimeout(node) : can.sdotimeout);
+            can.sdotimer(this);
+        }
+
         /// <summary>
         /// Send a SDO packet, with command and payload, should be only called from SDO state machine
         /// </summary>
@@ -243,14 +368,13 @@ namespace libCanopenSimple
         private void sendpacket(byte cmd, byte[] payload)
         {
 
-            canpacket p = new canpacket();
+            canframe p = new canframe();
             p.cob = (UInt16)(0x600 + node);
             p.len = 8;
-            p.data = new byte[8];
-            p.data[0] = cmd;
-            p.data[1] = (byte)index;
-            p.data[2] = (byte)(index >> 8);
-            p.data[3] = subindex;
+            p[0] = cmd;
+            p[1] = (byte)index;
+            p[2] = (byte)(index >> 8);
+            p[3] = subindex;
 
             int sendlength = 4;
 
@@ -259,14 +383,14 @@ namespace libCanopenSimple
 
             for (int x = 0; x < sendlength; x++)
             {
-                p.data[4 + x] = payload[x];
+                p[4 + x] = payload[x];
             }
 
             if (dbglevel == debuglevel.DEBUG_ALL)
                 Console.WriteLine(String.Format("Sending a new SDO packet: {0}", p.ToString()));
 
             if(can.isopen())
-                can.SendPacket(p);
+                can.SendFrame(p);
         }
 
         /// <summary>
@@ -276,21 +400,20 @@ namespace libCanopenSimple
         /// <param name="payload">Data payload</param>
         private void sendpacketsegment(byte cmd, byte[] payload)
         {
-            canpacket p = new canpacket();
+            canframe p = new canframe();
             p.cob = (UInt16)(0x600 + node);
             p.len = 8;
-            p.data = new byte[8];
-            p.data[0] = cmd;
+            p[0] = cmd;
 
             for (int x = 0; x < payload.Length; x++)
             {
-                p.data[1 + x] = payload[x];
+                p[1 + x] = payload[x];
             }
 
             if (dbglevel == debuglevel.DEBUG_ALL)
                 Console.WriteLine(String.Format("Sending a new segmented SDO packet: {0}", p.ToString()));
 
-            can.SendPacket(p);
+            can.SendFrame(p);
         }
 
         /// <summary>
@@ -298,8 +421,17 @@ namespace libCanopenSimple
         /// </summary>
         public void SDOFinish()
         {
-            can.SDOcallbacks.Remove((UInt16)(this.node + 0x580));
-            finishedevent.Set();
+            can.sdorelease(this);
+
+            if (Interlocked.Exchange(ref finishedflag, 1) != 0)
+                return;
+
+            ManualResetEvent ev = Volatile.Read(ref finishedevent);
+            if (ev != null)
+                ev.Set();
+
+            if (onfinish != null)
+                onfinish(this);
         }
 
         /// <summary>
@@ -309,26 +441,54 @@ namespace libCanopenSimple
         /// <returns></returns>
         public bool SDOProcess(canpacket cp)
         {
+            return SDOProcess(cp.ToFrame());
+        }
+
+        /// <summary>
+        /// SDO Instance processor, process current SDO reply and decide what to do next
+        /// </summary>
+        /// <param name="cp">SDO frame to process</param>
+        /// <returns>True when the transfer is complete</returns>
+        public bool SDOProcess(canframe cp)
+        {
+            // Initiate replies and aborts name the object, one for another object is the late reply to a
+            // transfer this node had before (cancelled or timed out), it must not finish or time this one
+            int scs = cp[0] >> 5;
+            if (phase == blockphase.NONE && scs >= 0x02 && scs <= 0x04 && (cp[1] + (cp[2] << 8) != index || cp[3] != subindex))
+                return false;
+
+            if (sent != DateTime.MinValue)
+            {
+                can.sdortt(node, SimClock.Now - sent);
+                sent = DateTime.MinValue;
+            }
 
-            int SCS = cp.data[0] >> 5; //7-5
+            if (phase != blockphase.NONE)
+            {
+                bool finished;
+                if (blockprocess(cp, out finished))
+                    return finished;
+            }
+
+            int SCS = cp[0] >> 5; //7-5
 
-            int n = (0x03 & (cp.data[0] >> 2)); //3-2 data size for normal packets
+            int n = (0x03 & (cp[0] >> 2)); //3-2 data size for normal packets
 
             returnlen = 8*(4-n);
 
-            int e = (0x01 & (cp.data[0] >> 1)); // expidited flag
-            int s = (cp.data[0] & 0x01); // data size set flag
+            int e = (0x01 & (cp[0] >> 1)); // expidited flag
+            int s = (cp[0] & 0x01); // data size set flag
 
-            int sn = (0x07 & (cp.data[0] >> 1)); //3-1 data size for segment packets
-            int t = (0x01 & (cp.data[0] >> 4));  //toggle flag
+            int sn = (0x07 & (cp[0] >> 1)); //3-1 data size for segment packets
+            int t = (0x01 & (cp[0] >> 4));  //toggle flag
 
-            int c = 0x01 & cp.data[0]; //More segments to upload?
+            int c = 0x01 & cp[0]; //More segments to upload?
 
             //ERROR abort
             if (SCS == 0x04)
             {
 
-                expitideddata = (UInt32)(cp.data[4] + (cp.data[5] << 8) + (cp.data[6] << 16) + (cp.data[7] << 24));
+                expitideddata = (UInt32)(cp[4] + (cp[5] << 8) + (cp[6] << 16) + (cp[7] << 24));
                 databuffer = BitConverter.GetBytes(expitideddata);
 
                 state = SDO_STATE.SDO_ERROR;
@@ -346,26 +506,17 @@ namespace libCanopenSimple
             {
 
 
-                UInt16 index = (UInt16)(cp.data[1] + (cp.data[2] << 8));
-                byte sub = cp.data[3];
-
-                int node = cp.cob - 0x580;
-
+                UInt16 index = (UInt16)(cp[1] + (cp[2] << 8));
+                byte sub = cp[3];
 
-                foreach (SDO sdo in activeSDO)
+                // replies only reach the SDO holding this node's slot
+                if ((index == this.index && sub == this.subindex)) //if segments break its here
                 {
-                    if (sdo.node == node)
+                    if (expitided == false)
                     {
-                        if ((index == sdo.index && sub == sdo.subindex)) //if segments break its here
-                        {
-                            if (expitided == false)
-                            {
-                                state = SDO_STATE.SDO_HANDSHAKE;
-                                requestNextSegment(false);
-                                return false;
-                            }
-                        }
-
+                        state = SDO_STATE.SDO_HANDSHAKE;
+                        requestNextSegment(false);
+                        return false;
                     }
                 }
 
@@ -399,7 +550,7 @@ namespace libCanopenSimple
             {
                 //Expidited and length are set so its a regular short transfer
 
-                expitideddata = (UInt32)(cp.data[4] + (cp.data[5] << 8) + (cp.data[6] << 16) + (cp.data[7] << 24));
+                expitideddata = (UInt32)(cp[4] + (cp[5] << 8) + (cp[6] << 16) + (cp[7] << 24));
                 databuffer = BitConverter.GetBytes(expitideddata);
 
                 state = SDO_STATE.SDO_FINISHED;
@@ -418,7 +569,7 @@ namespace libCanopenSimple
 
             if (SCS == 0x02)
             {
-                UInt32 count = (UInt32)(cp.data[4] + (cp.data[5] << 8) + (cp.data[6] << 16) + (cp.data[7] << 24));
+                UInt32 count = (UInt32)(cp[4] + (cp[5] << 8) + (cp[6] << 16) + (cp[7] << 24));
 
                 Console.WriteLine("RX Segmented transfer start length is {0}", count);
                 expitideddata = count;
@@ -443,7 +594,7 @@ namespace libCanopenSimple
                 for (int x = 0; x < scount; x++)
                 {
                     if ((totaldata + x) < databuffer.Length)
-                        databuffer[totaldata + x] = cp.data[1 + x];
+                        databuffer[totaldata + x] = cp[1 + x];
                 }
 
                 totaldata += 7;
@@ -472,7 +623,7 @@ namespace libCanopenSimple
         private void requestNextSegment(bool toggle)
         {
 
-            timeout = DateTime.Now + new TimeSpan(0, 0, 1);
+            settimeout();
 
             if (dir == direction.SDO_READ)
             {
@@ -523,5 +674,411 @@ namespace libCanopenSimple
 
         }
 
+        /// <summary>
+        /// Block transfer state machine
+        /// </summary>
+        /// <param name="cp">SDO frame to process</param>
+        /// <param name="finished">Set when the transfer is complete</param>
+        /// <returns>False if the frame should go to the normal state machine instead</returns>
+        private bool blockprocess(canframe cp, out bool finished)
+        {
+            finished = false;
+            byte cmd = cp[0];
+
+            //Abort, if it is the server turning down block mode try again the old way
+            if (cmd == 0x80)
+            {
+                UInt32 code = cp.u32(4);
+
+                if ((phase == blockphase.DL_INIT || phase == blockphase.UL_INIT) &&
+                    ((code & 0xFFFF0000) == 0x05040000 || code == 0x08000000))
+                {
+                    can.sdorejectedblock(node);
+                    start();
+                    return true;
+                }
+
+                phase = blockphase.NONE;
+                return false;
+            }
+
+            switch (phase)
+            {
+                case blockphase.DL_INIT:
+                    if ((cmd & 0xE3) == 0xA0)
+                    {
+                        state = SDO_STATE.SDO_HANDSHAKE;
+                        setblksize(cp[4]);
+                        blockstart = 0;
+                        phase = blockphase.DL_BLOCK;
+                        sendblock();
+                    }
+                    break;
+
+                case blockphase.DL_BLOCK:
+                    if ((cmd & 0xE3) == 0xA2 && cp[1] <= blocksent)
+                    {
+                        //Everything after the last segment acknowledged is sent again
+                        blockstart = Math.Min(blockstart + 7 * (UInt32)cp[1], (UInt32)databuffer.Length);
+                        totaldata = blockstart;
+                        setblksize(cp[2]);
+
+                        if (blockstart < databuffer.Length)
+                        {
+                            sendblock();
+                            break;
+                        }
+
+                        UInt16 crc = crc16(databuffer, 0, databuffer.Length);
+                        int n = (7 - databuffer.Length % 7) % 7;
+
+                        phase = blockphase.DL_END;
+                        settimeout();
+                        sendpacketsegment((byte)(0xC1 | (n << 2)), new byte[] { (byte)crc, (byte)(crc >> 8) });
+                    }
+                    break;
+
+                case blockphase.DL_END:
+                    if ((cmd & 0xE3) == 0xA1)
+                        blockfinish(out finished);
+                    break;
+
+                case blockphase.UL_INIT:
+                    if ((cmd & 0xE1) == 0xC0)
+                    {
+                        state = SDO_STATE.SDO_HANDSHAKE;
+                        blockcrc = (cmd & 0x04) != 0;
+
+                        //Size indicated, leave room for the padding of the last segment
+                        expitideddata = (cmd & 0x02) != 0 ? cp.u32(4) : 0;
+                        databuffer = new byte[expitideddata > 0 ? (int)expitideddata + 7 : 7 * blksize];
+                        totaldata = 0;
+                        ackseq = 0;
+                        blocklast = false;
+
+                        phase = blockphase.UL_BLOCK;
+                        settimeout();
+                        sendpacketsegment(0xA3, new byte[0]);
+                        break;
+                    }
+
+                    //The server switched to a normal upload
+                    if ((cmd >> 5) == 0x02)
+                    {
+                        phase = blockphase.NONE;
+                        return false;
+                    }
+                    break;
+
+                case blockphase.UL_BLOCK:
+                    {
+                        int seq = cmd & 0x7F;
+                        bool c = (cmd & 0x80) != 0;
+                        bool fresh = seq > ackseq;
+
+                        //Only the next segment in order is taken, the ack tells the server where to resend from
+                        if (seq == ackseq + 1)
+                        {
+                            if (totaldata + 7 > databuffer.Length)
+                                Array.Resize(ref databuffer, databuffer.Length * 2);
+
+                            for (int x = 0; x < 7; x++)
+                                databuffer[totaldata + x] = cp[1 + x];
+
+                            totaldata += 7;
+                            ackseq = (byte)seq;
+                            blocklast = c;
+                        }
+
+                        if (fresh && (seq >= blksize || c))
+                        {
+                            settimeout();
+                            sendpacketsegment(0xA2, new byte[] { ackseq, blksize });
+                            ackseq = 0;
+
+                            if (blocklast)
+                                phase = blockphase.UL_END;
+                        }
+                    }
+                    break;
+
+                case blockphase.UL_END:
+                    if ((cmd & 0xE3) == 0xC1)
+                    {
+                        int n = (cmd >> 2) & 0x07;
+                        int len = (int)totaldata - n;
+
+                        if (len < 0 || (expitideddata > 0 && len != expitideddata))
+                        {
+                            blockabort(0x05040001, out finished);
+                            break;
+                        }
+
+                        Array.Resize(ref databuffer, len);
+                        totaldata = (UInt32)len;
+
+                        if (blockcrc && crc16(databuffer, 0, len) != cp.u16(1))
+                        {
+                            blockabort(0x05040004, out finished);
+                            break;
+                        }
+
+                        sendpacketsegment(0xA1, new byte[0]);
+                        blockfinish(out finished);
+                    }
+                    break;
+            }
+
+            //Anything unexpected is most likely a duplicate of an earlier reply and is dropped,
+            //a server that has really lost its way is caught by the timeout
+            return true;
+        }
+
+        /// <summary>
+        /// Take the block size the server asked for, within what we offered
+        /// </summary>
+        private void setblksize(byte size)
+        {
+            if (size >= 1 && size <= 127)
+                blksize = size;
+        }
+
+        /// <summary>
+        /// Send the next download sub-block starting at blockstart
+        /// </summary>
+        private void sendblock()
+        {
+            UInt32 offset = blockstart;
+            byte seq = 0;
+
+            while (seq < blksize && offset < databuffer.Length)
+            {
+                seq++;
+
+                canframe p = new canframe();
+                p.cob = (UInt16)(0x600 + node);
+                p.len = 8;
+
+                for (int x = 0; x < 7 && offset < databuffer.Length; x++, offset++)
+                    p[1 + x] = databuffer[offset];
+
+                p[0] = (byte)(offset >= databuffer.Length ? seq | 0x80 : seq);
+
+                can.SendFrame(p);
+            }
+
+            blocksent = seq;
+            settimeout(true);
+        }
+
+        private void blockfinish(out bool finished)
+        {
+            phase = blockphase.NONE;
+            state = SDO_STATE.SDO_FINISHED;
+
+            if (completedcallback != null)
+                completedcallback(this);
+
+            finished = true;
+        }
+
+        /// <summary>
+        /// Abort the block transfer from our end
+        /// </summary>
+        private void blockabort(UInt32 code, out bool finished)
+        {
+            sendpacket(0x80, BitConverter.GetBytes(code));
+
+            phase = blockphase.NONE;
+            expitideddata = code;
+            databuffer = BitConverter.GetBytes(code);
+            state = SDO_STATE.SDO_ERROR;
+
+            Console.WriteLine("SDO Error on {0:x4}/{1:x2} {2:x8}", this.index, this.subindex, expitideddata);
+
+            if (completedcallback != null)
+                completedcallback(this);
+
+            finished = true;
+        }
+
+        static readonly UInt16[] crctable = makecrctable();
+
+        static UInt16[] makecrctable()
+        {
+            UInt16[] table = new UInt16[256];
+
+            for (int x = 0; x < 256; x++)
+            {
+                UInt16 c = (UInt16)(x << 8);
+                for (int b = 0; b < 8; b++)
+                    c = (c & 0x8000) != 0 ? (UInt16)((c << 1) ^ 0x1021) : (UInt16)(c << 1);
+                table[x] = c;
+            }
+
+            return table;
+        }
+
+        /// <summary>
+        /// CRC-16 CCITT (polynomial 0x1021, initial value 0) used to check block transfers
+        /// </summary>
+        internal static UInt16 crc16(byte[] data, int offset, int count)
+        {
+            UInt16 c = 0;
+
+            for (int x = offset; x < offset + count; x++)
+                c = (UInt16)((c << 8) ^ crctable[((c >> 8) ^ data[x]) & 0xFF]);
+
+            return c;
+        }
+
+    }
+
+    /// <summary>
+    /// SDO response time and timeout counters for one node, see libCanopenSimple.getSDOstats()
+    /// </summary>
+    public struct SDOnodestats
+    {
+        /// <summary>Smoothed round trip time of reads</summary>
+        public TimeSpan srtt;
+        /// <summary>Round trip time variation</summary>
+        public TimeSpan rttvar;
+        /// <summary>Timeout the next read request will get</summary>
+        public TimeSpan timeout;
+        /// <summary>Round trips measured</summary>
+        public int samples;
+        /// <summary>Requests that got no reply in time</summary>
+        public int timeouts;
+        /// <summary>Reads started again after a timeout</summary>
+        public int retries;
+    }
+
+    /// <summary>
+    /// Round trip time estimate of one node, smoothed the way TCP does it (RFC 6298), all times in ticks.
+    /// Only touched by the worker.
+    /// </summary>
+    internal class SDOrtt
+    {
+        public long srtt;
+        public long rttvar;
+        public long rto;    // 0 until the first sample
+        public int samples;
+        public int timeouts;
+        public int retries;
+
+        public void Sample(long r, long min, long max)
+        {
+            if (samples == 0)
+            {
+                srtt = r;
+                rttvar = r / 2;
+            }
+            else
+            {
+                rttvar = (3 * rttvar + Math.Abs(srtt - r)) / 4;
+                srtt = (7 * srtt + r) / 8;
+            }
+
+            samples++;
+            rto = Math.Min(Math.Max(srtt + Math.Max(TimeSpan.TicksPerMillisecond, 4 * rttvar), min), max);
+        }
+
+        /// <summary>
+        /// A request timed out, wait twice as long next time until a new sample says otherwise
+        /// </summary>
+        public void Backoff(long max)
+        {
+            timeouts++;
+            if (rto != 0)
+                rto = Math.Min(rto * 2, max);
+        }
+    }
+
+    /// <summary>
+    /// Min-heap of SDO response deadlines, so the next timeout is found without scanning every transfer.
+    /// Entries are not removed when a transfer finishes or its deadline moves, the owner skips stale ones
+    /// as they reach the top.
+    /// </summary>
+    internal class SDOdeadlines
+    {
+        struct entry
+        {
+            public long ticks;
+            public SDO sdo;
+        }
+
+        List<entry> heap = new List<entry>();
+
+        public int Count
+        {
+            get { return heap.Count; }
+        }
+
+        public void Push(SDO sdo)
+        {
+            entry e;
+            e.ticks = sdo.timeout.Ticks;
+            e.sdo = sdo;
+
+            heap.Add(e);
+
+            int x = heap.Count - 1;
+            while (x > 0)
+            {
+                int parent = (x - 1) / 2;
+                if (heap[parent].ticks <= e.ticks)
+                    break;
+                heap[x] = heap[parent];
+                x = parent;
+            }
+            heap[x] = e;
+        }
+
+        /// <summary>
+        /// Earliest entry, false if empty
+        /// </summary>
+        public bool Peek(out SDO sdo, out long ticks)
+        {
+            if (heap.Count == 0)
+            {
+                sdo = null;
+                ticks = long.MaxValue;
+                return false;
+            }
+
+            sdo = heap[0].sdo;
+            ticks = heap[0].ticks;
+            return true;
+        }
+
+        public void Pop()
+        {
+            int last = heap.Count - 1;
+            entry e = heap[last];
+            heap.RemoveAt(last);
+
+            if (last == 0)
+                return;
+
+            int x = 0;
+            while (true)
+            {
+                int child = 2 * x + 1;
+                if (child >= last)
+                    break;
+                if (child + 1 < last && heap[child + 1].ticks < heap[child].ticks)
+                    child++;
+                if (e.ticks <= heap[child].ticks)
+                    break;
+                heap[x] = heap[child];
+                x = child;
+            }
+            heap[x] = e;
+        }
+
+        public void Clear()
+        {
+            heap.Clear();
+        }
     }
 }
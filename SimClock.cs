@@ -0,0 +1,358 @@
+﻿/*
+    This file is part of libCanopenSimple.
+    libCanopenSimple is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    libCanopenSimple is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with libCanopenSimple.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright(c) 2017 Robin Cornelius <robin.cornelius@gmail.com>
+*/
+
+using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Threading;
+
+namespace libCanopenSimple
+{
+    /// <summary>
+    /// Time source for all library timers (SDO timeouts, heartbeat guarding and event time stamps)
+    /// Normally this is just the wall clock, in simulated mode time only moves when every participant
+    /// (the worker of each open libCanopenSimple, each driver receive thread and anyone in SimClock.Sleep())
+    /// is idle, at which point it jumps straight to the earliest deadline any of them is waiting for.
+    /// A driver receive thread is only idle once it has polled again after the last frame sent through it,
+    /// so a request on its way is never mistaken for a quiet bus. Drivers that can follow simulated time
+    /// (null) are handed it and report when their next frame is due, scenarios against them run as fast
+    /// as the frames can be processed and give the same result every run. Other drivers answer in real
+    /// time (a peer over nanomsg or shm, hardware) so time is also held until their bus has been quiet for
+    /// quiescence ms, results then only repeat as long as the peers answer within that window.
+    /// Real time is monotonic, it is the wall clock when the library was loaded plus Stopwatch elapsed
+    /// time, so guarding and timeouts are unaffected if the system clock is changed.
+    /// </summary>
+    public static class SimClock
+    {
+        /// <summary>
+        /// A thread that takes part in deciding when simulated time may move on
+        /// </summary>
+        public class Participant
+        {
+            internal bool idle = false;
+            internal DateTime deadline = DateTime.MaxValue;
+            internal Func<bool> haswork;
+            internal bool realtime;         // answers come from outside the simulation, needs a quiet period
+            internal long quietstamp;       // Stopwatch time until which a realtime participant still holds time back
+            internal int kickcount;
+
+            /// <summary>
+            /// Number of times other threads have handed this participant work, read it before
+            /// looking for work and pass it to Idle() so a hand over in between is not lost
+            /// </summary>
+            public int kicks
+            {
+                get { return Volatile.Read(ref kickcount); }
+            }
+        }
+
+        /// <summary>
+        /// Real time in ms the bus of a realtime participant must be quiet after a frame went either way
+        /// before simulated time moves on, long enough for a peer in another process to answer
+        /// </summary>
+        public static int quiescence = 20;
+
+        static readonly object sync = new object();
+        static List<Participant> participants = new List<Participant>();
+        static volatile bool simulating = false;
+        static volatile bool quietwait = false;
+        static long simticks;
+
+        // Real time anchor, Stopwatch ticks are converted to DateTime ticks relative to this
+        static readonly long anchorstamp = Stopwatch.GetTimestamp();
+        static readonly long anchorticks = DateTime.Now.Ticks;
+        static readonly double stamptoticks = (double)TimeSpan.TicksPerSecond / Stopwatch.Frequency;
+
+        /// <summary>
+        /// True when time is simulated rather than taken from the wall clock
+        /// </summary>
+        public static bool simulated
+        {
+            get { return simulating; }
+        }
+
+        /// <summary>
+        /// Current time, use this in place of DateTime.Now for anything that must follow simulated time
+        /// </summary>
+        public static DateTime Now
+        {
+            get
+            {
+                if (simulating)
+                    return new DateTime(Interlocked.Read(ref simticks));
+
+                return ToDateTime(Stopwatch.GetTimestamp());
+            }
+        }
+
+        /// <summary>
+        /// Current time in Stopwatch ticks, cheap enough to take once per received frame
+        /// </summary>
+        public static long Timestamp
+        {
+            get
+            {
+                if (simulating)
+                    return anchorstamp + (long)((Interlocked.Read(ref simticks) - anchorticks) / stamptoticks);
+
+                return Stopwatch.GetTimestamp();
+            }
+        }
+
+        /// <summary>
+        /// Convert a Timestamp to the time it represents
+        /// </summary>
+        /// <param name="stamp">Value previously read from Timestamp</param>
+        public static DateTime ToDateTime(long stamp)
+        {
+            return new DateTime(anchorticks + (long)((stamp - anchorstamp) * stamptoticks));
+        }
+
+        /// <summary>
+        /// Switch to simulated time, starting the clock at the given time
+        /// </summary>
+        /// <param name="start">Initial simulated time</param>
+        public static void Simulate(DateTime start)
+        {
+            lock (sync)
+            {
+                Interlocked.Exchange(ref simticks, start.Ticks);
+                simulating = true;
+                Monitor.PulseAll(sync);
+            }
+        }
+
+        /// <summary>
+        /// Return to wall clock time
+        /// </summary>
+        public static void RealTime()
+        {
+            lock (sync)
+            {
+                simulating = false;
+                Monitor.PulseAll(sync);
+            }
+        }
+
+        /// <summary>
+        /// Register a participant, simulated time will not move while it is busy
+        /// </summary>
+        /// <param name="haswork">Optional check run before time is advanced, return true if there is still work pending</param>
+        /// <param name="realtime">The participant waits on something that runs in real time, see quiescence</param>
+        /// <returns>Participant token</returns>
+        public static Participant Join(Func<bool> haswork = null, bool realtime = false)
+        {
+            Participant p = new Participant();
+            p.haswork = haswork;
+            p.realtime = realtime;
+
+            lock (sync)
+                participants.Add(p);
+
+            return p;
+        }
+
+        /// <summary>
+        /// Remove a participant
+        /// </summary>
+        public static void Leave(Participant p)
+        {
+            if (p == null)
+                return;
+
+            lock (sync)
+            {
+                participants.Remove(p);
+                advance();
+            }
+        }
+
+        /// <summary>
+        /// Mark a participant as having work in hand
+        /// </summary>
+        public static void Busy(Participant p)
+        {
+            if (!simulating)
+                return;
+
+            hold(p);
+
+            if (!p.idle)
+                return;
+
+            lock (sync)
+                p.idle = false;
+        }
+
+        /// <summary>
+        /// Hand a participant work from another thread, eg a frame sent through a driver, it stays busy
+        /// until it has looked again and called Idle()
+        /// </summary>
+        public static void Kick(Participant p)
+        {
+            if (!simulating)
+                return;
+
+            Interlocked.Increment(ref p.kickcount);
+            hold(p);
+
+            lock (sync)
+                p.idle = false;
+        }
+
+        /// <summary>
+        /// Mark a participant as idle until the given deadline without blocking
+        /// </summary>
+        public static void Idle(Participant p, DateTime deadline)
+        {
+            Idle(p, deadline, p.kicks);
+        }
+
+        /// <summary>
+        /// Mark a participant as idle until the given deadline without blocking, unless it has been kicked
+        /// </summary>
+        /// <param name="p">Participant token</param>
+        /// <param name="deadline">Time the participant next needs to run, DateTime.MaxValue if none</param>
+        /// <param name="kicks">Value of p.kicks read before the participant last looked for work</param>
+        public static void Idle(Participant p, DateTime deadline, int kicks)
+        {
+            if (!simulating || (p.idle && p.deadline == deadline && !quietwait))
+                return;
+
+            lock (sync)
+            {
+                if (p.kickcount != kicks)
+                    return;
+
+                p.idle = true;
+                p.deadline = deadline;
+                advance();
+            }
+        }
+
+        /// <summary>
+        /// Block an idle participant until its deadline is reached, it is woken by Wake() or realms of real time pass
+        /// </summary>
+        /// <param name="p">Participant token</param>
+        /// <param name="deadline">Time the participant next needs to run, DateTime.MaxValue if none</param>
+        /// <param name="realms">Real time limit on the wait in ms</param>
+        public static void Wait(Participant p, DateTime deadline, int realms)
+        {
+            lock (sync)
+            {
+                if (simulating && Now < deadline)
+                {
+                    p.idle = true;
+                    p.deadline = deadline;
+                    advance();
+
+                    if (Now < deadline)
+                        Monitor.Wait(sync, realms);
+                }
+
+                p.idle = false;
+            }
+        }
+
+        /// <summary>
+        /// Wake any waiting participants, call when new work has been handed to one of them
+        /// </summary>
+        public static void Wake()
+        {
+            if (!simulating)
+                return;
+
+            lock (sync)
+                Monitor.PulseAll(sync);
+        }
+
+        /// <summary>
+        /// Sleep that follows simulated time, test scenarios should use this rather than Thread.Sleep()
+        /// </summary>
+        /// <param name="span">Time to sleep for</param>
+        public static void Sleep(TimeSpan span)
+        {
+            if (!simulating)
+            {
+                Thread.Sleep(span);
+                return;
+            }
+
+            Participant p = Join();
+            DateTime deadline = Now + span;
+
+            while (simulating && Now < deadline)
+                Wait(p, deadline, 10);
+
+            Leave(p);
+        }
+
+        /// <summary>
+        /// Start the quiet period of a realtime participant over
+        /// </summary>
+        static void hold(Participant p)
+        {
+            if (p.realtime)
+                Volatile.Write(ref p.quietstamp, Stopwatch.GetTimestamp() + quiescence * Stopwatch.Frequency / 1000);
+        }
+
+        /// <summary>
+        /// Move simulated time on to the earliest deadline if every participant is idle, called with sync held
+        /// </summary>
+        static void advance()
+        {
+            if (!simulating || participants.Count == 0)
+                return;
+
+            DateTime next = DateTime.MaxValue;
+
+            foreach (Participant p in participants)
+            {
+                if (!p.idle)
+                    return;
+
+                if (p.deadline < next)
+                    next = p.deadline;
+            }
+
+            if (next == DateTime.MaxValue || next.Ticks <= Interlocked.Read(ref simticks))
+                return;
+
+            long stamp = Stopwatch.GetTimestamp();
+
+            foreach (Participant p in participants)
+            {
+                if (p.realtime && stamp < Volatile.Read(ref p.quietstamp))
+                {
+                    // idle callers retry until the window is over
+                    quietwait = true;
+                    return;
+                }
+            }
+
+            quietwait = false;
+
+            foreach (Participant p in participants)
+            {
+                if (p.haswork != null && p.haswork())
+                    return;
+            }
+
+            Interlocked.Exchange(ref simticks, next.Ticks);
+            Monitor.PulseAll(sync);
+        }
+    }
+}
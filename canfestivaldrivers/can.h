@@ -37,7 +37,7 @@ typedef struct {
   UNS8 data[8]; /**< message's datas */
 } Message;
 
-#define Message_Initializer {0,0,0,{0,0,0,0,0,0,0,0}}
+#define Message_Initializer {0,0,0,0,{0,0,0,0,0,0,0,0}}
 
 typedef UNS8 (*canSend_t)(Message *);
 
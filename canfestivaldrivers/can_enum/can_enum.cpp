@@ -0,0 +1,408 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "can_enum.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_arp.h>
+
+// kobject uevents straight from the kernel and the same events again once udev has run its rules
+#define UEVENT_KERNEL 1
+#define UEVENT_UDEV 2
+
+#define NETLINK_BUFFER 16384
+
+can_enum &can_enum::instance()
+   {
+   static can_enum e;
+   return e;
+   }
+
+can_enum::can_enum() : m_route(-1),
+      m_uevent(-1),
+      m_generation(0),
+      m_run(true)
+   {
+   m_wake[0] = m_wake[1] = -1;
+
+   // subscribe before the dump so no change can slip between the two
+   m_route = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+   if (m_route >= 0)
+      {
+      struct sockaddr_nl addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.nl_family = AF_NETLINK;
+      addr.nl_groups = RTMGRP_LINK;
+      if (bind(m_route, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+         {
+         ::close(m_route);
+         m_route = -1;
+         }
+      }
+
+   m_uevent = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+   if (m_uevent >= 0)
+      {
+      struct sockaddr_nl addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.nl_family = AF_NETLINK;
+      addr.nl_groups = UEVENT_KERNEL | UEVENT_UDEV;
+      if (bind(m_uevent, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+         {
+         ::close(m_uevent);
+         m_uevent = -1;
+         }
+      }
+
+   if (m_route >= 0 && !scan_links())
+      {
+      ::close(m_route);
+      m_route = -1;
+      }
+   scan_ttys();
+
+   if ((m_route >= 0 || m_uevent >= 0) && pipe2(m_wake, O_CLOEXEC) == 0)
+      m_watcher = std::thread(&can_enum::watch, this);
+   }
+
+can_enum::~can_enum()
+   {
+   if (m_watcher.joinable())
+      {
+      m_run.store(false);
+      char c = 0;
+      if (write(m_wake[1], &c, 1) < 0)
+         {
+         }
+      m_watcher.join();
+      }
+
+   if (m_wake[0] >= 0)
+      {
+      ::close(m_wake[0]);
+      ::close(m_wake[1]);
+      }
+   if (m_route >= 0)
+      ::close(m_route);
+   if (m_uevent >= 0)
+      ::close(m_uevent);
+   }
+
+std::vector<std::string> can_enum::interfaces()
+   {
+   std::map<int, std::string> links;
+
+   if (m_route >= 0)
+      {
+      std::lock_guard<std::mutex> l(m_lock);
+      links = m_links;
+      }
+   else
+      sysfs_links(links);
+
+   std::vector<std::string> names;
+   for (std::map<int, std::string>::const_iterator it = links.begin(); it != links.end(); ++it)
+      names.push_back(it->second);
+   return names;
+   }
+
+std::vector<std::string> can_enum::serial_ports()
+   {
+   if (m_uevent < 0)
+      scan_ttys();
+
+   std::lock_guard<std::mutex> l(m_lock);
+   return m_ttys;
+   }
+
+void can_enum::sysfs_links(std::map<int, std::string> &links)
+   {
+   DIR *d = opendir("/sys/class/net");
+   if (!d)
+      return;
+
+   struct dirent *e;
+   while ((e = readdir(d)) != NULL)
+      {
+      if (e->d_name[0] == '.')
+         continue;
+
+      std::string base = std::string("/sys/class/net/") + e->d_name;
+      int type = 0, index = 0;
+
+      FILE *fp = fopen((base + "/type").c_str(), "r");
+      if (!fp)
+         continue;
+      if (fscanf(fp, "%d", &type) != 1)
+         type = 0;
+      fclose(fp);
+
+      if (type != ARPHRD_CAN)
+         continue;
+
+      fp = fopen((base + "/ifindex").c_str(), "r");
+      if (fp)
+         {
+         if (fscanf(fp, "%d", &index) != 1)
+            index = 0;
+         fclose(fp);
+         }
+
+      links[index ? index : -(int)links.size() - 1] = e->d_name;
+      }
+
+   closedir(d);
+   }
+
+// RTM_GETLINK dump on a socket of its own, the replies are handled like link events
+bool can_enum::scan_links()
+   {
+   int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+   if (fd < 0)
+      return false;
+
+   struct
+      {
+      struct nlmsghdr nh;
+      struct ifinfomsg ifi;
+      } req;
+
+   memset(&req, 0, sizeof(req));
+   req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+   req.nh.nlmsg_type = RTM_GETLINK;
+   req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+   req.nh.nlmsg_seq = 1;
+   req.ifi.ifi_family = AF_UNSPEC;
+
+   if (send(fd, &req, req.nh.nlmsg_len, 0) < 0)
+      {
+      ::close(fd);
+      return false;
+      }
+
+   std::vector<UNS8> buf(NETLINK_BUFFER);
+   bool done = false, ok = true;
+
+   while (!done)
+      {
+      ssize_t n = recv(fd, &buf[0], buf.size(), 0);
+      if (n < 0)
+         {
+         if (errno == EINTR)
+            continue;
+         ok = false;
+         break;
+         }
+
+      int left = (int)n;
+      for (struct nlmsghdr *nh = (struct nlmsghdr *)&buf[0]; NLMSG_OK(nh, (unsigned)left); nh = NLMSG_NEXT(nh, left))
+         {
+         if (nh->nlmsg_type == NLMSG_DONE)
+            done = true;
+         else if (nh->nlmsg_type == NLMSG_ERROR)
+            {
+            done = true;
+            ok = false;
+            }
+         }
+
+      handle_route(&buf[0], (int)n);
+      }
+
+   ::close(fd);
+   return ok;
+   }
+
+void can_enum::handle_route(const UNS8 *buf, int len)
+   {
+   bool changed = false;
+   std::lock_guard<std::mutex> l(m_lock);
+
+   for (const struct nlmsghdr *nh = (const struct nlmsghdr *)buf; NLMSG_OK(nh, (unsigned)len); nh = NLMSG_NEXT(nh, len))
+      {
+      if (nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK)
+         continue;
+
+      const struct ifinfomsg *ifi = (const struct ifinfomsg *)NLMSG_DATA(nh);
+      if (ifi->ifi_type != ARPHRD_CAN)
+         continue;
+
+      if (nh->nlmsg_type == RTM_DELLINK)
+         {
+         changed |= m_links.erase(ifi->ifi_index) != 0;
+         continue;
+         }
+
+      int alen = (int)IFLA_PAYLOAD(nh);
+      for (const struct rtattr *a = IFLA_RTA(ifi); RTA_OK(a, alen); a = RTA_NEXT(a, alen))
+         {
+         if (a->rta_type != IFLA_IFNAME)
+            continue;
+
+         std::string name((const char *)RTA_DATA(a));
+         std::string &slot = m_links[ifi->ifi_index];
+         if (slot != name)
+            {
+            slot = name;   // new, or renamed
+            changed = true;
+            }
+         }
+      }
+
+   if (changed)
+      m_generation++;
+   }
+
+// USB serial ttys only, legacy and platform UARTs would need probing to tell if anything is there
+void can_enum::scan_ttys()
+   {
+   std::vector<std::string> ttys;
+   std::map<std::string, std::string> by_id;   // /dev/ttyXXX -> /dev/serial/by-id/...
+
+   DIR *d = opendir("/dev/serial/by-id");
+   if (d)
+      {
+      struct dirent *e;
+      while ((e = readdir(d)) != NULL)
+         {
+         if (e->d_name[0] == '.')
+            continue;
+
+         std::string link = std::string("/dev/serial/by-id/") + e->d_name;
+         char target[PATH_MAX];
+         if (realpath(link.c_str(), target))
+            by_id[target] = link;
+         }
+      closedir(d);
+      }
+
+   d = opendir("/sys/class/tty");
+   if (d)
+      {
+      struct dirent *e;
+      while ((e = readdir(d)) != NULL)
+         {
+         if (e->d_name[0] == '.')
+            continue;
+
+         std::string sub = std::string("/sys/class/tty/") + e->d_name + "/device/subsystem";
+         char target[PATH_MAX];
+         ssize_t n = readlink(sub.c_str(), target, sizeof(target) - 1);
+         if (n <= 0)
+            continue;
+         target[n] = 0;
+
+         const char *bus = strrchr(target, '/');
+         bus = bus ? bus + 1 : target;
+         if (strcmp(bus, "usb") != 0 && strcmp(bus, "usb-serial") != 0)
+            continue;
+
+         std::string dev = std::string("/dev/") + e->d_name;
+         std::map<std::string, std::string>::const_iterator it = by_id.find(dev);
+         ttys.push_back(it != by_id.end() ? it->second : dev);
+         }
+      closedir(d);
+      }
+
+   std::sort(ttys.begin(), ttys.end());
+
+   std::lock_guard<std::mutex> l(m_lock);
+   if (ttys != m_ttys)
+      {
+      m_ttys.swap(ttys);
+      m_generation++;
+      }
+   }
+
+// Kernel and udev messages both carry SUBSYSTEM=, udev's after a binary header
+void can_enum::handle_uevent(const char *buf, int len)
+   {
+   for (int pos = 0; pos < len; pos += (int)strnlen(buf + pos, len - pos) + 1)
+      {
+      if (strncmp(buf + pos, "SUBSYSTEM=tty", 14) == 0)
+         {
+         scan_ttys();
+         return;
+         }
+      }
+   }
+
+void can_enum::watch()
+   {
+   std::vector<UNS8> buf(NETLINK_BUFFER);
+
+   struct pollfd fds[3];
+   fds[0].fd = m_wake[0];
+   fds[1].fd = m_route;
+   fds[2].fd = m_uevent;
+   for (int x = 0; x < 3; x++)
+      fds[x].events = POLLIN;
+
+   while (m_run.load())
+      {
+      if (poll(fds, 3, -1) < 0)
+         {
+         if (errno == EINTR)
+            continue;
+         break;
+         }
+
+      if (fds[0].revents)
+         break;
+
+      if (fds[1].revents & POLLIN)
+         {
+         ssize_t n = recv(m_route, &buf[0], buf.size(), MSG_DONTWAIT);
+         if (n > 0)
+            handle_route(&buf[0], (int)n);
+         else if (n < 0 && errno == ENOBUFS)
+            {
+            // events were lost, start again from a fresh dump
+               {
+               std::lock_guard<std::mutex> l(m_lock);
+               m_links.clear();
+               }
+            scan_links();
+            }
+         }
+
+      if (fds[2].revents & POLLIN)
+         {
+         ssize_t n = recv(m_uevent, &buf[0], buf.size() - 1, MSG_DONTWAIT);
+         if (n > 0)
+            handle_uevent((const char *)&buf[0], (int)n);
+         else if (n < 0 && errno == ENOBUFS)
+            scan_ttys();
+         }
+      }
+   }
@@ -0,0 +1,96 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __can_enum_h__
+#define __can_enum_h__
+
+// Linux adapter enumeration for canEnumerate2_driver
+//
+// SocketCAN interfaces are listed over rtnetlink and USB serial ttys (SLCAN
+// adapters) from sysfs, named by their /dev/serial/by-id link when udev made
+// one. Both lists are built once, on first use, and then kept current by a
+// background thread listening for rtnetlink link and kobject uevent/udev
+// messages, so enumerating returns a copy of the cached lists straight away and
+// no serial port is ever opened to find out what it is. Where netlink isn't
+// available (some containers) every call falls back to a sysfs scan.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+extern "C" {
+#include "can_driver.h"
+}
+
+class can_enum
+   {
+   public:
+      /**
+       * @brief The process wide instance, the first call does the initial scan
+       */
+      static can_enum &instance();
+
+      /**
+       * @brief SocketCAN network interfaces (ARPHRD_CAN), eg can0 vcan0 slcan0
+       */
+      std::vector<std::string> interfaces();
+
+      /**
+       * @brief USB serial ttys, the /dev/serial/by-id path if there is one else /dev/ttyXXX
+       */
+      std::vector<std::string> serial_ports();
+
+      /**
+       * @brief Bumped every time either list changes
+       */
+      UNS32 generation() const { return m_generation.load(); }
+
+   private:
+      can_enum();
+      ~can_enum();
+
+      bool scan_links();
+      void scan_ttys();
+      void handle_route(const UNS8 *buf, int len);
+      void handle_uevent(const char *buf, int len);
+      void watch();
+
+      static void sysfs_links(std::map<int, std::string> &links);
+
+   private:
+      int m_route;
+      int m_uevent;
+      int m_wake[2];
+
+      std::mutex m_lock;
+      std::map<int, std::string> m_links;   // ifindex -> name
+      std::vector<std::string> m_ttys;
+      std::atomic<UNS32> m_generation;
+
+      std::atomic<bool> m_run;
+      std::thread m_watcher;
+   };
+
+#endif
@@ -0,0 +1,113 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __can_cap_h__
+#define __can_cap_h__
+
+#include "can_wire.h"
+
+/**
+ * @brief Indexed block capture format
+ *
+ * Frames are stored in blocks, each block starts with a small index giving
+ * its time range and which COB-IDs it holds, so a reader looking for one node
+ * or one time window only touches the blocks it needs. A directory of all
+ * blocks is written at the end of the file when the capture is closed, if the
+ * writer died first the reader rebuilds it by walking the block headers.
+ * Everything is little endian, timestamps are nanoseconds.
+ *
+ * File header (16 bytes)
+ *   0-3   magic    "CCAP"
+ *   4     version  CAN_CAP_VERSION
+ *   5-15  reserved, 0
+ *
+ * Block (CAN_CAP_BLOCK_HEADER bytes then size bytes of frames)
+ *   0-3   magic    "CBLK"
+ *   4     encoding CAN_CAP_ENC_xxx
+ *   5-7   reserved, 0
+ *   8-11  count    frames in the block
+ *   12-15 size     bytes of frame data following the header
+ *   16-23 first    earliest timestamp in the block
+ *   24-31 last     latest timestamp in the block
+ *   32-35 channels bit n set if channel n is present, channels above 31 set bit 31
+ *   36-39 reserved, 0
+ *   40-295 cobs    2048 bit presence map indexed by identifier & 0x7FF,
+ *                  29 bit identifiers are folded in on their low 11 bits
+ *
+ * CAN_CAP_ENC_RAW frames are can_wire.h frame records with timestamp, in the
+ * order they were captured (timestamps from several sources may interleave
+ * slightly, first/last are the min and max). CAN_CAP_ENC_COLUMNAR blocks are
+ * compressed as described in can_pack.h.
+ *
+ * Directory entry (32 bytes, one per block, in file order)
+ *   0-7   offset   file offset of the block header
+ *   8-11  count
+ *   12-15 size
+ *   16-23 first
+ *   24-31 last
+ *
+ * Trailer (24 bytes, the last bytes of the file)
+ *   0-7   offset   file offset of the directory
+ *   8-15  frames   total frames in the capture
+ *   16-19 blocks   directory entries
+ *   20-23 magic    "CIDX"
+ */
+
+#define CAN_CAP_VERSION 1
+
+#define CAN_CAP_FILE_HEADER 16
+#define CAN_CAP_BLOCK_HEADER 296
+#define CAN_CAP_DIR_ENTRY 32
+#define CAN_CAP_TRAILER 24
+
+#define CAN_CAP_BITMAP_OFFSET 40
+#define CAN_CAP_BITMAP_SIZE 256
+
+#define CAN_CAP_ENC_RAW 0
+#define CAN_CAP_ENC_COLUMNAR 1
+
+#define CAN_CAP_RECORD_SIZE (CAN_WIRE_FRAME_SIZE + CAN_WIRE_TS_SIZE)
+#define CAN_CAP_DEFAULT_BLOCK 4096
+
+CAN_WIRE_INLINE int can_cap_is_magic(const UNS8 *p, const char *magic)
+{
+  return memcmp(p, magic, 4) == 0;
+}
+
+CAN_WIRE_INLINE void can_cap_bitmap_set(UNS8 *map, UNS32 id)
+{
+  id &= 0x7FF;
+  map[id >> 3] |= (UNS8)(1 << (id & 7));
+}
+
+CAN_WIRE_INLINE int can_cap_bitmap_test(const UNS8 *map, UNS32 id)
+{
+  id &= 0x7FF;
+  return (map[id >> 3] >> (id & 7)) & 1;
+}
+
+CAN_WIRE_INLINE UNS32 can_cap_channel_bit(UNS8 channel)
+{
+  return 1UL << (channel > 31 ? 31 : channel);
+}
+
+#endif /* __can_cap_h__ */
@@ -0,0 +1,979 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "can_log.h"
+#include "can_pack.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// How far ahead of the cursor we ask the kernel to read
+#define PREFETCH_WINDOW (16 * 1024 * 1024)
+
+static int hexval(char c)
+   {
+   if (c >= '0' && c <= '9')
+      return c - '0';
+   if (c >= 'a' && c <= 'f')
+      return c - 'a' + 10;
+   if (c >= 'A' && c <= 'F')
+      return c - 'A' + 10;
+   return -1;
+   }
+
+static const char *skip_space(const char *p, const char *end)
+   {
+   while (p < end && (*p == ' ' || *p == '\t'))
+      p++;
+   return p;
+   }
+
+// Parse a hex number, returns the number of digits consumed
+static int parse_hex(const char *&p, const char *end, UNS32 &v)
+   {
+   int digits = 0;
+   v = 0;
+   while (p < end && hexval(*p) >= 0)
+      {
+      v = (v << 4) | (UNS32)hexval(*p++);
+      digits++;
+      }
+   return digits;
+   }
+
+// Parse a decimal number, returns the number of digits consumed
+static int parse_dec(const char *&p, const char *end, UNS32 &v)
+   {
+   int digits = 0;
+   v = 0;
+   while (p < end && *p >= '0' && *p <= '9')
+      {
+      v = v * 10 + (UNS32)(*p++ - '0');
+      digits++;
+      }
+   return digits;
+   }
+
+// Parse "seconds.fraction" into nanoseconds without going through a double
+static bool parse_time(const char *&p, const char *end, UNS64 &ns)
+   {
+   UNS64 sec = 0;
+   UNS64 frac = 0;
+   int digits = 0;
+
+   if (p >= end || *p < '0' || *p > '9')
+      return false;
+
+   while (p < end && *p >= '0' && *p <= '9')
+      sec = sec * 10 + (UNS64)(*p++ - '0');
+
+   if (p < end && *p == '.')
+      {
+      p++;
+      while (p < end && *p >= '0' && *p <= '9')
+         {
+         if (digits < 9)
+            {
+            frac = frac * 10 + (UNS64)(*p - '0');
+            digits++;
+            }
+         p++;
+         }
+      }
+
+   while (digits++ < 9)
+      frac *= 10;
+
+   ns = sec * 1000000000ULL + frac;
+   return true;
+   }
+
+can_log_reader::can_log_reader() : m_base(NULL),
+      m_size(0),
+      m_pos(0),
+      m_prefetched(0),
+      m_end(0),
+      m_fd(-1),
+      m_fmt(FMT_UNKNOWN),
+      m_batch_left(0),
+      m_batch_flags(0),
+      m_block(0),
+      m_block_end(0),
+      m_block_left(0),
+      m_block_packed(false),
+      m_have_pending(false),
+      m_filtered(false),
+      m_asc_dec(false)
+   {
+   memset(m_filter_map, 0, sizeof(m_filter_map));
+   }
+
+can_log_reader::~can_log_reader()
+   {
+   close();
+   }
+
+bool can_log_reader::open(const char *path)
+   {
+   close();
+
+   m_fd = ::open(path, O_RDONLY);
+   if (m_fd < 0)
+      {
+      fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+      return false;
+      }
+
+   struct stat st;
+   if (fstat(m_fd, &st) < 0 || st.st_size == 0)
+      {
+      fprintf(stderr, "%s: empty or unreadable capture\n", path);
+      close();
+      return false;
+      }
+
+   m_size = (std::size_t)st.st_size;
+
+   void *p = mmap(NULL, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+   if (p == MAP_FAILED)
+      {
+      fprintf(stderr, "mmap %s: %s\n", path, strerror(errno));
+      close();
+      return false;
+      }
+
+   m_base = reinterpret_cast<const UNS8*>(p);
+   madvise(p, m_size, MADV_SEQUENTIAL);
+
+   m_fmt = detect();
+   if (m_fmt == FMT_INDEXED && !load_directory())
+      scan_blocks();
+   rewind();
+
+   return m_fmt != FMT_UNKNOWN;
+   }
+
+void can_log_reader::close()
+   {
+   if (m_base)
+      munmap(const_cast<UNS8*>(m_base), m_size);
+
+   if (m_fd >= 0)
+      ::close(m_fd);
+
+   m_base = NULL;
+   m_size = 0;
+   m_fd = -1;
+   m_fmt = FMT_UNKNOWN;
+   m_asc_dec = false;
+   m_blocks.clear();
+   m_latest.clear();
+   }
+
+void can_log_reader::rewind()
+   {
+   m_pos = 0;
+   m_end = m_size;
+   m_prefetched = 0;
+   m_batch_left = 0;
+   m_block = 0;
+   m_block_end = m_blocks.size();
+   m_block_left = 0;
+   m_have_pending = false;
+   prefetch();
+   }
+
+void can_log_reader::split(std::size_t parts, std::vector<std::size_t> &starts) const
+   {
+   starts.clear();
+
+   if (m_size == 0 || parts == 0)
+      return;
+
+   if (m_fmt == FMT_INDEXED)
+      {
+      for (std::size_t k = 0; k < parts; k++)
+         {
+         std::size_t b = k * m_blocks.size() / parts;
+         if (b < m_blocks.size() && (starts.empty() || starts.back() != m_blocks[b].offset))
+            starts.push_back((std::size_t)m_blocks[b].offset);
+         }
+      return;
+      }
+
+   if (m_fmt == FMT_BINARY)
+      {
+      // batches can't be found from an arbitrary offset, hop along the headers instead
+      std::size_t pos = 0;
+      std::size_t k = 0;
+      UNS8 flags;
+
+      while (pos + CAN_WIRE_HEADER_SIZE <= m_size && k < parts)
+         {
+         int count = can_wire_check(m_base + pos, (int)(m_size - pos), &flags);
+         if (count < 0)
+            break;
+
+         if (pos >= k * m_size / parts)
+            {
+            starts.push_back(pos);
+            k++;
+            }
+
+         pos += CAN_WIRE_HEADER_SIZE + (std::size_t)count * can_wire_record_size(flags);
+         }
+      return;
+      }
+
+   // text, each piece starts at the first line beginning at or after its share
+   for (std::size_t k = 0; k < parts; k++)
+      {
+      std::size_t pos = k * m_size / parts;
+      if (pos > 0)
+         {
+         const void *nl = memchr(m_base + pos - 1, '\n', m_size - pos + 1);
+         if (nl == NULL)
+            break;
+         pos = (std::size_t)(static_cast<const UNS8*>(nl) - m_base) + 1;
+         }
+
+      if (pos < m_size && (starts.empty() || starts.back() != pos))
+         starts.push_back(pos);
+      }
+   }
+
+void can_log_reader::range(std::size_t begin, std::size_t end)
+   {
+   rewind();
+
+   if (end > m_size)
+      end = m_size;
+
+   if (m_fmt == FMT_INDEXED)
+      {
+      while (m_block < m_blocks.size() && m_blocks[m_block].offset < begin)
+         m_block++;
+
+      m_block_end = m_block;
+      while (m_block_end < m_blocks.size() && m_blocks[m_block_end].offset < end)
+         m_block_end++;
+      }
+
+   m_pos = begin;
+   m_end = end;
+   prefetch();
+   }
+
+bool can_log_reader::seek(UNS64 timestamp)
+   {
+   if (m_fmt == FMT_INDEXED)
+      {
+      // every block before the first whose running max reaches timestamp is entirely earlier
+      std::size_t i = (std::size_t)(std::lower_bound(m_latest.begin(), m_latest.end(), timestamp) - m_latest.begin());
+      if (!seek_block(i))
+         return false;
+      }
+   else
+      {
+      rewind();
+      }
+
+   can_wire_frame f;
+   while (next_frame(&f))
+      {
+      if (f.timestamp >= timestamp)
+         {
+         m_pending = f;
+         m_have_pending = true;
+         return true;
+         }
+      }
+
+   return false;
+   }
+
+bool can_log_reader::seek_block(std::size_t i)
+   {
+   m_have_pending = false;
+   m_block_left = 0;
+
+   if (i >= m_blocks.size())
+      {
+      m_block = m_blocks.size();
+      return false;
+      }
+
+   m_block = i;
+   m_pos = (std::size_t)m_blocks[i].offset;
+   m_prefetched = 0;
+   prefetch();
+   return true;
+   }
+
+void can_log_reader::filter(UNS32 id)
+   {
+   id &= CAN_WIRE_ID_MASK;
+   m_filtered = true;
+   can_cap_bitmap_set(m_filter_map, id);
+   if (id > 0x7FF)
+      m_filter_ids.push_back(id);
+   }
+
+void can_log_reader::clear_filter()
+   {
+   m_filtered = false;
+   memset(m_filter_map, 0, sizeof(m_filter_map));
+   m_filter_ids.clear();
+   }
+
+bool can_log_reader::matches(const can_wire_frame *f) const
+   {
+   if (!m_filtered)
+      return true;
+
+   if (!can_cap_bitmap_test(m_filter_map, f->id))
+      return false;
+
+   UNS32 id = f->id & CAN_WIRE_ID_MASK;
+   if (id <= 0x7FF)
+      return true;
+
+   return std::find(m_filter_ids.begin(), m_filter_ids.end(), id) != m_filter_ids.end();
+   }
+
+bool can_log_reader::block_matches(const can_cap_block &b) const
+   {
+   if (!m_filtered)
+      return true;
+
+   const UNS8 *map = m_base + b.offset + CAN_CAP_BITMAP_OFFSET;
+   for (int x = 0; x < CAN_CAP_BITMAP_SIZE; x++)
+      {
+      if (map[x] & m_filter_map[x])
+         return true;
+      }
+
+   return false;
+   }
+
+// A raw block must hold the frames it claims, the other encodings are checked as they are unpacked
+static bool block_fits(const UNS8 *header, const can_cap_block &b)
+   {
+   return header[4] != CAN_CAP_ENC_RAW || (UNS64)b.count * CAN_CAP_RECORD_SIZE <= b.size;
+   }
+
+// Read the directory from the trailer, false if it is missing or doesn't add up
+bool can_log_reader::load_directory()
+   {
+   m_blocks.clear();
+
+   if (m_size < CAN_CAP_FILE_HEADER + CAN_CAP_TRAILER)
+      return false;
+
+   const UNS8 *t = m_base + m_size - CAN_CAP_TRAILER;
+   if (!can_cap_is_magic(t + 20, "CIDX"))
+      return false;
+
+   UNS64 dir = can_wire_get64(t);
+   UNS32 n = can_wire_get32(t + 16);
+   if (dir + (UNS64)n * CAN_CAP_DIR_ENTRY + CAN_CAP_TRAILER != m_size)
+      return false;
+
+   m_blocks.resize(n);
+   for (UNS32 x = 0; x < n; x++)
+      {
+      const UNS8 *e = m_base + dir + (UNS64)x * CAN_CAP_DIR_ENTRY;
+      can_cap_block &b = m_blocks[x];
+
+      b.offset = can_wire_get64(e);
+      b.count = can_wire_get32(e + 8);
+      b.size = can_wire_get32(e + 12);
+      b.first = can_wire_get64(e + 16);
+      b.last = can_wire_get64(e + 24);
+
+      if (b.offset + CAN_CAP_BLOCK_HEADER + b.size > dir || !can_cap_is_magic(m_base + b.offset, "CBLK") ||
+            !block_fits(m_base + b.offset, b))
+         {
+         m_blocks.clear();
+         return false;
+         }
+      }
+
+   index_blocks();
+   return true;
+   }
+
+// No usable directory, the writer didn't get to close the capture. Walk the block headers instead
+void can_log_reader::scan_blocks()
+   {
+   std::size_t pos = CAN_CAP_FILE_HEADER;
+
+   m_blocks.clear();
+
+   while (pos + CAN_CAP_BLOCK_HEADER <= m_size && can_cap_is_magic(m_base + pos, "CBLK"))
+      {
+      const UNS8 *h = m_base + pos;
+      can_cap_block b;
+
+      b.offset = pos;
+      b.count = can_wire_get32(h + 8);
+      b.size = can_wire_get32(h + 12);
+      b.first = can_wire_get64(h + 16);
+      b.last = can_wire_get64(h + 24);
+
+      if (pos + CAN_CAP_BLOCK_HEADER + b.size > m_size)
+         break; // block cut short by the crash
+
+      if (!block_fits(h, b))
+         break; // header is garbage, nothing after it can be trusted
+
+      m_blocks.push_back(b);
+      pos += CAN_CAP_BLOCK_HEADER + b.size;
+      }
+
+   fprintf(stderr, "capture has no index, recovered %u blocks\n", (unsigned)m_blocks.size());
+   index_blocks();
+   }
+
+void can_log_reader::index_blocks()
+   {
+   UNS64 latest = 0;
+
+   m_latest.resize(m_blocks.size());
+   for (std::size_t x = 0; x < m_blocks.size(); x++)
+      {
+      if (m_blocks[x].last > latest)
+         latest = m_blocks[x].last;
+      m_latest[x] = latest;
+      }
+   }
+
+can_log_reader::format can_log_reader::detect()
+   {
+   if (CAN_WIRE_IS_BATCH(m_base[0]))
+      return FMT_BINARY;
+
+   if (m_size >= CAN_CAP_FILE_HEADER && can_cap_is_magic(m_base, "CCAP"))
+      return FMT_INDEXED;
+
+   // skip ASC headers ("date ...", "base hex ...") and blank lines, the first
+   // frame line tells us which text format this is
+   const char *p = reinterpret_cast<const char*>(m_base);
+   const char *end = p + (m_size < 65536 ? m_size : 65536);
+
+   while (p < end)
+      {
+      const char *line = skip_space(p, end);
+
+      // ids and data bytes are hex unless the header says otherwise
+      if (end - line > 5 && strncmp(line, "base ", 5) == 0)
+         {
+         const char *base = skip_space(line + 5, end);
+         m_asc_dec = end - base >= 3 && strncmp(base, "dec", 3) == 0;
+         }
+
+      if (line < end && *line == '(')
+         return FMT_CANDUMP;
+
+      if (line < end && *line >= '0' && *line <= '9')
+         return FMT_ASC;
+
+      while (p < end && *p != '\n')
+         p++;
+      p++;
+      }
+
+   return FMT_UNKNOWN;
+   }
+
+// Keep the kernel reading ahead of us, only asks again once we are half way through the last window
+void can_log_reader::prefetch()
+   {
+   if (m_pos + PREFETCH_WINDOW / 2 < m_prefetched || m_prefetched >= m_size)
+      return;
+
+   long pagesize = sysconf(_SC_PAGESIZE);
+   std::size_t start = m_pos & ~(std::size_t)(pagesize - 1);
+   std::size_t len = PREFETCH_WINDOW;
+   if (start + len > m_size)
+      len = m_size - start;
+
+   madvise(const_cast<UNS8*>(m_base) + start, len, MADV_WILLNEED);
+   m_prefetched = start + len;
+   }
+
+bool can_log_reader::next_line(const char *&line, const char *&end)
+   {
+   if (m_pos >= m_end)
+      return false;
+
+   line = reinterpret_cast<const char*>(m_base) + m_pos;
+   const char *eof = reinterpret_cast<const char*>(m_base) + m_size;
+   const char *nl = static_cast<const char*>(memchr(line, '\n', (std::size_t)(eof - line)));
+
+   end = nl ? nl : eof;
+   m_pos = (std::size_t)(end - reinterpret_cast<const char*>(m_base)) + 1;
+
+   if (end > line && end[-1] == '\r')
+      end--;
+
+   return true;
+   }
+
+bool can_log_reader::next(can_wire_frame *f)
+   {
+   if (m_have_pending)
+      {
+      m_have_pending = false;
+      *f = m_pending;
+      if (matches(f))
+         return true;
+      }
+
+   while (next_frame(f))
+      {
+      if (matches(f))
+         return true;
+      }
+
+   return false;
+   }
+
+bool can_log_reader::next_frame(can_wire_frame *f)
+   {
+   prefetch();
+
+   switch (m_fmt)
+      {
+      case FMT_CANDUMP:
+         return next_candump(f);
+      case FMT_ASC:
+         return next_asc(f);
+      case FMT_BINARY:
+         return next_binary(f);
+      case FMT_INDEXED:
+         return next_indexed(f);
+      default:
+         return false;
+      }
+   }
+
+// (1436509052.249713) can0 181#0102030405060708
+// (1436509052.249713) can0 12345678#R
+bool can_log_reader::next_candump(can_wire_frame *f)
+   {
+   const char *p, *end;
+
+   while (next_line(p, end))
+      {
+      p = skip_space(p, end);
+      if (p >= end || *p != '(')
+         continue;
+      p++;
+
+      if (!parse_time(p, end, f->timestamp) || p >= end || *p != ')')
+         continue;
+      p = skip_space(p + 1, end);
+
+      // interface name, channel number is taken from any trailing digits
+      UNS32 channel = 0;
+      while (p < end && *p != ' ' && *p != '\t')
+         {
+         channel = (*p >= '0' && *p <= '9') ? channel * 10 + (UNS32)(*p - '0') : 0;
+         p++;
+         }
+      p = skip_space(p, end);
+
+      UNS32 id;
+      int digits = parse_hex(p, end, id);
+      if (digits == 0 || p >= end || *p != '#')
+         continue;
+      p++;
+
+      if (p < end && *p == '#')
+         continue; // CAN FD, not something we can replay
+
+      f->id = id | (digits > 3 ? CAN_WIRE_ID_EXT : 0);
+      f->channel = (UNS8)channel;
+      f->len = 0;
+      memset(f->data, 0, 8);
+
+      if (p < end && *p == 'R')
+         {
+         f->id |= CAN_WIRE_ID_RTR;
+         if (p + 1 < end && p[1] >= '0' && p[1] <= '8')
+            f->len = (UNS8)(p[1] - '0');
+         return true;
+         }
+
+      while (f->len < 8 && p + 1 < end && hexval(p[0]) >= 0 && hexval(p[1]) >= 0)
+         {
+         f->data[f->len++] = (UNS8)((hexval(p[0]) << 4) | hexval(p[1]));
+         p += 2;
+         if (p < end && *p == '.')
+            p++;
+         }
+
+      return true;
+      }
+
+   return false;
+   }
+
+//    0.001234 1  181             Rx   d 8 01 02 03 04 05 06 07 08
+//    0.002000 1  12345678x       Rx   r
+bool can_log_reader::next_asc(can_wire_frame *f)
+   {
+   const char *p, *end;
+
+   while (next_line(p, end))
+      {
+      p = skip_space(p, end);
+
+      if (!parse_time(p, end, f->timestamp))
+         continue;
+      p = skip_space(p, end);
+
+      // the channel is always decimal, "base" only covers ids and data
+      UNS32 channel;
+      if (parse_dec(p, end, channel) == 0)
+         continue;
+      p = skip_space(p, end);
+
+      UNS32 id;
+      if ((m_asc_dec ? parse_dec(p, end, id) : parse_hex(p, end, id)) == 0)
+         continue; // error frames, statistics and other events
+
+      f->id = id;
+      if (p < end && *p == 'x')
+         {
+         f->id |= CAN_WIRE_ID_EXT;
+         p++;
+         }
+
+      if (p >= end || (*p != ' ' && *p != '\t'))
+         continue; // a word that happened to start with hex digits, eg ErrorFrame
+      p = skip_space(p, end);
+
+      // direction
+      while (p < end && *p != ' ' && *p != '\t')
+         p++;
+      p = skip_space(p, end);
+
+      f->channel = (UNS8)channel;
+      f->len = 0;
+      memset(f->data, 0, 8);
+
+      if (p < end && *p == 'r')
+         {
+         f->id |= CAN_WIRE_ID_RTR;
+         return true;
+         }
+
+      if (p >= end || *p != 'd')
+         continue;
+      p = skip_space(p + 1, end);
+
+      UNS32 dlc;
+      parse_dec(p, end, dlc);
+      if (dlc > 8)
+         dlc = 8;
+
+      for (UNS32 x = 0; x < dlc; x++)
+         {
+         UNS32 b;
+         p = skip_space(p, end);
+         if ((m_asc_dec ? parse_dec(p, end, b) : parse_hex(p, end, b)) == 0)
+            break;
+         f->data[f->len++] = (UNS8)b;
+         }
+
+      return true;
+      }
+
+   return false;
+   }
+
+bool can_log_reader::next_binary(can_wire_frame *f)
+   {
+   while (m_batch_left == 0)
+      {
+      if (m_pos >= m_end || m_pos + CAN_WIRE_HEADER_SIZE > m_size)
+         return false;
+
+      int count = can_wire_check(m_base + m_pos, (int)(m_size - m_pos), &m_batch_flags);
+      if (count < 0)
+         return false; // truncated or corrupt tail, stop here
+
+      m_pos += CAN_WIRE_HEADER_SIZE;
+      m_batch_left = count;
+      }
+
+   m_pos += (std::size_t)can_wire_get_frame(m_base + m_pos, f, m_batch_flags);
+   m_batch_left--;
+
+   return true;
+   }
+
+bool can_log_reader::next_indexed(can_wire_frame *f)
+   {
+   while (m_block_left == 0)
+      {
+      if (m_block >= m_block_end)
+         return false;
+
+      const can_cap_block &b = m_blocks[m_block++];
+
+      // blocks without any frame we are filtering for are never touched
+      if (!block_matches(b))
+         continue;
+
+      m_pos = (std::size_t)b.offset + CAN_CAP_BLOCK_HEADER;
+      prefetch();
+
+      m_block_packed = m_base[b.offset + 4] != CAN_CAP_ENC_RAW;
+      if (m_block_packed && !read_block(m_block - 1, m_unpacked))
+         continue;
+
+      m_block_left = b.count;
+      }
+
+   if (m_block_packed)
+      {
+      *f = m_unpacked[m_unpacked.size() - m_block_left];
+      }
+   else
+      {
+      m_pos += (std::size_t)can_wire_get_frame(m_base + m_pos, f, CAN_WIRE_F_TIMESTAMP);
+      }
+   m_block_left--;
+
+   return true;
+   }
+
+bool can_log_reader::read_block(std::size_t i, std::vector<can_wire_frame> &frames) const
+   {
+   if (i >= m_blocks.size())
+      return false;
+
+   const can_cap_block &b = m_blocks[i];
+   const UNS8 *p = m_base + b.offset + CAN_CAP_BLOCK_HEADER;
+
+   frames.resize(b.count);
+
+   switch (m_base[b.offset + 4])
+      {
+      case CAN_CAP_ENC_RAW:
+         if ((UNS64)b.count * CAN_CAP_RECORD_SIZE > b.size)
+            return false;
+         for (UNS32 x = 0; x < b.count; x++)
+            p += can_wire_get_frame(p, &frames[x], CAN_WIRE_F_TIMESTAMP);
+         return true;
+
+      case CAN_CAP_ENC_COLUMNAR:
+         if (can_unpack_block(p, b.size, b.count, b.count ? &frames[0] : NULL))
+            return true;
+         fprintf(stderr, "capture block at %llu is corrupt\n", (unsigned long long)b.offset);
+         return false;
+
+      default:
+         return false;
+      }
+   }
+
+//------------------------------------------------------------------------
+can_cap_writer::can_cap_writer() : m_fd(-1),
+      m_block_frames(CAN_CAP_DEFAULT_BLOCK),
+      m_encoding(CAN_CAP_ENC_RAW),
+      m_offset(0),
+      m_frames(0),
+      m_channels(0)
+   {
+   }
+
+can_cap_writer::~can_cap_writer()
+   {
+   close();
+   }
+
+bool can_cap_writer::open(const char *path, UNS32 block_frames, UNS8 encoding)
+   {
+   close();
+
+   m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (m_fd < 0)
+      {
+      fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+      return false;
+      }
+
+   m_path = path;
+   m_block_frames = block_frames ? block_frames : CAN_CAP_DEFAULT_BLOCK;
+   m_encoding = encoding;
+   m_frames = 0;
+   m_dir.clear();
+   m_buf.reserve(CAN_CAP_BLOCK_HEADER + (std::size_t)m_block_frames * CAN_CAP_RECORD_SIZE);
+   m_pending.reserve(m_block_frames);
+
+   UNS8 hdr[CAN_CAP_FILE_HEADER];
+   memset(hdr, 0, sizeof(hdr));
+   memcpy(hdr, "CCAP", 4);
+   hdr[4] = CAN_CAP_VERSION;
+
+   if (!write_all(hdr, sizeof(hdr)))
+      return false;
+
+   m_offset = CAN_CAP_FILE_HEADER;
+   start_block();
+   return true;
+   }
+
+void can_cap_writer::start_block()
+   {
+   m_buf.assign(CAN_CAP_BLOCK_HEADER, 0);
+   m_pending.clear();
+   m_cur.offset = m_offset;
+   m_cur.count = 0;
+   m_cur.size = 0;
+   m_cur.first = ~(UNS64)0;
+   m_cur.last = 0;
+   m_channels = 0;
+   }
+
+bool can_cap_writer::add(const can_wire_frame *f)
+   {
+   if (m_fd < 0)
+      return false;
+
+   m_pending.push_back(*f);
+
+   can_cap_bitmap_set(&m_buf[CAN_CAP_BITMAP_OFFSET], f->id);
+   m_channels |= can_cap_channel_bit(f->channel);
+   if (f->timestamp < m_cur.first)
+      m_cur.first = f->timestamp;
+   if (f->timestamp > m_cur.last)
+      m_cur.last = f->timestamp;
+
+   if (++m_cur.count >= m_block_frames)
+      return flush();
+
+   return true;
+   }
+
+bool can_cap_writer::flush()
+   {
+   if (m_fd < 0)
+      return false;
+
+   if (m_cur.count == 0)
+      return true;
+
+   if (m_encoding == CAN_CAP_ENC_COLUMNAR)
+      {
+      can_pack_block(&m_pending[0], m_cur.count, m_buf);
+      }
+   else
+      {
+      m_buf.resize(CAN_CAP_BLOCK_HEADER + (std::size_t)m_cur.count * CAN_CAP_RECORD_SIZE);
+      UNS8 *p = &m_buf[CAN_CAP_BLOCK_HEADER];
+      for (UNS32 x = 0; x < m_cur.count; x++)
+         p += can_wire_put_frame(p, &m_pending[x], CAN_WIRE_F_TIMESTAMP);
+      }
+
+   UNS8 *h = &m_buf[0];
+   m_cur.size = (UNS32)(m_buf.size() - CAN_CAP_BLOCK_HEADER);
+
+   memcpy(h, "CBLK", 4);
+   h[4] = m_encoding;
+   can_wire_put32(h + 8, m_cur.count);
+   can_wire_put32(h + 12, m_cur.size);
+   can_wire_put64(h + 16, m_cur.first);
+   can_wire_put64(h + 24, m_cur.last);
+   can_wire_put32(h + 32, m_channels);
+
+   bool ok = write_all(h, m_buf.size());
+
+   m_dir.push_back(m_cur);
+   m_offset += m_buf.size();
+   m_frames += m_cur.count;
+   start_block();
+
+   return ok;
+   }
+
+bool can_cap_writer::close()
+   {
+   if (m_fd < 0)
+      return true;
+
+   bool ok = flush();
+
+   std::vector<UNS8> dir(m_dir.size() * CAN_CAP_DIR_ENTRY + CAN_CAP_TRAILER);
+   UNS8 *p = &dir[0];
+
+   for (std::size_t x = 0; x < m_dir.size(); x++, p += CAN_CAP_DIR_ENTRY)
+      {
+      can_wire_put64(p, m_dir[x].offset);
+      can_wire_put32(p + 8, m_dir[x].count);
+      can_wire_put32(p + 12, m_dir[x].size);
+      can_wire_put64(p + 16, m_dir[x].first);
+      can_wire_put64(p + 24, m_dir[x].last);
+      }
+
+   can_wire_put64(p, m_offset);
+   can_wire_put64(p + 8, m_frames);
+   can_wire_put32(p + 16, (UNS32)m_dir.size());
+   memcpy(p + 20, "CIDX", 4);
+
+   ok = write_all(&dir[0], dir.size()) && ok;
+
+   ::close(m_fd);
+   m_fd = -1;
+   m_dir.clear();
+
+   return ok;
+   }
+
+bool can_cap_writer::write_all(const UNS8 *p, std::size_t len)
+   {
+   std::size_t done = 0;
+
+   while (done < len)
+      {
+      ssize_t n = ::write(m_fd, p + done, len - done);
+      if (n < 0)
+         {
+         if (errno == EINTR)
+            continue;
+         fprintf(stderr, "write %s: %s\n", m_path.c_str(), strerror(errno));
+         return false;
+         }
+      done += (std::size_t)n;
+      }
+
+   return true;
+   }
@@ -0,0 +1,216 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __can_log_h__
+#define __can_log_h__
+
+// Bus capture reading and writing, shared by the drivers and the offline tools.
+//
+// Captures are mapped rather than read so multi gigabyte files open instantly,
+// the reader asks the kernel to fault in a window ahead of the cursor as it goes.
+//
+// Supported formats, detected from the file contents
+//   candump   "(1436509052.249713) can0 181#0102030405060708" (-L log format)
+//   asc       Vector ASCII, "   0.001234 1  181             Rx   d 8 01 02 03 04 05 06 07 08"
+//   binary    can_wire.h batches with CAN_WIRE_F_TIMESTAMP set, as written by the tee driver
+//   indexed   can_cap.h blocks, seek() and filter() skip whole blocks using the block index,
+//             blocks may be raw records or compressed columns (can_pack.h)
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "can_driver.h"
+#include "can_wire.h"
+#include "can_cap.h"
+}
+
+/**
+ * @brief One block of an indexed capture, as listed in the directory
+ */
+struct can_cap_block
+   {
+   UNS64 offset;
+   UNS32 count;
+   UNS32 size;
+   UNS64 first;
+   UNS64 last;
+   };
+
+class can_log_reader
+   {
+   public:
+      enum format
+         {
+         FMT_UNKNOWN,
+         FMT_CANDUMP,
+         FMT_ASC,
+         FMT_BINARY,
+         FMT_INDEXED,
+         };
+
+	  can_log_reader();
+	  ~can_log_reader();
+
+      bool open(const char *path);
+      void close();
+
+      /**
+       * @brief Read the next frame, timestamps are in nanoseconds
+       * @return false at the end of the capture
+       */
+      bool next(can_wire_frame *f);
+
+      void rewind();
+
+      /**
+       * @brief Position so the next frame read is the first at or after timestamp
+       * @return false if there is no such frame
+       */
+      bool seek(UNS64 timestamp);
+
+      /**
+       * @brief Split the capture into up to parts pieces that can be read independently
+       * @param starts receives the offset of each piece, a piece runs to the start of the next or size()
+       */
+      void split(std::size_t parts, std::vector<std::size_t> &starts) const;
+
+      /**
+       * @brief Rewind and only read records starting in [begin, end), offsets must come from split()
+       */
+      void range(std::size_t begin, std::size_t end);
+
+      /**
+       * @brief Only return frames with this identifier, may be called several times to add more
+       */
+      void filter(UNS32 id);
+      void clear_filter();
+
+      // Block directory of indexed captures, empty for other formats
+      std::size_t blocks() const { return m_blocks.size(); }
+      const can_cap_block &block(std::size_t i) const { return m_blocks[i]; }
+      bool seek_block(std::size_t i);
+
+      /**
+       * @brief Decode every frame of one block, safe to call from several threads at once
+       */
+      bool read_block(std::size_t i, std::vector<can_wire_frame> &frames) const;
+
+      format fmt() const { return m_fmt; }
+      const UNS8 *data() const { return m_base; }
+      std::size_t size() const { return m_size; }
+      std::size_t position() const { return m_pos; }
+
+   private:
+      bool next_candump(can_wire_frame *f);
+      bool next_asc(can_wire_frame *f);
+      bool next_binary(can_wire_frame *f);
+      bool next_indexed(can_wire_frame *f);
+      bool next_frame(can_wire_frame *f);
+      bool matches(const can_wire_frame *f) const;
+      bool block_matches(const can_cap_block &b) const;
+      bool load_directory();
+      void scan_blocks();
+      void index_blocks();
+      bool next_line(const char *&line, const char *&end);
+      void prefetch();
+      format detect();
+
+   private:
+      const UNS8 *m_base;
+      std::size_t m_size;
+      std::size_t m_pos;
+      std::size_t m_prefetched;
+      std::size_t m_end;
+      int m_fd;
+      format m_fmt;
+
+      // binary batch state
+      int m_batch_left;
+      UNS8 m_batch_flags;
+
+      // indexed capture state
+      std::vector<can_cap_block> m_blocks;
+      std::vector<UNS64> m_latest;    // running max of block last timestamps, for seek()
+      std::size_t m_block;
+      std::size_t m_block_end;
+      UNS32 m_block_left;
+      std::vector<can_wire_frame> m_unpacked;   // current block if it is compressed
+      bool m_block_packed;
+
+      // frame read ahead by seek()
+      bool m_have_pending;
+      can_wire_frame m_pending;
+
+      bool m_filtered;
+      UNS8 m_filter_map[CAN_CAP_BITMAP_SIZE];
+      std::vector<UNS32> m_filter_ids;
+
+      bool m_asc_dec;   // ASC "base dec" header, ids and data bytes are decimal
+   };
+
+/**
+ * @brief Writes indexed block captures (can_cap.h)
+ *
+ * Frames are collected into a block in memory and written out with one write
+ * when the block is full or flush() is called. The directory and trailer are
+ * written by close(), a capture that was never closed can still be read.
+ */
+class can_cap_writer
+   {
+   public:
+      can_cap_writer();
+      ~can_cap_writer();
+
+      bool open(const char *path, UNS32 block_frames = CAN_CAP_DEFAULT_BLOCK, UNS8 encoding = CAN_CAP_ENC_RAW);
+      bool close();
+
+      bool add(const can_wire_frame *f);
+
+      /**
+       * @brief Write out the current block even if it is not full
+       */
+      bool flush();
+
+      UNS64 frames() const { return m_frames; }
+
+   private:
+      void start_block();
+      bool write_all(const UNS8 *p, std::size_t len);
+
+   private:
+      int m_fd;
+      std::string m_path;
+      UNS32 m_block_frames;
+      UNS8 m_encoding;
+      UNS64 m_offset;
+      UNS64 m_frames;
+
+      std::vector<UNS8> m_buf;
+      std::vector<can_wire_frame> m_pending;
+      can_cap_block m_cur;
+      UNS32 m_channels;
+      std::vector<can_cap_block> m_dir;
+   };
+
+#endif
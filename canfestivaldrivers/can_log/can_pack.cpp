@@ -0,0 +1,464 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "can_pack.h"
+
+#include <unordered_map>
+
+#define PACK_COLUMNS 5
+#define PACK_HEADER 11
+#define PACK_COB_ENTRY 5
+
+// LZ77 parameters, matches are at least LZ_MIN_MATCH long and at most 64k back
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+enum
+   {
+   COL_TIME,
+   COL_COB,
+   COL_PAYLOAD,
+   COL_DLC,
+   COL_DATA,
+   };
+
+// Prediction and dictionary state for one COB, encoder and decoder update it identically
+struct pack_cob
+   {
+   INTEGER64 last;
+   INTEGER64 period;
+   bool seen;
+   UNS8 next;
+   UNS8 dict[CAN_PACK_DICT][9];
+   };
+
+static const UNS64 pow10[] =
+   {
+   1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL
+   };
+
+static void put_varint(std::vector<UNS8> &out, UNS64 v)
+   {
+   while (v >= 0x80)
+      {
+      out.push_back((UNS8)(v | 0x80));
+      v >>= 7;
+      }
+   out.push_back((UNS8)v);
+   }
+
+static bool get_varint(const UNS8 *&p, const UNS8 *end, UNS64 &v)
+   {
+   int shift = 0;
+   v = 0;
+
+   while (p < end && shift < 64)
+      {
+      UNS8 b = *p++;
+      v |= (UNS64)(b & 0x7F) << shift;
+      if (!(b & 0x80))
+         return true;
+      shift += 7;
+      }
+
+   return false;
+   }
+
+static UNS64 zigzag(INTEGER64 v)
+   {
+   return ((UNS64)v << 1) ^ (UNS64)(v >> 63);
+   }
+
+static INTEGER64 unzigzag(UNS64 v)
+   {
+   return (INTEGER64)(v >> 1) ^ -(INTEGER64)(v & 1);
+   }
+
+static UNS32 read32(const UNS8 *p)
+   {
+   UNS32 v;
+   memcpy(&v, p, 4);
+   return v;
+   }
+
+static void lz_put_length(std::vector<UNS8> &out, std::size_t len)
+   {
+   while (len >= 255)
+      {
+      out.push_back(255);
+      len -= 255;
+      }
+   out.push_back((UNS8)len);
+   }
+
+static void lz_sequence(std::vector<UNS8> &out, const UNS8 *lit, std::size_t litlen, std::size_t offset, std::size_t matchlen)
+   {
+   std::size_t m = matchlen ? matchlen - LZ_MIN_MATCH : 0;
+
+   out.push_back((UNS8)(((litlen < 15 ? litlen : 15) << 4) | (m < 15 ? m : 15)));
+   if (litlen >= 15)
+      lz_put_length(out, litlen - 15);
+
+   out.insert(out.end(), lit, lit + litlen);
+
+   if (matchlen == 0)
+      return;
+
+   out.push_back((UNS8)offset);
+   out.push_back((UNS8)(offset >> 8));
+   if (m >= 15)
+      lz_put_length(out, m - 15);
+   }
+
+// Greedy LZ77, token nibbles give literal count and match length as in LZ4.
+// The last sequence has literals only
+static void lz_compress(const UNS8 *in, std::size_t n, std::vector<UNS8> &out)
+   {
+   std::vector<UNS32> table(1 << LZ_HASH_BITS, 0xFFFFFFFFUL);
+   std::size_t anchor = 0;
+   std::size_t i = 0;
+
+   while (i + LZ_MIN_MATCH <= n)
+      {
+      UNS32 seq = read32(in + i);
+      UNS32 h = (UNS32)(seq * 2654435761UL) >> (32 - LZ_HASH_BITS);
+      UNS32 cand = table[h];
+      table[h] = (UNS32)i;
+
+      if (cand != 0xFFFFFFFFUL && i - cand <= LZ_MAX_OFFSET && read32(in + cand) == seq)
+         {
+         std::size_t len = LZ_MIN_MATCH;
+         while (i + len < n && in[cand + len] == in[i + len])
+            len++;
+
+         lz_sequence(out, in + anchor, i - anchor, i - cand, len);
+         i += len;
+         anchor = i;
+         continue;
+         }
+
+      i++;
+      }
+
+   lz_sequence(out, in + anchor, n - anchor, 0, 0);
+   }
+
+static bool lz_get_length(const UNS8 *&p, const UNS8 *end, std::size_t &len)
+   {
+   UNS8 b;
+   do
+      {
+      if (p >= end)
+         return false;
+      b = *p++;
+      len += b;
+      }
+   while (b == 255);
+
+   return true;
+   }
+
+static bool lz_decompress(const UNS8 *p, std::size_t size, UNS8 *out, std::size_t n)
+   {
+   const UNS8 *end = p + size;
+   UNS8 *op = out;
+   UNS8 *oend = out + n;
+
+   while (p < end)
+      {
+      UNS8 token = *p++;
+
+      std::size_t lit = token >> 4;
+      if (lit == 15 && !lz_get_length(p, end, lit))
+         return false;
+      if (lit > (std::size_t)(end - p) || lit > (std::size_t)(oend - op))
+         return false;
+
+      memcpy(op, p, lit);
+      op += lit;
+      p += lit;
+
+      if (p == end)
+         break;
+
+      if (end - p < 2)
+         return false;
+      std::size_t offset = (std::size_t)(p[0] | (p[1] << 8));
+      p += 2;
+
+      std::size_t len = token & 15;
+      if (len == 15 && !lz_get_length(p, end, len))
+         return false;
+      len += LZ_MIN_MATCH;
+
+      if (offset == 0 || offset > (std::size_t)(op - out) || len > (std::size_t)(oend - op))
+         return false;
+
+      // matches may overlap what they produce, so byte at a time
+      const UNS8 *src = op - offset;
+      for (std::size_t x = 0; x < len; x++)
+         op[x] = src[x];
+      op += len;
+      }
+
+   return op == oend;
+   }
+
+static void put_column(std::vector<UNS8> &out, const std::vector<UNS8> &col)
+   {
+   std::vector<UNS8> packed;
+   if (!col.empty())
+      lz_compress(&col[0], col.size(), packed);
+
+   const std::vector<UNS8> &stored = packed.size() < col.size() ? packed : col;
+
+   UNS8 len[8];
+   can_wire_put32(len, (UNS32)col.size());
+   can_wire_put32(len + 4, (UNS32)stored.size());
+   out.insert(out.end(), len, len + 8);
+   out.insert(out.end(), stored.begin(), stored.end());
+   }
+
+static bool get_column(const UNS8 *&p, const UNS8 *end, std::vector<UNS8> &col)
+   {
+   if (end - p < 8)
+      return false;
+
+   UNS32 raw = can_wire_get32(p);
+   UNS32 stored = can_wire_get32(p + 4);
+   p += 8;
+
+   if (stored > (std::size_t)(end - p) || stored > raw)
+      return false;
+
+   col.resize(raw);
+   if (raw != 0)
+      {
+      if (stored == raw)
+         memcpy(&col[0], p, raw);
+      else if (!lz_decompress(p, stored, &col[0], raw))
+         return false;
+      }
+
+   p += stored;
+   return true;
+   }
+
+static void payload_key(const can_wire_frame *f, UNS8 *key)
+   {
+   UNS8 len = f->len > 8 ? 8 : f->len;
+
+   memset(key, 0, 9);
+   key[0] = len;
+   memcpy(key + 1, f->data, len);
+   }
+
+void can_pack_block(const can_wire_frame *f, UNS32 count, std::vector<UNS8> &out)
+   {
+   std::vector<UNS8> cols[PACK_COLUMNS];
+   std::vector<pack_cob> cobs;
+   std::vector<UNS32> index(count);
+   std::unordered_map<UNS64, UNS32> lookup;
+
+   UNS64 base = count ? f[0].timestamp : 0;
+
+   // coarsest unit every timestamp is a whole multiple of, candump logs are in us
+   int unit = 9;
+   for (UNS32 x = 0; x < count && unit > 0; x++)
+      {
+      INTEGER64 d = (INTEGER64)(f[x].timestamp - base);
+      while (unit > 0 && d % (INTEGER64)pow10[unit] != 0)
+         unit--;
+      }
+
+   std::size_t table = out.size() + PACK_HEADER;
+   out.resize(table);
+   out[table - PACK_HEADER] = (UNS8)unit;
+   can_wire_put64(&out[table - PACK_HEADER + 1], base);
+
+   for (UNS32 x = 0; x < count; x++)
+      {
+      UNS64 key = ((UNS64)f[x].channel << 32) | f[x].id;
+      std::unordered_map<UNS64, UNS32>::iterator it = lookup.find(key);
+
+      if (it == lookup.end())
+         {
+         it = lookup.insert(std::make_pair(key, (UNS32)cobs.size())).first;
+
+         pack_cob c;
+         memset(&c, 0, sizeof(c));
+         cobs.push_back(c);
+
+         UNS8 e[PACK_COB_ENTRY];
+         can_wire_put32(e, f[x].id);
+         e[4] = f[x].channel;
+         out.insert(out.end(), e, e + PACK_COB_ENTRY);
+         }
+
+      index[x] = it->second;
+      }
+
+   can_wire_put16(&out[table - 2], (UNS16)cobs.size());
+
+   bool wide = cobs.size() > 256;
+   INTEGER64 prev = 0;
+
+   for (UNS32 x = 0; x < count; x++)
+      {
+      pack_cob &c = cobs[index[x]];
+      INTEGER64 t = (INTEGER64)(f[x].timestamp - base) / (INTEGER64)pow10[unit];
+      INTEGER64 pred = c.seen ? c.last + c.period : prev;
+
+      put_varint(cols[COL_TIME], zigzag(t - pred));
+      if (c.seen)
+         c.period = t - c.last;
+      c.last = t;
+      c.seen = true;
+      prev = t;
+
+      cols[COL_COB].push_back((UNS8)index[x]);
+      if (wide)
+         cols[COL_COB].push_back((UNS8)(index[x] >> 8));
+
+      UNS8 key[9];
+      payload_key(&f[x], key);
+
+      int slot = 0;
+      while (slot < CAN_PACK_DICT && memcmp(c.dict[slot], key, 9) != 0)
+         slot++;
+
+      if (slot < CAN_PACK_DICT)
+         {
+         cols[COL_PAYLOAD].push_back((UNS8)slot);
+         continue;
+         }
+
+      cols[COL_PAYLOAD].push_back(CAN_PACK_LITERAL);
+      cols[COL_DLC].push_back(key[0]);
+      cols[COL_DATA].insert(cols[COL_DATA].end(), key + 1, key + 1 + key[0]);
+
+      memcpy(c.dict[c.next], key, 9);
+      c.next = (UNS8)((c.next + 1) % CAN_PACK_DICT);
+      }
+
+   for (int x = 0; x < PACK_COLUMNS; x++)
+      put_column(out, cols[x]);
+   }
+
+bool can_unpack_block(const UNS8 *p, std::size_t size, UNS32 count, can_wire_frame *out)
+   {
+   const UNS8 *end = p + size;
+
+   if (size < PACK_HEADER)
+      return false;
+
+   UNS8 unit = p[0];
+   UNS64 base = can_wire_get64(p + 1);
+   UNS32 ncobs = can_wire_get16(p + 9);
+   p += PACK_HEADER;
+
+   if (unit > 9 || (std::size_t)(end - p) < (std::size_t)ncobs * PACK_COB_ENTRY)
+      return false;
+
+   const UNS8 *table = p;
+   p += ncobs * PACK_COB_ENTRY;
+
+   std::vector<UNS8> cols[PACK_COLUMNS];
+   for (int x = 0; x < PACK_COLUMNS; x++)
+      {
+      if (!get_column(p, end, cols[x]))
+         return false;
+      }
+
+   bool wide = ncobs > 256;
+   if (cols[COL_COB].size() != (std::size_t)count * (wide ? 2 : 1) || cols[COL_PAYLOAD].size() != count)
+      return false;
+
+   std::vector<pack_cob> cobs(ncobs);
+   if (ncobs)
+      memset(&cobs[0], 0, ncobs * sizeof(pack_cob));
+
+   const UNS8 *tp = cols[COL_TIME].empty() ? NULL : &cols[COL_TIME][0];
+   const UNS8 *tend = tp + cols[COL_TIME].size();
+   const UNS8 *cp = cols[COL_COB].empty() ? NULL : &cols[COL_COB][0];
+   const UNS8 *pp = cols[COL_PAYLOAD].empty() ? NULL : &cols[COL_PAYLOAD][0];
+   const UNS8 *lp = cols[COL_DLC].empty() ? NULL : &cols[COL_DLC][0];
+   const UNS8 *lend = lp + cols[COL_DLC].size();
+   const UNS8 *dp = cols[COL_DATA].empty() ? NULL : &cols[COL_DATA][0];
+   const UNS8 *dend = dp + cols[COL_DATA].size();
+
+   UNS64 scale = pow10[unit];
+   INTEGER64 prev = 0;
+
+   for (UNS32 x = 0; x < count; x++)
+      {
+      can_wire_frame *f = &out[x];
+
+      UNS32 i = *cp++;
+      if (wide)
+         i |= (UNS32)(*cp++) << 8;
+      if (i >= ncobs)
+         return false;
+
+      pack_cob &c = cobs[i];
+      f->id = can_wire_get32(table + i * PACK_COB_ENTRY);
+      f->channel = table[i * PACK_COB_ENTRY + 4];
+
+      UNS64 z;
+      if (!get_varint(tp, tend, z))
+         return false;
+
+      INTEGER64 t = (c.seen ? c.last + c.period : prev) + unzigzag(z);
+      if (c.seen)
+         c.period = t - c.last;
+      c.last = t;
+      c.seen = true;
+      prev = t;
+      f->timestamp = base + (UNS64)t * scale;
+
+      UNS8 slot = *pp++;
+      if (slot == CAN_PACK_LITERAL)
+         {
+         if (lp >= lend || *lp > 8 || (std::size_t)(dend - dp) < *lp)
+            return false;
+
+         UNS8 *key = c.dict[c.next];
+         memset(key, 0, 9);
+         key[0] = *lp++;
+         memcpy(key + 1, dp, key[0]);
+         dp += key[0];
+
+         slot = c.next;
+         c.next = (UNS8)((c.next + 1) % CAN_PACK_DICT);
+         }
+      else if (slot >= CAN_PACK_DICT)
+         {
+         return false;
+         }
+
+      f->len = c.dict[slot][0];
+      memcpy(f->data, c.dict[slot] + 1, 8);
+      }
+
+   return true;
+   }
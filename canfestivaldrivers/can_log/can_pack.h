@@ -0,0 +1,75 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __can_pack_h__
+#define __can_pack_h__
+
+// Columnar block encoding for long term capture archives (CAN_CAP_ENC_COLUMNAR)
+//
+// Bus traffic is mostly the same few COB-IDs repeating on a fixed period with
+// payloads that rarely change (heartbeats, SYNC, cyclic PDOs). Splitting a
+// block into columns puts like with like, each column is then squeezed with a
+// small LZ77 coder so repeating patterns (the id sequence of a PDO cycle, runs
+// of dictionary hits) cost next to nothing.
+//
+// Payload layout
+//   0     unit     timestamps are stored in units of 10^unit ns
+//   1-8   base     timestamp of the first frame
+//   9-10  cobs     entries in the COB table
+//   11-   table    5 bytes per entry, id (with CAN_WIRE_ID_xxx flags) then channel,
+//                  in order of first appearance
+//   then five columns, each u32 raw length, u32 stored length and the data
+//   (LZ compressed unless stored length equals raw length)
+//     time     per frame, zigzag varint of the error against a per COB
+//              prediction (last time + last period, or the previous frame)
+//     cob      per frame, index into the COB table, 1 byte or 2 if more than 256
+//     payload  per frame, slot in that COB's CAN_PACK_DICT entry dictionary
+//              of recent payloads, or CAN_PACK_LITERAL
+//     dlc      per literal, its length
+//     data     per literal, its len data bytes
+//
+// Data bytes past len are not kept, they decode as 0. Blocks are independent,
+// so a reader can decode any number of them in parallel.
+
+#include <cstddef>
+#include <vector>
+
+extern "C" {
+#include "can_wire.h"
+}
+
+#define CAN_PACK_DICT 8
+#define CAN_PACK_LITERAL 0xFF
+#define CAN_PACK_DEFAULT_BLOCK 16384
+
+/**
+ * @brief Encode count frames as a columnar block payload appended to out
+ */
+void can_pack_block(const can_wire_frame *f, UNS32 count, std::vector<UNS8> &out);
+
+/**
+ * @brief Decode a columnar block payload into count frames
+ * @return false if the payload is corrupt
+ */
+bool can_unpack_block(const UNS8 *p, std::size_t size, UNS32 count, can_wire_frame *out);
+
+#endif
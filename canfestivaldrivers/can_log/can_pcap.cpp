@@ -0,0 +1,220 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "can_pcap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// pcapng block types and options
+#define PCAPNG_SHB 0x0A0D0D0AUL
+#define PCAPNG_IDB 0x00000001UL
+#define PCAPNG_EPB 0x00000006UL
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4DUL
+
+#define PCAPNG_OPT_END 0
+#define PCAPNG_IF_NAME 2
+#define PCAPNG_IF_TSRESOL 9
+#define PCAPNG_EPB_FLAGS 2
+
+#define PCAPNG_INBOUND 1
+#define PCAPNG_OUTBOUND 2
+
+// SocketCAN struct can_frame, the id word is big endian in this link type
+#define SOCKETCAN_FRAME 16
+#define SOCKETCAN_EFF 0x80000000UL
+#define SOCKETCAN_RTR 0x40000000UL
+
+#define SHB_SIZE 28
+#define IDB_MAX 64
+#define EPB_SIZE (28 + SOCKETCAN_FRAME + 12 + 4)
+
+static UNS8 *put_option(UNS8 *p, UNS16 code, const void *value, UNS16 len)
+   {
+   can_wire_put16(p, code);
+   can_wire_put16(p + 2, len);
+   memset(p + 4, 0, (len + 3u) & ~3u);
+   if (len)
+      memcpy(p + 4, value, len);
+   return p + 4 + ((len + 3u) & ~3u);
+   }
+
+can_pcap_writer::can_pcap_writer() : m_fd(-1),
+      m_used(0),
+      m_interfaces(0)
+   {
+   }
+
+can_pcap_writer::~can_pcap_writer()
+   {
+   close();
+   }
+
+bool can_pcap_writer::open(const char *path)
+   {
+   close();
+
+   if (strcmp(path, "-") == 0)
+      m_fd = dup(STDOUT_FILENO);
+   else
+      m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+   if (m_fd < 0)
+      {
+      fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+      return false;
+      }
+
+   m_path = path;
+   m_buf.resize(CAN_PCAP_BUFFER);
+   m_used = 0;
+   m_interfaces = 0;
+   for (int x = 0; x < 256; x++)
+      m_interface[x] = -1;
+
+   UNS8 *p = &m_buf[0];
+   can_wire_put32(p, PCAPNG_SHB);
+   can_wire_put32(p + 4, SHB_SIZE);
+   can_wire_put32(p + 8, PCAPNG_BYTE_ORDER);
+   can_wire_put16(p + 12, 1);
+   can_wire_put16(p + 14, 0);
+   can_wire_put64(p + 16, ~(UNS64)0);   // section length not known up front
+   can_wire_put32(p + 24, SHB_SIZE);
+   m_used = SHB_SIZE;
+
+   return true;
+   }
+
+void can_pcap_writer::add_interface(UNS8 channel)
+   {
+   char name[8];
+   UNS8 resol = 9;   // 10^-9 s
+   int len = snprintf(name, sizeof(name), "can%u", channel);
+
+   UNS8 *p = &m_buf[m_used];
+   can_wire_put32(p, PCAPNG_IDB);
+   can_wire_put16(p + 8, CAN_PCAP_LINKTYPE_SOCKETCAN);
+   can_wire_put16(p + 10, 0);
+   can_wire_put32(p + 12, SOCKETCAN_FRAME);
+
+   UNS8 *o = put_option(p + 16, PCAPNG_IF_NAME, name, (UNS16)len);
+   o = put_option(o, PCAPNG_IF_TSRESOL, &resol, 1);
+   o = put_option(o, PCAPNG_OPT_END, NULL, 0);
+
+   UNS32 size = (UNS32)(o - p) + 4;
+   can_wire_put32(p + 4, size);
+   can_wire_put32(o, size);
+
+   m_used += size;
+   m_interface[channel] = m_interfaces++;
+   }
+
+bool can_pcap_writer::add(const can_wire_frame *f)
+   {
+   if (m_fd < 0)
+      return false;
+
+   bool ok = true;
+   if (m_used + IDB_MAX + EPB_SIZE > m_buf.size())
+      ok = flush();
+
+   if (m_interface[f->channel] < 0)
+      add_interface(f->channel);
+
+   UNS32 id = f->id & CAN_WIRE_ID_MASK;
+   if (f->id & CAN_WIRE_ID_EXT)
+      id |= SOCKETCAN_EFF;
+   if (f->id & CAN_WIRE_ID_RTR)
+      id |= SOCKETCAN_RTR;
+
+   UNS8 *p = &m_buf[m_used];
+   can_wire_put32(p, PCAPNG_EPB);
+   can_wire_put32(p + 4, EPB_SIZE);
+   can_wire_put32(p + 8, (UNS32)m_interface[f->channel]);
+   can_wire_put32(p + 12, (UNS32)(f->timestamp >> 32));
+   can_wire_put32(p + 16, (UNS32)f->timestamp);
+   can_wire_put32(p + 20, SOCKETCAN_FRAME);
+   can_wire_put32(p + 24, SOCKETCAN_FRAME);
+
+   UNS8 *d = p + 28;
+   d[0] = (UNS8)(id >> 24);
+   d[1] = (UNS8)(id >> 16);
+   d[2] = (UNS8)(id >> 8);
+   d[3] = (UNS8)id;
+   d[4] = f->len > 8 ? 8 : f->len;
+   d[5] = 0;
+   d[6] = 0;
+   d[7] = 0;
+   memcpy(d + 8, f->data, 8);
+
+   UNS8 *o = d + SOCKETCAN_FRAME;
+   can_wire_put16(o, PCAPNG_EPB_FLAGS);
+   can_wire_put16(o + 2, 4);
+   can_wire_put32(o + 4, (f->id & CAN_WIRE_ID_TX) ? PCAPNG_OUTBOUND : PCAPNG_INBOUND);
+   can_wire_put32(o + 8, PCAPNG_OPT_END);
+   can_wire_put32(p + EPB_SIZE - 4, EPB_SIZE);
+
+   m_used += EPB_SIZE;
+   return ok;
+   }
+
+bool can_pcap_writer::flush()
+   {
+   if (m_fd < 0)
+      return false;
+
+   bool ok = write_all(&m_buf[0], m_used);
+   m_used = 0;
+   return ok;
+   }
+
+bool can_pcap_writer::close()
+   {
+   if (m_fd < 0)
+      return true;
+
+   bool ok = flush();
+   ::close(m_fd);
+   m_fd = -1;
+   return ok;
+   }
+
+bool can_pcap_writer::write_all(const UNS8 *p, std::size_t len)
+   {
+   std::size_t done = 0;
+
+   while (done < len)
+      {
+      ssize_t n = ::write(m_fd, p + done, len - done);
+      if (n < 0)
+         {
+         if (errno == EINTR)
+            continue;
+         fprintf(stderr, "write %s: %s\n", m_path.c_str(), strerror(errno));
+         return false;
+         }
+      done += (std::size_t)n;
+      }
+
+   return true;
+   }
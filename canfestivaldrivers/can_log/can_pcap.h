@@ -0,0 +1,77 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __can_pcap_h__
+#define __can_pcap_h__
+
+// Streaming pcapng writer, for looking at captures with Wireshark's CANopen dissector
+//
+// One section, one interface per CAN channel (named can0, can1 ...) with
+// LINKTYPE_CAN_SOCKETCAN and nanosecond timestamps. Interfaces are described
+// the first time their channel is seen so the output can be read while it is
+// still being written, eg through a fifo into wireshark -k -i <fifo>.
+// Frames we transmitted are marked outbound in the packet flags.
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "can_wire.h"
+}
+
+#define CAN_PCAP_LINKTYPE_SOCKETCAN 227
+#define CAN_PCAP_BUFFER (1024 * 1024)
+
+class can_pcap_writer
+   {
+   public:
+      can_pcap_writer();
+      ~can_pcap_writer();
+
+      /**
+       * @brief Create the file, "-" writes to stdout
+       */
+      bool open(const char *path);
+      bool close();
+
+      bool add(const can_wire_frame *f);
+
+      /**
+       * @brief Write out everything buffered so far
+       */
+      bool flush();
+
+   private:
+      void add_interface(UNS8 channel);
+      bool write_all(const UNS8 *p, std::size_t len);
+
+   private:
+      int m_fd;
+      std::string m_path;
+      std::vector<UNS8> m_buf;
+      std::size_t m_used;
+      int m_interface[256];   // pcapng interface id of each channel, -1 until seen
+      int m_interfaces;
+   };
+
+#endif
@@ -37,12 +37,40 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <string>         // std::string
 #include <cstddef>        // std::size_t
 
+#include <deque>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
 #include <nanomsg/nn.h>
 #include <nanomsg/bus.h>
 
 extern "C" {
 #include "can_driver.h"
+#include "can_wire.h"
 }
+class can_nanomsg_win32;
+
+// One NN_BUS socket per endpoint url, shared by every handle opened on it.
+// A busname of "ipc://rig1#ch3" is channel 3 on endpoint "ipc://rig1", plain
+// busnames are channel 0 so peers that know nothing about channels still work.
+//
+// Only one handle at a time (the leader) sits in nn_recv, whatever it reads is
+// split by channel byte into each handle's queue and only the handles that got
+// frames are woken, so N channels cost one socket and one blocking read.
+struct nn_endpoint
+   {
+	std::string url;
+	int fd;
+	int refs;
+	bool reading;
+	std::mutex lock;
+	std::vector<can_nanomsg_win32*> channels[256];
+	UNS8 rxbuf[CAN_WIRE_MAX_PACKET];
+   };
+
 class can_nanomsg_win32
    {
    public:
@@ -53,91 +81,237 @@ class can_nanomsg_win32
 	  ~can_nanomsg_win32();
       bool send(const Message *m);
       bool receive(Message *m);
+      UNS64 overruns();
    private:
-      bool open_rs232(std::string port ="COM1", int baud_rate = 57600);
-      bool close_rs232();
+      static nn_endpoint *open_endpoint(const std::string &url);
+      static void close_endpoint(nn_endpoint *ep);
+      static void demux(nn_endpoint *ep, const UNS8 *buf, int len);
+      void push(const Message &m);
    private:
-      HANDLE m_port;
-      HANDLE m_read_event;
-      HANDLE m_write_event;
-      std::string m_residual_buffer;
+	  nn_endpoint *m_ep;
+	  UNS8 m_channel;
 
-	  int fd;
+	  // frames demultiplexed for us, guarded by the endpoint lock
+	  std::deque<Message> m_rxq;
+	  std::condition_variable m_rxready;
+	  UNS64 m_overruns;   // frames pushed out of a full m_rxq
    };
 
-can_nanomsg_win32::can_nanomsg_win32(s_BOARD *board) : m_port(INVALID_HANDLE_VALUE),
-      m_read_event(0),
-      m_write_event(0)
+enum { RX_TIMEOUT_MS = 10, RX_QUEUE_MAX = 4096 };
+
+static std::mutex g_endpoints_lock;
+static std::map<std::string, nn_endpoint*> g_endpoints;
+
+can_nanomsg_win32::can_nanomsg_win32(s_BOARD *board) : m_ep(NULL),
+      m_channel(0),
+      m_overruns(0)
    {
+	std::string url = board->busname;
 
-	open_rs232(board->busname, 0);
-	
+	std::size_t hash = url.find("#ch");
+	if (hash != std::string::npos)
+	{
+		const char *ch = url.c_str() + hash + 3;
+		char *end = NULL;
+		long n = strtol(ch, &end, 10);
+
+		if (end == ch || *end != '\0' || n < 0 || n > 255)
+		{
+			fprintf(stderr, "nanomsg %s: channel must be 0-255\n", board->busname);
+			throw error();
+		}
+
+		m_channel = (UNS8)n;
+		url.erase(hash);
+	}
+
+	m_ep = open_endpoint(url);
+	if (m_ep == NULL)
+		throw error();
+
+	std::lock_guard<std::mutex> l(m_ep->lock);
+	m_ep->channels[m_channel].push_back(this);
    }
 
 can_nanomsg_win32::~can_nanomsg_win32()
    {
+	{
+		std::lock_guard<std::mutex> l(m_ep->lock);
+		std::vector<can_nanomsg_win32*> &v = m_ep->channels[m_channel];
+		v.erase(std::remove(v.begin(), v.end(), this), v.end());
+	}
 
+	if (m_overruns)
+		fprintf(stderr, "nanomsg %s#ch%u: receive queue full, %llu frames lost\n",
+			m_ep->url.c_str(), m_channel, (unsigned long long)m_overruns);
+
+	close_endpoint(m_ep);
    }
 
+nn_endpoint *can_nanomsg_win32::open_endpoint(const std::string &url)
+   {
+	std::lock_guard<std::mutex> l(g_endpoints_lock);
 
+	std::map<std::string, nn_endpoint*>::iterator it = g_endpoints.find(url);
+	if (it != g_endpoints.end())
+	{
+		it->second->refs++;
+		return it->second;
+	}
 
-bool can_nanomsg_win32::send(const Message *m)
-   {
-		if (nn_send(fd, m, sizeof(Message), 0) < 0) {
-			fprintf(stderr, "nn_send: %s\n", nn_strerror(nn_errno()));
-			nn_close(fd);
-			return false;
+	int fd = nn_socket(AF_SP, NN_BUS);
+	if (fd < 0) {
+		fprintf(stderr, "nn_socket: %s\n", nn_strerror(nn_errno()));
+		return NULL;
 	}
 
-		return true;
+	if (nn_bind(fd, url.c_str()) < 0) {
+		fprintf(stderr, "nn_socket: %s\n", nn_strerror(nn_errno()));
+		nn_close(fd);
+		return NULL;
+	}
+
+	int timeout = RX_TIMEOUT_MS;
+	nn_setsockopt(fd, NN_SOL_SOCKET, NN_RCVTIMEO, &timeout, sizeof(timeout));
+
+	nn_endpoint *ep = new nn_endpoint();
+	ep->url = url;
+	ep->fd = fd;
+	ep->refs = 1;
+	ep->reading = false;
+
+	g_endpoints[url] = ep;
+	return ep;
    }
 
-bool can_nanomsg_win32::receive(Message *m)
+void can_nanomsg_win32::close_endpoint(nn_endpoint *ep)
    {
+	std::lock_guard<std::mutex> l(g_endpoints_lock);
 
-	int rc;
-	/*  Here we ask the library to allocate response buffer for us (NN_MSG). */
+	if (--ep->refs > 0)
+		return;
 
-	rc = nn_recv(fd, m, 14, NN_DONTWAIT);
-	//rc = nn_recv(fd, &m2, NN_MSG, 0);
-	if (rc < 0) {
-		m->len = 0;
-
-		if (m->cob_sender_id != 0) //we are 0 as we are not really the bus
-			nn_send(fd, m, 14, NN_DONTWAIT);
+	// no handles are left so nobody can be blocked in nn_recv on it
+	g_endpoints.erase(ep->url);
+	nn_close(ep->fd);
+	delete ep;
+   }
 
-		//fprintf(stderr, "nn_recv: %s\n", nn_strerror(nn_errno()));
-		//nn_close(fd);
-		return false;
+// Queue a frame for this handle, called with the endpoint lock held
+void can_nanomsg_win32::push(const Message &m)
+   {
+	if (m_rxq.size() >= RX_QUEUE_MAX)
+	{
+		m_rxq.pop_front();
+		m_overruns++;
 	}
 
-	//memcpy(m, m2, rc<12?rc:12);
+	m_rxq.push_back(m);
+	m_rxready.notify_one();
+   }
 
-	return true;
+UNS64 can_nanomsg_win32::overruns()
+   {
+	std::lock_guard<std::mutex> l(m_ep->lock);
+	return m_overruns;
    }
 
-bool can_nanomsg_win32::open_rs232(std::string port, int baud_rate)
+// Split a received packet out to the handles on each channel, called with the endpoint lock held
+void can_nanomsg_win32::demux(nn_endpoint *ep, const UNS8 *buf, int len)
    {
+	// Peers built before the wire format send the raw 14 byte host struct,
+	// no versioned packet can be that size so it is safe to pass it through
+	if (len == sizeof(Message)) {
+		Message m;
+		memcpy(&m, buf, sizeof(Message));
+		for (size_t x = 0; x < ep->channels[0].size(); x++)
+			ep->channels[0][x]->push(m);
+		return;
+	}
 
-	fd = nn_socket(AF_SP, NN_BUS);
-	if (fd < 0) {
-		fprintf(stderr, "nn_socket: %s\n", nn_strerror(nn_errno()));
-		return false;
+	UNS8 flags;
+	int count = can_wire_check(buf, len, &flags);
+	int pos = CAN_WIRE_HEADER_SIZE;
+
+	for (int i = 0; i < count; i++)
+	{
+		can_wire_frame f;
+		Message m;
+		pos += can_wire_get_frame(buf + pos, &f, flags);
+
+		if (!can_wire_to_message(&f, &m))
+			continue;
+
+		std::vector<can_nanomsg_win32*> &v = ep->channels[f.channel];
+		for (size_t x = 0; x < v.size(); x++)
+			v[x]->push(m);
 	}
+   }
 
-	if (nn_bind(fd, port.c_str()) < 0) {
-		fprintf(stderr, "nn_socket: %s\n", nn_strerror(nn_errno()));
-		nn_close(fd);
-		return false;
+bool can_nanomsg_win32::send(const Message *m)
+   {
+		UNS8 buf[CAN_WIRE_HEADER_SIZE + CAN_WIRE_FRAME_SIZE];
+		int len = can_wire_put_header(buf, 0, 1);
+		len += can_wire_put_message(buf + len, m, m_channel, 0, 0);
+
+		if (nn_send(m_ep->fd, buf, len, 0) < 0) {
+			fprintf(stderr, "nn_send: %s\n", nn_strerror(nn_errno()));
+			return false;
 	}
 
-	return true;
-  
+		// the socket never hears itself, so other local handles on the same
+		// channel get the frame directly as they would on a real bus
+		std::lock_guard<std::mutex> l(m_ep->lock);
+		std::vector<can_nanomsg_win32*> &v = m_ep->channels[m_channel];
+		for (size_t x = 0; x < v.size(); x++)
+		{
+			if (v[x] != this)
+				v[x]->push(*m);
+		}
+
+		return true;
    }
 
-bool can_nanomsg_win32::close_rs232()
+bool can_nanomsg_win32::receive(Message *m)
    {
-	nn_close(fd);
+	std::unique_lock<std::mutex> l(m_ep->lock);
+
+	if (m_rxq.empty())
+	{
+		if (!m_ep->reading)
+		{
+			// become the leader and do the one blocking read for the whole endpoint
+			m_ep->reading = true;
+			l.unlock();
+
+			int rc = nn_recv(m_ep->fd, m_ep->rxbuf, sizeof(m_ep->rxbuf), 0);
+
+			l.lock();
+			m_ep->reading = false;
+
+			if (rc >= 0)
+				demux(m_ep, m_ep->rxbuf, rc);
+		}
+		else
+		{
+			m_rxready.wait_for(l, std::chrono::milliseconds(RX_TIMEOUT_MS));
+		}
+	}
+
+	if (m_rxq.empty())
+	{
+		bool echo = m->cob_sender_id != 0; //we are 0 as we are not really the bus
+		m->len = 0;
+		l.unlock();
+
+		if (echo)
+			send(m);
+
+		return false;
+	}
+
+	*m = m_rxq.front();
+	m_rxq.pop_front();
 	return true;
    }
 
@@ -182,6 +356,15 @@ extern "C"
 	return 0;
 	} 
 
+/**
+ * @brief Frames this handle has lost because its receive queue was full
+ */
+extern "C"
+   UNS64 __stdcall canOverruns_driver(CAN_HANDLE fd0)
+   {
+	   return reinterpret_cast<can_nanomsg_win32*>(fd0)->overruns();
+   }
+
 typedef void(__stdcall *setStringValuesCB_t) (char *pStringValues[], int nValues);
 static setStringValuesCB_t __stdcall gSetStringValuesCB;
 
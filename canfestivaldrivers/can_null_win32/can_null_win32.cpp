@@ -25,8 +25,6 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 // driver for CanFestival-3 Win32 port
 
 
-#define MAX_BUF_SIZE 20
-
 #include <sstream>
 #include <iomanip>
 #if 0  // change to 1 if you use boost
@@ -40,9 +38,121 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <string>         // std::string
 #include <cstddef>        // std::size_t
 
+#include <deque>
+#include <queue>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+
 extern "C" {
 #include "can_driver.h"
 }
+
+// With a plain busname such as "null://null1" this driver is silent, anything
+// sent is discarded and receive never returns a frame.
+//
+// Adding a query turns it into a synthetic traffic generator, no I/O is done,
+// frames are made up on demand in receive() so it is a hardware free way to
+// find the throughput limit of the host side. eg
+//
+//   null://gen?rate=max&cob=0x181-0x1ff&dlc=2,8
+//   null://gen?nodes=32&hb=1000&pdo=10&emcy=5000:4&sdo=1
+//
+//   rate=n|max   random frames per second, max produces one on every poll
+//   cob=lo-hi    COB range for random frames (default 0x181-0x57f)
+//   dist=u|hot   uniform COB choice, or hot where 80% of frames use the lowest 20% of the range
+//   dlc=a,b,..   DLC mix for random frames, picked at random (default 8)
+//   nodes=n      number of simulated nodes (1..n) for the periodic traffic below
+//   hb=ms        heartbeat period, 0x700+node state operational
+//   pdo=ms       TPDO1 cycle, 0x180+node with an 8 byte counter
+//   emcy=ms:n    every ms a burst of n EMCY frames from random nodes
+//   sdo=1        answer SDO requests to the simulated nodes as a scripted server,
+//                reads return (index<<8)|subindex, writes are acknowledged
+//   sdoblock=1   the scripted server also speaks SDO block upload and download
+//                with CRC, without it block requests are rejected so clients
+//                fall back to segmented transfers
+//   blob=n       size in bytes of every object read (default 4, which is sent
+//                expedited), larger objects go by segmented or block upload so
+//                the two can be compared
+//   seed=n       random seed so runs are repeatable
+//
+// Impairments, applied to every frame between the host and the simulated
+// nodes (SDO requests, SDO replies, loopback echoes and the periodic frames,
+// not the random rate= frames) to see how the host copes with a bad link. eg
+//
+//   null://loop?loop=1&nodes=4&sdo=1&delay=5&jitter=2&jdist=normal&drop=0.01
+//
+//   loop=1       frames sent are echoed back to receive()
+//   delay=ms     one way latency, fractions allowed
+//   jitter=ms    spread of the latency, see jdist
+//   jdist=u|normal|exp  jitter uniform in +-jitter (default), normal with
+//                jitter as standard deviation, or exponential with jitter as mean
+//   drop=p       probability a frame is lost
+//   dup=p        probability a frame is delivered twice (each copy has its own latency)
+//   reorder=p    probability a frame skips the latency and overtakes frames in flight
+//
+// Everything is timed from the steady clock until canSetTime_driver() hands
+// over to a simulated time, from then on heartbeats, PDOs, EMCYs, rate= and
+// the link delays follow it and canNextEvent_driver() says when the next frame
+// is due so the caller can jump straight there.
+
+typedef std::chrono::steady_clock gen_clock;
+
+// A frame on its way between the host and the simulated nodes
+struct in_flight
+   {
+   gen_clock::time_point due;
+   UNS64 seq;
+   bool to_node;
+   Message m;
+
+   bool operator<(const in_flight &o) const
+      {
+      // priority_queue keeps the largest on top, we want the earliest
+      return due != o.due ? due > o.due : seq > o.seq;
+      }
+   };
+
+enum jitter_dist
+   {
+   JITTER_UNIFORM,
+   JITTER_NORMAL,
+   JITTER_EXP,
+   };
+
+enum sdo_block_state
+   {
+   BLOCK_IDLE,
+   BLOCK_DOWNLOAD,       // taking sub-block segments
+   BLOCK_DOWNLOAD_END,   // all data acknowledged, waiting for the end with the CRC
+   BLOCK_UPLOAD_START,   // initiate answered, waiting for the client to start
+   BLOCK_UPLOAD,         // sub-block sent, waiting for the acknowledge
+   BLOCK_UPLOAD_END,     // end with the CRC sent, waiting for the client's end
+   SEGMENT_UPLOAD,       // plain segmented upload of a blob= object, offset is the bytes sent
+   };
+
+// A block transfer between the host and one simulated node
+struct sdo_block
+   {
+   sdo_block_state state;
+   UNS8 blksize;
+   UNS8 seq;                // last segment of this sub-block taken in order
+   UNS16 index;
+   UNS8 subindex;
+   UNS32 offset;            // upload, bytes acknowledged by the client
+   std::vector<UNS8> data;  // download, bytes received so far
+   };
+
+struct periodic
+   {
+   UNS16 cob;
+   gen_clock::duration period;
+   gen_clock::time_point next;
+   UNS32 count;
+   };
+
 class can_null_win32
    {
    public:
@@ -53,23 +163,807 @@ class can_null_win32
 	  ~can_null_win32();
       bool send(const Message *m);
       bool receive(Message *m);
+      void set_time(UNS64 ns);
+      UNS64 next_event();
+   private:
+      gen_clock::time_point now();
+      void rebase(gen_clock::duration d);
+      void parse(const std::string &query);
+      void schedule(gen_clock::time_point now);
+      void random_frame(Message *m);
+      void sdo_server(const Message *m);
+      bool sdo_block_server(const Message *m, UNS8 node);
+      void sdo_block_send(UNS8 node);
+      void transmit(const Message *m, bool to_node);
+      void deliver(gen_clock::time_point now);
+      gen_clock::duration latency();
+   private:
+      bool m_generate;
+      std::mt19937 m_rng;
+      std::deque<Message> m_pending;
+
+      bool m_rate_max;
+      double m_rate;
+      double m_credit;
+      gen_clock::time_point m_last;
+      UNS16 m_cob_lo;
+      UNS16 m_cob_hi;
+      bool m_hot;
+      std::vector<UNS8> m_dlc;
+
+      UNS8 m_nodes;
+      std::vector<periodic> m_periodic;
+      gen_clock::duration m_emcy_period;
+      gen_clock::time_point m_emcy_next;
+      int m_emcy_burst;
+
+      bool m_sdo;
+      bool m_sdo_block;
+      UNS32 m_blob;
+      std::vector<sdo_block> m_block;   // per node, only touched by the receive thread
+      bool m_loop;
+
+      // frames in flight, send() adds from the application thread and
+      // receive() delivers, everything behind m_lock
+      std::mutex m_lock;
+      std::priority_queue<in_flight> m_flight;
+      std::atomic<bool> m_flying;   // m_flight is not empty, checked without the lock
+      std::mt19937 m_link_rng;
+      UNS64 m_seq;
+      double m_delay;
+      double m_jitter;
+      jitter_dist m_jdist;
+      double m_drop;
+      double m_dup;
+      double m_reorder;
+      UNS64 m_dropped;
+      UNS64 m_duplicated;
+      UNS64 m_reordered;
+
+      // simulated time, m_vnow is also read by send() on the application thread
+      std::atomic<bool> m_virtual;
+      std::atomic<gen_clock::rep> m_vnow;
+      gen_clock::duration m_voffset;   // steady clock less simulated time at the hand over
    };
 
-can_null_win32::can_null_win32(s_BOARD *board)
+static std::string query_value(const std::string &query, const char *key)
    {
+   std::string k = std::string(key) + "=";
+   std::size_t pos = 0;
 
-	
+   while (pos < query.size())
+      {
+      std::size_t end = query.find('&', pos);
+      if (end == std::string::npos)
+         end = query.size();
+
+      if (query.compare(pos, k.size(), k) == 0)
+         return query.substr(pos + k.size(), end - pos - k.size());
+
+      pos = end + 1;
+      }
+
+   return "";
+   }
+
+can_null_win32::can_null_win32(s_BOARD *board) : m_generate(false),
+      m_rng(1),
+      m_rate_max(false),
+      m_rate(0),
+      m_credit(0),
+      m_cob_lo(0x181),
+      m_cob_hi(0x57f),
+      m_hot(false),
+      m_nodes(0),
+      m_emcy_period(0),
+      m_emcy_burst(0),
+      m_sdo(false),
+      m_sdo_block(false),
+      m_blob(4),
+      m_loop(false),
+      m_flying(false),
+      m_link_rng(2),
+      m_seq(0),
+      m_delay(0),
+      m_jitter(0),
+      m_jdist(JITTER_UNIFORM),
+      m_drop(0),
+      m_dup(0),
+      m_reorder(0),
+      m_dropped(0),
+      m_duplicated(0),
+      m_reordered(0),
+      m_virtual(false),
+      m_vnow(0),
+      m_voffset(0)
+   {
+	std::string bus = board->busname ? board->busname : "";
+	std::size_t q = bus.find('?');
+
+	if (q != std::string::npos)
+	{
+		m_generate = true;
+		parse(bus.substr(q + 1));
+	}
    }
 
 can_null_win32::~can_null_win32()
    {
+	if (m_dropped || m_duplicated || m_reordered)
+		fprintf(stderr, "null: %llu frames dropped, %llu duplicated, %llu reordered\n",
+			(unsigned long long)m_dropped, (unsigned long long)m_duplicated, (unsigned long long)m_reordered);
+   }
+
+void can_null_win32::parse(const std::string &query)
+   {
+	std::string v;
+
+	v = query_value(query, "seed");
+	if (!v.empty())
+	{
+		m_rng.seed((unsigned long)strtoul(v.c_str(), NULL, 0));
+		m_link_rng.seed((unsigned long)strtoul(v.c_str(), NULL, 0) + 1);
+	}
+
+	v = query_value(query, "rate");
+	if (v == "max")
+		m_rate_max = true;
+	else if (!v.empty())
+		m_rate = atof(v.c_str());
+
+	v = query_value(query, "cob");
+	if (!v.empty())
+	{
+		char *end;
+		m_cob_lo = (UNS16)strtoul(v.c_str(), &end, 0);
+		m_cob_hi = (*end == '-') ? (UNS16)strtoul(end + 1, NULL, 0) : m_cob_lo;
+		if (m_cob_hi < m_cob_lo)
+			std::swap(m_cob_lo, m_cob_hi);
+	}
+
+	m_hot = query_value(query, "dist") == "hot";
+
+	v = query_value(query, "dlc");
+	for (std::size_t pos = 0; pos < v.size();)
+	{
+		std::size_t end = v.find(',', pos);
+		if (end == std::string::npos)
+			end = v.size();
+		m_dlc.push_back((UNS8)std::min(8, std::max(0, atoi(v.c_str() + pos))));
+		pos = end + 1;
+	}
+	if (m_dlc.empty())
+		m_dlc.push_back(8);
+
+	v = query_value(query, "nodes");
+	if (!v.empty())
+		m_nodes = (UNS8)std::min(127, std::max(0, atoi(v.c_str())));
+
+	gen_clock::time_point now = this->now();
+	m_last = now;
+
+	int hb = atoi(query_value(query, "hb").c_str());
+	int pdo = atoi(query_value(query, "pdo").c_str());
+
+	for (UNS8 node = 1; node <= m_nodes; node++)
+	{
+		periodic p;
+		p.count = 0;
+
+		if (hb > 0)
+		{
+			p.cob = 0x700 + node;
+			p.period = std::chrono::milliseconds(hb);
+			p.next = now + p.period * node / (m_nodes + 1); // spread nodes out over the period
+			m_periodic.push_back(p);
+		}
+
+		if (pdo > 0)
+		{
+			p.cob = 0x180 + node;
+			p.period = std::chrono::milliseconds(pdo);
+			p.next = now;
+			m_periodic.push_back(p);
+		}
+	}
+
+	v = query_value(query, "emcy");
+	if (!v.empty() && m_nodes > 0)
+	{
+		int period = atoi(v.c_str());
+		std::size_t colon = v.find(':');
+		int burst = colon == std::string::npos ? 1 : atoi(v.c_str() + colon + 1);
+
+		// like hb= and pdo=, a zero or unparsable period (or burst) leaves emergencies off
+		if (period > 0 && burst > 0)
+		{
+			m_emcy_period = std::chrono::milliseconds(period);
+			m_emcy_burst = burst;
+			m_emcy_next = now + m_emcy_period;
+		}
+	}
+
+	m_sdo = atoi(query_value(query, "sdo").c_str()) != 0;
+	m_sdo_block = atoi(query_value(query, "sdoblock").c_str()) != 0;
+	v = query_value(query, "blob");
+	if (!v.empty())
+		m_blob = (UNS32)strtoul(v.c_str(), NULL, 0);
+	m_block.resize(m_nodes + 1);
+	for (std::size_t x = 0; x < m_block.size(); x++)
+		m_block[x].state = BLOCK_IDLE;
+	m_loop = atoi(query_value(query, "loop").c_str()) != 0;
+
+	m_delay = std::max(0.0, atof(query_value(query, "delay").c_str()));
+	m_jitter = std::max(0.0, atof(query_value(query, "jitter").c_str()));
+	m_drop = atof(query_value(query, "drop").c_str());
+	m_dup = atof(query_value(query, "dup").c_str());
+	m_reorder = atof(query_value(query, "reorder").c_str());
+
+	v = query_value(query, "jdist");
+	if (v == "normal")
+		m_jdist = JITTER_NORMAL;
+	else if (v == "exp")
+		m_jdist = JITTER_EXP;
+   }
+
+// One latency sample, called with m_lock held
+gen_clock::duration can_null_win32::latency()
+   {
+	double ms = m_delay;
+
+	if (m_jitter > 0)
+	{
+		switch (m_jdist)
+		{
+		case JITTER_NORMAL:
+			ms += std::normal_distribution<double>(0.0, m_jitter)(m_link_rng);
+			break;
+		case JITTER_EXP:
+			ms += std::exponential_distribution<double>(1.0 / m_jitter)(m_link_rng);
+			break;
+		default:
+			ms += std::uniform_real_distribution<double>(-m_jitter, m_jitter)(m_link_rng);
+			break;
+		}
+	}
+
+	if (ms <= 0)
+		return gen_clock::duration(0);
+
+	return std::chrono::duration_cast<gen_clock::duration>(std::chrono::duration<double, std::milli>(ms));
+   }
+
+// Put a frame on the simulated link, subject to the impairments
+void can_null_win32::transmit(const Message *m, bool to_node)
+   {
+	std::lock_guard<std::mutex> l(m_lock);
+	std::uniform_real_distribution<double> p(0.0, 1.0);
+	gen_clock::time_point now = this->now();
+
+	if (m_drop > 0 && p(m_link_rng) < m_drop)
+	{
+		m_dropped++;
+		return;
+	}
+
+	int copies = 1;
+	if (m_dup > 0 && p(m_link_rng) < m_dup)
+	{
+		m_duplicated++;
+		copies = 2;
+	}
+
+	for (int x = 0; x < copies; x++)
+	{
+		in_flight f;
+		f.seq = m_seq++;
+		f.to_node = to_node;
+		f.m = *m;
+
+		if (m_reorder > 0 && p(m_link_rng) < m_reorder)
+		{
+			m_reordered++;
+			f.due = now;
+		}
+		else
+		{
+			f.due = now + latency();
+		}
+
+		m_flight.push(f);
+	}
+
+	m_flying = true;
+   }
+
+// Hand over everything that has arrived, replies from the simulated nodes go back on the link
+void can_null_win32::deliver(gen_clock::time_point now)
+   {
+	std::vector<Message> requests;
+
+	{
+		std::lock_guard<std::mutex> l(m_lock);
+
+		while (!m_flight.empty() && m_flight.top().due <= now)
+		{
+			if (m_flight.top().to_node)
+				requests.push_back(m_flight.top().m);
+			else
+				m_pending.push_back(m_flight.top().m);
+			m_flight.pop();
+		}
+
+		m_flying = !m_flight.empty();
+	}
+
+	for (std::size_t x = 0; x < requests.size(); x++)
+		sdo_server(&requests[x]);
+   }
+
+// Queue everything that has fallen due since the last poll
+void can_null_win32::schedule(gen_clock::time_point now)
+   {
+	for (std::size_t x = 0; x < m_periodic.size(); x++)
+	{
+		periodic &p = m_periodic[x];
+
+		while (p.next <= now)
+		{
+			Message m = Message_Initializer;
+			m.cob_id = p.cob;
+
+			if (p.cob >= 0x700)
+			{
+				m.len = 1;
+				m.data[0] = p.count++ == 0 ? 0x00 : 0x05; // boot up then operational
+			}
+			else
+			{
+				m.len = 8;
+				memcpy(m.data, &p.count, sizeof(p.count));
+				p.count++;
+			}
+
+			transmit(&m, false);
+			p.next += p.period;
+		}
+	}
+
+	if (m_emcy_burst > 0 && m_emcy_next <= now)
+	{
+		for (int x = 0; x < m_emcy_burst; x++)
+		{
+			Message m = Message_Initializer;
+			m.cob_id = (UNS16)(0x80 + 1 + m_rng() % m_nodes);
+			m.len = 8;
+			m.data[0] = 0x00;
+			m.data[1] = 0x10; // 0x1000 generic error
+			m.data[2] = 0x01;
+			transmit(&m, false);
+		}
+
+		while (m_emcy_next <= now)
+			m_emcy_next += m_emcy_period;
+	}
+
+	if (m_rate > 0)
+	{
+		m_credit += std::chrono::duration<double>(now - m_last).count() * m_rate;
+		m_last = now;
+
+		// don't let a stalled consumer build up an unbounded burst, but always allow
+		// one whole frame or rates below 1 frame/s would never send anything
+		if (m_credit > std::max(1.0, m_rate))
+			m_credit = std::max(1.0, m_rate);
+	}
+   }
+
+void can_null_win32::random_frame(Message *m)
+   {
+	UNS32 span = (UNS32)(m_cob_hi - m_cob_lo) + 1;
+	UNS32 r = m_rng();
+
+	if (m_hot && (r % 10) < 8)
+		span = std::max<UNS32>(1, span / 5);
+
+	m->cob_id = (UNS16)(m_cob_lo + (r >> 8) % span);
+	m->rtr = 0;
+	m->len = m_dlc[(r >> 4) % m_dlc.size()];
+
+	UNS32 d = m_rng();
+	memcpy(m->data, &d, 4);
+	memcpy(m->data + 4, &r, 4);
+   }
+
+// CRC-16 CCITT (polynomial 0x1021, initial value 0) as used by SDO block transfers
+static UNS16 sdo_crc(const UNS8 *p, std::size_t len)
+   {
+	struct table
+	{
+		UNS16 t[256];
+		table()
+		{
+			for (int x = 0; x < 256; x++)
+			{
+				UNS16 c = (UNS16)(x << 8);
+				for (int b = 0; b < 8; b++)
+					c = (c & 0x8000) ? (UNS16)((c << 1) ^ 0x1021) : (UNS16)(c << 1);
+				t[x] = c;
+			}
+		}
+	};
+	static const table crc;
+
+	UNS16 c = 0;
+	for (std::size_t x = 0; x < len; x++)
+		c = (UNS16)((c << 8) ^ crc.t[((c >> 8) ^ p[x]) & 0xff]);
+	return c;
+   }
+
+// Contents of an object read by block upload, the first 4 bytes are the
+// same (index<<8)|subindex an expedited read returns
+static UNS8 sdo_object_byte(UNS16 index, UNS8 subindex, UNS32 x)
+   {
+	UNS32 v = ((UNS32)index << 8) | subindex;
+	return x < 4 ? (UNS8)(v >> (8 * x)) : (UNS8)(x ^ subindex);
+   }
+
+static void sdo_abort(Message *r, UNS32 code)
+   {
+	r->data[0] = 0x80;
+	r->data[4] = (UNS8)code;
+	r->data[5] = (UNS8)(code >> 8);
+	r->data[6] = (UNS8)(code >> 16);
+	r->data[7] = (UNS8)(code >> 24);
+   }
+
+// Minimal scripted SDO server for the simulated nodes
+void can_null_win32::sdo_server(const Message *m)
+   {
+	UNS8 node = m->cob_id - 0x600;
+	if (node == 0 || node > m_nodes || m->len != 8)
+		return;
+
+	Message r = Message_Initializer;
+	r.cob_id = 0x580 + node;
+	r.len = 8;
+	memcpy(r.data, m->data, 4); // echo index/subindex
+
+	if (m_sdo_block && sdo_block_server(m, node))
+		return;
+
+	UNS8 ccs = m->data[0] >> 5;
+	sdo_block &b = m_block[node];
+	switch (ccs)
+	{
+	case 2: // initiate upload, a 4 byte expedited value unless blob= asks for more
+		if (m_blob <= 4)
+		{
+			r.data[0] = 0x43;
+			r.data[4] = m->data[3];
+			r.data[5] = m->data[1];
+			r.data[6] = m->data[2];
+			break;
+		}
+		r.data[0] = 0x41; // segmented, size indicated
+		r.data[4] = (UNS8)m_blob;
+		r.data[5] = (UNS8)(m_blob >> 8);
+		r.data[6] = (UNS8)(m_blob >> 16);
+		r.data[7] = (UNS8)(m_blob >> 24);
+		b.state = SEGMENT_UPLOAD;
+		b.index = (UNS16)(m->data[1] | (m->data[2] << 8));
+		b.subindex = m->data[3];
+		b.offset = 0;
+		break;
+	case 3: // upload segment, up to 7 more bytes with the client's toggle
+		if (b.state != SEGMENT_UPLOAD)
+		{
+			sdo_abort(&r, 0x05040001);
+			break;
+		}
+		{
+			UNS32 n = std::min<UNS32>(7, m_blob - b.offset);
+			memset(r.data, 0, 8);
+			r.data[0] = (UNS8)((m->data[0] & 0x10) | ((7 - n) << 1));
+			for (UNS32 x = 0; x < n; x++)
+				r.data[1 + x] = sdo_object_byte(b.index, b.subindex, b.offset + x);
+			b.offset += n;
+			if (b.offset >= m_blob)
+			{
+				r.data[0] |= 0x01; // last segment
+				b.state = BLOCK_IDLE;
+			}
+		}
+		break;
+	case 1: // initiate download
+		r.data[0] = 0x60;
+		break;
+	case 0: // download segment, acknowledge with the same toggle
+		memset(r.data, 0, 8);
+		r.data[0] = 0x20 | (m->data[0] & 0x10);
+		break;
+	case 4: // abort from the client, nothing to say
+		b.state = BLOCK_IDLE;
+		return;
+	default: // anything else is a protocol error
+		sdo_abort(&r, 0x05040001); // command specifier not valid
+		break;
+	}
+
+	transmit(&r, false);
+   }
+
+// Block upload and download, returns false if the request is not part of a
+// block transfer so the plain server answers it
+bool can_null_win32::sdo_block_server(const Message *m, UNS8 node)
+   {
+	sdo_block &b = m_block[node];
+	UNS8 cmd = m->data[0];
+
+	Message r = Message_Initializer;
+	r.cob_id = 0x580 + node;
+	r.len = 8;
+
+	if (cmd == 0x80)
+	{
+		b.state = BLOCK_IDLE;
+		return true;
+	}
+
+	// while a sub-block is coming in every frame is a segment, seq in bits 6-0
+	// and bit 7 set on the last one
+	if (b.state == BLOCK_DOWNLOAD)
+	{
+		UNS8 seq = cmd & 0x7f;
+		bool fresh = seq > b.seq;
+
+		if (seq == b.seq + 1)
+		{
+			b.data.insert(b.data.end(), m->data + 1, m->data + 8);
+			b.seq = seq;
+			if (cmd & 0x80)
+				b.state = BLOCK_DOWNLOAD_END;
+		}
+
+		// a missing segment shows up as a short ack, the client resends from there
+		if (fresh && (seq == b.blksize || (cmd & 0x80)))
+		{
+			r.data[0] = 0xa2;
+			r.data[1] = b.seq;
+			r.data[2] = b.blksize;
+			b.seq = 0;
+			transmit(&r, false);
+		}
+
+		return true;
+	}
+
+	UNS8 ccs = cmd >> 5;
+	if (ccs == 6 && (cmd & 0x01) == 0)
+	{
+		// initiate download, we check the CRC so always say so
+		memcpy(r.data, m->data, 4);
+		r.data[0] = 0xa4;
+		r.data[4] = 127;
+		b.state = BLOCK_DOWNLOAD;
+		b.blksize = 127;
+		b.seq = 0;
+		b.data.clear();
+	}
+	else if (ccs == 6 && b.state == BLOCK_DOWNLOAD_END)
+	{
+		UNS8 n = (cmd >> 2) & 0x07;
+		std::size_t len = b.data.size() >= n ? b.data.size() - n : 0;
+		UNS16 crc = (UNS16)(m->data[1] | (m->data[2] << 8));
+
+		if (sdo_crc(b.data.empty() ? NULL : &b.data[0], len) == crc)
+			r.data[0] = 0xa1;
+		else
+			sdo_abort(&r, 0x05040004); // CRC error
+		b.state = BLOCK_IDLE;
+	}
+	else if (ccs == 5 && (cmd & 0x03) == 0)
+	{
+		// initiate upload, switch to an expedited upload if the client allows it for this size
+		UNS8 blksize = m->data[4];
+		UNS8 pst = m->data[5];
+		UNS16 index = (UNS16)(m->data[1] | (m->data[2] << 8));
+
+		memcpy(r.data, m->data, 4);
+		if (pst != 0 && m_blob > 0 && m_blob <= pst && m_blob <= 4)
+		{
+			r.data[0] = (UNS8)(0x43 | ((4 - m_blob) << 2));
+			for (UNS32 x = 0; x < m_blob; x++)
+				r.data[4 + x] = sdo_object_byte(index, m->data[3], x);
+		}
+		else if (blksize == 0 || blksize > 127)
+			sdo_abort(&r, 0x05040002); // invalid block size
+		else
+		{
+			r.data[0] = 0xc6;
+			r.data[4] = (UNS8)m_blob;
+			r.data[5] = (UNS8)(m_blob >> 8);
+			r.data[6] = (UNS8)(m_blob >> 16);
+			r.data[7] = (UNS8)(m_blob >> 24);
+			b.state = BLOCK_UPLOAD_START;
+			b.blksize = blksize;
+			b.index = index;
+			b.subindex = m->data[3];
+			b.offset = 0;
+		}
+	}
+	else if (cmd == 0xa3 && b.state == BLOCK_UPLOAD_START)
+	{
+		b.state = BLOCK_UPLOAD;
+		sdo_block_send(node);
+		return true;
+	}
+	else if ((cmd & 0xe3) == 0xa2 && b.state == BLOCK_UPLOAD)
+	{
+		b.offset = std::min(m_blob, b.offset + 7 * (UNS32)m->data[1]);
+		if (m->data[2] >= 1 && m->data[2] <= 127)
+			b.blksize = m->data[2];
+
+		if (b.offset < m_blob)
+		{
+			sdo_block_send(node);
+			return true;
+		}
+
+		std::vector<UNS8> obj(m_blob);
+		for (UNS32 x = 0; x < m_blob; x++)
+			obj[x] = sdo_object_byte(b.index, b.subindex, x);
+		UNS16 crc = sdo_crc(obj.empty() ? NULL : &obj[0], obj.size());
+
+		r.data[0] = (UNS8)(0xc1 | (((7 - m_blob % 7) % 7) << 2));
+		r.data[1] = (UNS8)crc;
+		r.data[2] = (UNS8)(crc >> 8);
+		b.state = BLOCK_UPLOAD_END;
+	}
+	else if (cmd == 0xa1 && b.state == BLOCK_UPLOAD_END)
+	{
+		b.state = BLOCK_IDLE;
+		return true;
+	}
+	else if (ccs == 5 || ccs == 6)
+	{
+		// a block command out of turn, most likely a duplicate
+		return true;
+	}
+	else
+		return false;
+
+	transmit(&r, false);
+	return true;
+   }
+
+// Send the next upload sub-block, starting with the first byte not acknowledged
+void can_null_win32::sdo_block_send(UNS8 node)
+   {
+	sdo_block &b = m_block[node];
+	UNS32 offset = b.offset;
 
+	for (UNS8 seq = 1; seq <= b.blksize && offset < m_blob; seq++)
+	{
+		Message r = Message_Initializer;
+		r.cob_id = 0x580 + node;
+		r.len = 8;
+		r.data[0] = seq;
+		for (int x = 0; x < 7; x++, offset++)
+		{
+			if (offset < m_blob)
+				r.data[1 + x] = sdo_object_byte(b.index, b.subindex, offset);
+		}
+		if (offset >= m_blob)
+			r.data[0] |= 0x80;
+		transmit(&r, false);
+	}
+   }
+
+// Current time, simulated once set_time() has been called
+gen_clock::time_point can_null_win32::now()
+   {
+	if (m_virtual)
+		return gen_clock::time_point(gen_clock::duration(m_vnow.load()));
+
+	return gen_clock::now();
+   }
+
+// Move everything that is scheduled, used when going from simulated back to real time
+void can_null_win32::rebase(gen_clock::duration d)
+   {
+	for (std::size_t x = 0; x < m_periodic.size(); x++)
+		m_periodic[x].next += d;
+
+	m_emcy_next += d;
+	m_last += d;
+
+	std::lock_guard<std::mutex> l(m_lock);
+	std::priority_queue<in_flight> moved;
+
+	while (!m_flight.empty())
+	{
+		in_flight f = m_flight.top();
+		f.due += d;
+		moved.push(f);
+		m_flight.pop();
+	}
+
+	m_flight.swap(moved);
    }
 
+// Follow a simulated clock, ns may count from any origin, ~0 goes back to the real clock
+void can_null_win32::set_time(UNS64 ns)
+   {
+	if (ns == ~(UNS64)0)
+	{
+		if (m_virtual)
+		{
+			rebase(gen_clock::now() - now());
+			m_virtual = false;
+		}
+		return;
+	}
+
+	gen_clock::duration t = std::chrono::duration_cast<gen_clock::duration>(std::chrono::nanoseconds(ns));
+
+	// carry on from the current steady clock time so nothing already scheduled moves
+	if (!m_virtual)
+		m_voffset = gen_clock::now().time_since_epoch() - t;
+
+	m_vnow = (t + m_voffset).count();
+	m_virtual = true;
+   }
+
+// Simulated time at which receive() next has a frame to return, ~0 if nothing is scheduled
+UNS64 can_null_win32::next_event()
+   {
+	if (!m_virtual || !m_generate)
+		return ~(UNS64)0;
+
+	gen_clock::time_point next = gen_clock::time_point::max();
+
+	if (!m_pending.empty() || m_rate_max)
+		next = now();
+
+	for (std::size_t x = 0; x < m_periodic.size(); x++)
+		next = std::min(next, m_periodic[x].next);
+
+	if (m_emcy_burst > 0)
+		next = std::min(next, m_emcy_next);
+
+	if (m_rate > 0)
+		next = std::min(next, m_last + std::chrono::duration_cast<gen_clock::duration>(std::chrono::duration<double>((1.0 - m_credit) / m_rate)));
+
+	{
+		std::lock_guard<std::mutex> l(m_lock);
+		if (!m_flight.empty())
+			next = std::min(next, m_flight.top().due);
+	}
+
+	if (next == gen_clock::time_point::max())
+		return ~(UNS64)0;
 
+	gen_clock::duration t = next.time_since_epoch() - m_voffset;
+	if (t.count() < 0)
+		return 0;
+
+	// round up, a time just short of the event would never reach it
+	std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t);
+	if (ns < t)
+		ns += std::chrono::nanoseconds(1);
+
+	return (UNS64)ns.count();
+   }
 
 bool can_null_win32::send(const Message *m)
    {
+		if (m_loop)
+			transmit(m, false);
+
+		if (m_sdo && m->cob_id > 0x600 && m->cob_id < 0x680)
+			transmit(m, true);
+
 		return true;
    }
 
@@ -77,6 +971,30 @@ bool can_null_win32::receive(Message *m)
    {
 
 	m->len = 0;
+
+	if (!m_generate)
+		return true;
+
+	if (m_pending.empty())
+	{
+		schedule(now());
+		if (m_flying)
+			deliver(now());
+	}
+
+	if (!m_pending.empty())
+	{
+		*m = m_pending.front();
+		m_pending.pop_front();
+		return true;
+	}
+
+	if (m_rate_max || m_credit >= 1.0)
+	{
+		m_credit -= 1.0;
+		random_frame(m);
+	}
+
 	return true;
    
    }
@@ -95,6 +1013,18 @@ extern "C"
 	   return (UNS8)reinterpret_cast<can_null_win32*>(fd0)->send(m);
    }
 
+extern "C"
+   void __stdcall canSetTime_driver(CAN_HANDLE fd0, UNS64 ns)
+   {
+	   reinterpret_cast<can_null_win32*>(fd0)->set_time(ns);
+   }
+
+extern "C"
+   UNS64 __stdcall canNextEvent_driver(CAN_HANDLE fd0)
+   {
+	   return reinterpret_cast<can_null_win32*>(fd0)->next_event();
+   }
+
 extern "C"
    CAN_HANDLE __stdcall canOpen_driver(s_BOARD *board)
    {
@@ -133,15 +1063,18 @@ void __stdcall NativeCallDelegate(char *pStringValues[], int nValues)
 extern "C" void __stdcall canEnumerate2_driver(setStringValuesCB_t callback)
 {
 	
-	DWORD numDevs = 1;
+	static const char *buses[] = { "null://null1", "null://gen?rate=max&cob=0x181-0x1ff", "null://gen?nodes=8&hb=1000&pdo=10&sdo=1", "null://loop?loop=1&nodes=4&hb=1000&sdo=1&delay=5&jitter=2&drop=0.01" };
+
+	DWORD numDevs = sizeof(buses) / sizeof(buses[0]);
 	gSetStringValuesCB = callback;
 	char **Values = (char**)malloc(sizeof(void*)*numDevs);
 
-	char buf[MAX_BUF_SIZE];
-	sprintf_s(buf, MAX_BUF_SIZE, "null://null1");
-	int len = 1+strnlen_s(buf, MAX_BUF_SIZE);
-	*(Values) = (char*)malloc(len);
-	strcpy_s(*(Values),len, buf);
+	for (DWORD x = 0; x < numDevs; x++)
+	{
+		int len = 1 + (int)strlen(buses[x]);
+		Values[x] = (char*)malloc(len);
+		strcpy_s(Values[x], len, buses[x]);
+	}
 
 	NativeCallDelegate(Values, numDevs);
 }
\ No newline at end of file
@@ -0,0 +1,295 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Capture replay driver
+//
+// The busname is the capture to play back followed by options, eg
+//   replay:///var/log/can/rig1.log
+//   replay:///var/log/can/rig1.log?speed=10&loop=1
+//   replay:///var/log/can/rig1.asc?speed=max
+//   replay:///var/log/can/rig1.ccap?start=3600&cob=0x581,0x601
+//
+//   speed=1    original timing (default)
+//   speed=n    n times faster (or slower for n < 1)
+//   speed=max  as fast as canReceive is called
+//   loop=1     start again from the top at the end of the capture
+//   channel=n  only replay frames captured on channel n
+//   start=s    begin s seconds after the first frame of the capture
+//   cob=a,b    only replay frames with these identifiers
+//
+// start and cob work on every format, on indexed captures they jump straight
+// to the right block and skip blocks without the wanted identifiers.
+//
+// Frames sent to the driver are discarded, it is a read only bus.
+
+#include <string>         // std::string
+#include <cstddef>        // std::size_t
+#include <chrono>
+#include <thread>
+
+#include "can_log/can_log.h"
+
+// Longest we block in one receive call waiting for the next frame to fall due
+#define REPLAY_MAX_WAIT_MS 10
+
+typedef std::chrono::steady_clock replay_clock;
+
+class can_replay
+   {
+   public:
+      class error
+        {
+        };
+	  can_replay(s_BOARD *board);
+	  ~can_replay();
+      bool send(const Message *m);
+      bool receive(Message *m);
+   private:
+      bool fetch();
+   private:
+      can_log_reader m_log;
+      double m_speed;
+      bool m_max;
+      bool m_loop;
+      int m_channel;
+
+      bool m_have;
+      can_wire_frame m_next;
+
+      bool m_started;
+      UNS64 m_first_ts;
+      replay_clock::time_point m_start;
+   };
+
+static std::string option(const std::string &query, const char *key)
+   {
+   std::string k = std::string(key) + "=";
+   std::size_t pos = 0;
+
+   while (pos < query.size())
+      {
+      std::size_t end = query.find('&', pos);
+      if (end == std::string::npos)
+         end = query.size();
+
+      if (query.compare(pos, k.size(), k) == 0)
+         return query.substr(pos + k.size(), end - pos - k.size());
+
+      pos = end + 1;
+      }
+
+   return "";
+   }
+
+can_replay::can_replay(s_BOARD *board) : m_speed(1.0),
+      m_max(false),
+      m_loop(false),
+      m_channel(-1),
+      m_have(false),
+      m_started(false),
+      m_first_ts(0)
+   {
+   std::string bus = board->busname ? board->busname : "";
+   std::string query;
+
+   if (bus.compare(0, 9, "replay://") == 0)
+      bus.erase(0, 9);
+
+   std::size_t q = bus.find('?');
+   if (q != std::string::npos)
+      {
+      query = bus.substr(q + 1);
+      bus.erase(q);
+      }
+
+   std::string v = option(query, "speed");
+   if (v == "max")
+      m_max = true;
+   else if (!v.empty() && atof(v.c_str()) > 0)
+      m_speed = atof(v.c_str());
+
+   m_loop = atoi(option(query, "loop").c_str()) != 0;
+
+   v = option(query, "channel");
+   if (!v.empty())
+      m_channel = atoi(v.c_str());
+
+   if (!m_log.open(bus.c_str()))
+      throw error();
+
+   v = option(query, "start");
+   if (!v.empty())
+      {
+      can_wire_frame first;
+      if (m_log.next(&first))
+         m_log.seek(first.timestamp + (UNS64)(atof(v.c_str()) * 1e9));
+      }
+
+   v = option(query, "cob");
+   for (std::size_t pos = 0; pos < v.size(); )
+      {
+      std::size_t end = v.find(',', pos);
+      if (end == std::string::npos)
+         end = v.size();
+      m_log.filter((UNS32)strtoul(v.substr(pos, end - pos).c_str(), NULL, 0));
+      pos = end + 1;
+      }
+   }
+
+can_replay::~can_replay()
+   {
+   }
+
+bool can_replay::send(const Message *)
+   {
+   return true;
+   }
+
+// Read ahead one frame we can deliver, restarting the clock if we loop
+bool can_replay::fetch()
+   {
+   while (!m_have)
+      {
+      if (!m_log.next(&m_next))
+         {
+         if (!m_loop)
+            return false;
+
+         m_log.rewind();
+         m_started = false;
+         if (!m_log.next(&m_next))
+            return false;
+         }
+
+      if (m_channel >= 0 && m_next.channel != m_channel)
+         continue;
+
+      m_have = true;
+      }
+
+   return true;
+   }
+
+bool can_replay::receive(Message *m)
+   {
+   m->len = 0;
+
+   if (!fetch())
+      {
+      // end of capture, don't spin the caller
+      std::this_thread::sleep_for(std::chrono::milliseconds(REPLAY_MAX_WAIT_MS));
+      return true;
+      }
+
+   if (!m_max)
+      {
+      if (!m_started)
+         {
+         m_started = true;
+         m_first_ts = m_next.timestamp;
+         m_start = replay_clock::now();
+         }
+
+      UNS64 offset = m_next.timestamp > m_first_ts ? m_next.timestamp - m_first_ts : 0;
+      replay_clock::time_point due = m_start + std::chrono::duration_cast<replay_clock::duration>(
+         std::chrono::duration<double, std::nano>((double)offset / m_speed));
+
+      replay_clock::time_point now = replay_clock::now();
+      if (due > now)
+         {
+         replay_clock::duration wait = due - now;
+         if (wait > std::chrono::milliseconds(REPLAY_MAX_WAIT_MS))
+            {
+            std::this_thread::sleep_for(std::chrono::milliseconds(REPLAY_MAX_WAIT_MS));
+            return true;
+            }
+         std::this_thread::sleep_for(wait);
+         }
+      }
+
+   m_have = false;
+
+   // 29 bit frames can't be carried by Message, skip them
+   if (!can_wire_to_message(&m_next, m))
+      m->len = 0;
+
+   return true;
+   }
+
+
+//------------------------------------------------------------------------
+extern "C"
+   UNS8 DLL_CALL(canReceive)(CAN_HANDLE fd0, Message *m)
+   {
+	   return (UNS8)(!(reinterpret_cast<can_replay*>(fd0)->receive(m)));
+   }
+
+extern "C"
+   UNS8 DLL_CALL(canSend)(CAN_HANDLE fd0, Message const *m)
+   {
+	   return (UNS8)reinterpret_cast<can_replay*>(fd0)->send(m);
+   }
+
+extern "C"
+   CAN_HANDLE DLL_CALL(canOpen)(s_BOARD *board)
+   {
+   try
+      {
+		  return (CAN_HANDLE) new can_replay(board);
+      }
+   catch (can_replay::error&)
+      {
+      return NULL;
+      }
+   }
+
+extern "C"
+   int DLL_CALL(canClose)(CAN_HANDLE inst)
+   {
+	   delete reinterpret_cast<can_replay*>(inst);
+   return 1;
+   }
+
+extern "C"
+	UNS8 DLL_CALL(canChangeBaudRate)( CAN_HANDLE fd, char* baud)
+	{
+	return 0;
+	}
+
+typedef void(*setStringValuesCB_t) (char *pStringValues[], int nValues);
+static setStringValuesCB_t gSetStringValuesCB;
+
+void NativeCallDelegate(char *pStringValues[], int nValues)
+{
+	if (gSetStringValuesCB)
+		gSetStringValuesCB(pStringValues, nValues);
+}
+
+// There is nothing to discover, the capture path is the bus name
+extern "C" void canEnumerate2_driver(setStringValuesCB_t callback)
+{
+	gSetStringValuesCB = callback;
+	char **Values = (char**)malloc(sizeof(void*));
+	Values[0] = strdup("replay:///tmp/can.log?speed=1");
+
+	NativeCallDelegate(Values, 1);
+}
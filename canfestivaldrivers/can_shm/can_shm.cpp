@@ -0,0 +1,468 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// POSIX shared memory virtual CAN bus
+//
+// The busname names a shared memory segment, eg "shm://rig1" or "shm://rig1?slots=8192"
+// every process that opens the same name is attached to the same virtual bus.
+//
+// The segment holds a broadcast ring of frames, writers claim a slot with an atomic
+// ticket and publish it with a per slot sequence word, each reader keeps its own cursor
+// so any number of readers can follow the ring without coordinating with each other.
+// A reader that falls more than a ring behind is moved forward and the lost frames are
+// counted as overruns, the count is exported through canOverruns_driver and printed on
+// close. Idle readers sleep on a futex that is only woken when a reader has registered
+// as waiting so the send path does not pay for a syscall on a busy bus.
+
+#include <string>         // std::string
+#include <cstddef>        // std::size_t
+#include <atomic>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+extern "C" {
+#include "can_driver.h"
+}
+
+#define SHM_MAGIC 0x43414E53 // "CANS"
+#define SHM_VERSION 1
+#define SHM_PREFIX "/cansimple_"
+#define SHM_DEFAULT_SLOTS 4096
+#define SHM_SPIN_COUNT 200
+#define SHM_WAIT_MS 10
+
+// Slot sequence word, one more than the ticket last written into the slot shifted
+// up one with the low bit set while a writer is still copying the frame in.
+// Zero is never a valid stamp so untouched slots read as empty
+#define SEQ_BUSY 1ULL
+#define SEQ_STAMP(ticket) (((ticket) + 1) << 1)
+
+struct shm_slot
+   {
+   std::atomic<uint64_t> seq;
+   uint32_t origin;      // handle that sent the frame, so we don't hear our own echo
+   uint32_t pad;
+   Message msg;
+   };
+
+struct shm_header
+   {
+   std::atomic<uint32_t> magic;
+   uint32_t version;
+   uint32_t slots;       // ring size, always a power of 2
+   std::atomic<uint32_t> attached;
+   std::atomic<uint32_t> next_origin;
+   std::atomic<uint32_t> waiters;
+   std::atomic<uint32_t> futex;
+   uint32_t pad;
+   std::atomic<uint64_t> head;  // next ticket to hand out to a writer
+   };
+
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "shared memory atomics must be plain words");
+
+class can_shm
+   {
+   public:
+      class error
+        {
+        };
+	  can_shm(s_BOARD *board);
+	  ~can_shm();
+      bool send(const Message *m);
+      bool receive(Message *m);
+      uint64_t overruns() const { return m_overruns.load(std::memory_order_relaxed); }
+   private:
+      bool open_shm(const std::string &name, uint32_t slots);
+      void close_shm();
+      bool try_read(Message *m);
+      void wait_for_data();
+      shm_slot *slot(uint64_t ticket) { return &m_slots[ticket & (m_hdr->slots - 1)]; }
+   private:
+      std::string m_name;
+      int m_fd;
+      size_t m_size;
+      shm_header *m_hdr;
+      shm_slot *m_slots;
+      uint64_t m_cursor;
+      uint32_t m_origin;
+      std::atomic<uint64_t> m_overruns;   // written by the reading thread, read by canOverruns_driver
+   };
+
+static int futex(std::atomic<uint32_t> *addr, int op, uint32_t val, const struct timespec *ts)
+   {
+   return (int)syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, val, ts, NULL, 0);
+   }
+
+// Accept "shm://name?slots=n", "shm://name" or just "name"
+static void parse_busname(const char *busname, std::string &name, uint32_t &slots)
+   {
+   std::string bus = busname ? busname : "";
+
+   if (bus.compare(0, 6, "shm://") == 0)
+      bus.erase(0, 6);
+
+   slots = SHM_DEFAULT_SLOTS;
+
+   std::size_t q = bus.find('?');
+   if (q != std::string::npos)
+      {
+      std::string args = bus.substr(q + 1);
+      bus.erase(q);
+
+      if (args.compare(0, 6, "slots=") == 0)
+         slots = (uint32_t)strtoul(args.c_str() + 6, NULL, 0);
+      }
+
+   // ring arithmetic relies on a power of 2
+   uint32_t p = 64;
+   while (p < slots && p < (1u << 24))
+      p <<= 1;
+   slots = p;
+
+   if (bus.empty())
+      bus = "bus1";
+
+   name = SHM_PREFIX + bus;
+   }
+
+can_shm::can_shm(s_BOARD *board) : m_fd(-1),
+      m_size(0),
+      m_hdr(NULL),
+      m_slots(NULL),
+      m_cursor(0),
+      m_origin(0),
+      m_overruns(0)
+   {
+   uint32_t slots;
+   parse_busname(board->busname, m_name, slots);
+
+   if (!open_shm(m_name, slots))
+      throw error();
+   }
+
+can_shm::~can_shm()
+   {
+   if (overruns())
+      fprintf(stderr, "shm %s: reader overrun, %llu frames lost in total\n", m_name.c_str(), (unsigned long long)overruns());
+
+   close_shm();
+   }
+
+bool can_shm::open_shm(const std::string &name, uint32_t slots)
+   {
+   bool creator = true;
+
+   m_fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+   if (m_fd < 0 && errno == EEXIST)
+      {
+      creator = false;
+      m_fd = shm_open(name.c_str(), O_RDWR, 0666);
+      }
+
+   if (m_fd < 0)
+      {
+      fprintf(stderr, "shm_open %s: %s\n", name.c_str(), strerror(errno));
+      return false;
+      }
+
+   if (creator)
+      {
+      m_size = sizeof(shm_header) + sizeof(shm_slot) * slots;
+      if (ftruncate(m_fd, (off_t)m_size) < 0)
+         {
+         fprintf(stderr, "ftruncate %s: %s\n", name.c_str(), strerror(errno));
+         close(m_fd);
+         shm_unlink(name.c_str());
+         return false;
+         }
+      }
+   else
+      {
+      // the creator may still be sizing the segment, give it a moment
+      struct stat st;
+      memset(&st, 0, sizeof(st));
+      for (int x = 0; x < 1000; x++)
+         {
+         if (fstat(m_fd, &st) == 0 && st.st_size >= (off_t)sizeof(shm_header))
+            break;
+         usleep(1000);
+         }
+      m_size = (size_t)st.st_size;
+      }
+
+   void *p = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+   if (p == MAP_FAILED)
+      {
+      fprintf(stderr, "mmap %s: %s\n", name.c_str(), strerror(errno));
+      close(m_fd);
+      return false;
+      }
+
+   m_hdr = reinterpret_cast<shm_header*>(p);
+   m_slots = reinterpret_cast<shm_slot*>(m_hdr + 1);
+
+   if (creator)
+      {
+      // fresh segments are zero filled so only the fixed fields need setting,
+      // publishing the magic last lets other openers know the ring is ready
+      m_hdr->version = SHM_VERSION;
+      m_hdr->slots = slots;
+      m_hdr->magic.store(SHM_MAGIC, std::memory_order_release);
+      }
+   else
+      {
+      for (int x = 0; x < 1000 && m_hdr->magic.load(std::memory_order_acquire) != SHM_MAGIC; x++)
+         usleep(1000);
+
+      if (m_hdr->magic.load(std::memory_order_acquire) != SHM_MAGIC || m_hdr->version != SHM_VERSION ||
+         m_size < sizeof(shm_header) + sizeof(shm_slot) * m_hdr->slots)
+         {
+         fprintf(stderr, "shm %s: not a compatible can bus segment\n", name.c_str());
+         munmap(p, m_size);
+         close(m_fd);
+         m_hdr = NULL;
+         return false;
+         }
+      }
+
+   m_hdr->attached.fetch_add(1);
+   m_origin = m_hdr->next_origin.fetch_add(1) + 1;
+
+   // new readers only see traffic sent after they joined
+   m_cursor = m_hdr->head.load(std::memory_order_acquire);
+
+   return true;
+   }
+
+void can_shm::close_shm()
+   {
+   if (m_hdr == NULL)
+      return;
+
+   // last one out removes the name, anyone still mapped keeps their view
+   if (m_hdr->attached.fetch_sub(1) == 1)
+      shm_unlink(m_name.c_str());
+
+   munmap(m_hdr, m_size);
+   close(m_fd);
+   m_hdr = NULL;
+   }
+
+bool can_shm::send(const Message *m)
+   {
+   uint64_t ticket = m_hdr->head.fetch_add(1, std::memory_order_acq_rel);
+   shm_slot *s = slot(ticket);
+
+   s->seq.store(SEQ_STAMP(ticket) | SEQ_BUSY, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+
+   s->origin = m_origin;
+   s->msg = *m;
+
+   s->seq.store(SEQ_STAMP(ticket), std::memory_order_release);
+
+   m_hdr->futex.fetch_add(1, std::memory_order_release);
+   if (m_hdr->waiters.load(std::memory_order_acquire) != 0)
+      futex(&m_hdr->futex, FUTEX_WAKE, INT32_MAX, NULL);
+
+   return true;
+   }
+
+// Pull the frame under our cursor if it has been published, returns false
+// when we have caught up with the writers
+bool can_shm::try_read(Message *m)
+   {
+   for (;;)
+      {
+      shm_slot *s = slot(m_cursor);
+      uint64_t seq = s->seq.load(std::memory_order_acquire);
+      uint64_t expected = SEQ_STAMP(m_cursor);
+
+      if ((seq & ~SEQ_BUSY) < expected || seq == (expected | SEQ_BUSY))
+         {
+         // not published yet, unless the writer that claimed it died and the
+         // ring has since moved a whole lap past us
+         if (m_hdr->head.load(std::memory_order_acquire) - m_cursor <= m_hdr->slots)
+            return false;
+         }
+      else if (seq == expected)
+         {
+         uint32_t origin = s->origin;
+         Message copy = s->msg;
+
+         std::atomic_thread_fence(std::memory_order_acquire);
+         if (s->seq.load(std::memory_order_relaxed) == seq)
+            {
+            m_cursor++;
+            if (origin == m_origin)
+               continue;
+
+            *m = copy;
+            return true;
+            }
+         }
+
+      // A writer has lapped us, skip forward to the oldest frame still in the ring
+      uint64_t head = m_hdr->head.load(std::memory_order_acquire);
+      uint64_t oldest = head > m_hdr->slots ? head - m_hdr->slots : 0;
+      if (oldest <= m_cursor)
+         oldest = m_cursor + 1;
+
+      m_overruns.fetch_add(oldest - m_cursor, std::memory_order_relaxed);
+      MSG_ERR_DRV("shm %s: reader overrun, %llu frames lost\n", m_name.c_str(), (unsigned long long)(oldest - m_cursor));
+      m_cursor = oldest;
+      }
+   }
+
+void can_shm::wait_for_data()
+   {
+   uint32_t seen = m_hdr->futex.load(std::memory_order_acquire);
+
+   for (int x = 0; x < SHM_SPIN_COUNT; x++)
+      {
+      if (m_hdr->head.load(std::memory_order_acquire) != m_cursor)
+         return;
+      }
+
+   m_hdr->waiters.fetch_add(1, std::memory_order_acq_rel);
+
+   if (m_hdr->head.load(std::memory_order_acquire) == m_cursor)
+      {
+      struct timespec ts;
+      ts.tv_sec = 0;
+      ts.tv_nsec = SHM_WAIT_MS * 1000000L;
+      futex(&m_hdr->futex, FUTEX_WAIT, seen, &ts);
+      }
+
+   m_hdr->waiters.fetch_sub(1, std::memory_order_acq_rel);
+   }
+
+bool can_shm::receive(Message *m)
+   {
+   if (try_read(m))
+      return true;
+
+   // Nothing pending, park for a short while so the rx thread is not burning a core
+   wait_for_data();
+
+   if (try_read(m))
+      return true;
+
+   m->len = 0;
+   return true;
+   }
+
+
+//------------------------------------------------------------------------
+extern "C"
+   UNS8 DLL_CALL(canReceive)(CAN_HANDLE fd0, Message *m)
+   {
+	   return (UNS8)(!(reinterpret_cast<can_shm*>(fd0)->receive(m)));
+   }
+
+extern "C"
+   UNS8 DLL_CALL(canSend)(CAN_HANDLE fd0, Message const *m)
+   {
+	   return (UNS8)reinterpret_cast<can_shm*>(fd0)->send(m);
+   }
+
+extern "C"
+   CAN_HANDLE DLL_CALL(canOpen)(s_BOARD *board)
+   {
+   try
+      {
+		  return (CAN_HANDLE) new can_shm(board);
+      }
+   catch (can_shm::error&)
+      {
+      return NULL;
+      }
+   }
+
+extern "C"
+   int DLL_CALL(canClose)(CAN_HANDLE inst)
+   {
+	   delete reinterpret_cast<can_shm*>(inst);
+   return 1;
+   }
+
+extern "C"
+	UNS8 DLL_CALL(canChangeBaudRate)( CAN_HANDLE fd, char* baud)
+	{
+	return 0;
+	}
+
+/**
+ * @brief Frames this handle has lost by falling more than a ring behind the writers
+ */
+extern "C"
+   UNS64 DLL_CALL(canOverruns)(CAN_HANDLE fd0)
+   {
+	   return reinterpret_cast<can_shm*>(fd0)->overruns();
+   }
+
+typedef void(*setStringValuesCB_t) (char *pStringValues[], int nValues);
+static setStringValuesCB_t gSetStringValuesCB;
+
+void NativeCallDelegate(char *pStringValues[], int nValues)
+{
+	if (gSetStringValuesCB)
+		gSetStringValuesCB(pStringValues, nValues);
+}
+
+// Report every bus that currently exists in /dev/shm, or a default bus to create
+extern "C" void canEnumerate2_driver(setStringValuesCB_t callback)
+{
+	std::vector<std::string> buses;
+
+	DIR *d = opendir("/dev/shm");
+	if (d)
+	{
+		struct dirent *e;
+		while ((e = readdir(d)) != NULL)
+		{
+			if (strncmp(e->d_name, SHM_PREFIX + 1, strlen(SHM_PREFIX) - 1) == 0)
+				buses.push_back(std::string("shm://") + (e->d_name + strlen(SHM_PREFIX) - 1));
+		}
+		closedir(d);
+	}
+
+	if (buses.empty())
+		buses.push_back("shm://bus1");
+
+	gSetStringValuesCB = callback;
+	char **Values = (char**)malloc(sizeof(void*)*buses.size());
+
+	for (size_t x = 0; x < buses.size(); x++)
+		Values[x] = strdup(buses[x].c_str());
+
+	NativeCallDelegate(Values, (int)buses.size());
+}
@@ -0,0 +1,614 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Linux SocketCAN driver
+//
+// The busname is the interface, optionally with a query, eg
+//   can0
+//   socketcan://vcan0?filter=0x580:0x780,0x700:0x780&rcvbuf=4194304
+//   /dev/serial/by-id/usb-Protofusion_Labs_CANable_...-if00
+//
+// A tty path attaches an SLCAN adapter first, as slcand would (needs
+// CAP_NET_ADMIN): the bitrate is set from the baudrate given to canOpen, the
+// tty is switched to the slcan line discipline and the interface the kernel
+// creates for it is brought up and used. Closing detaches it again.
+//
+//   filter=id:mask,..  kernel side CAN_RAW_FILTER, only matching frames are
+//                      ever copied to us (default everything)
+//   rcvbuf=bytes       socket receive buffer, sized to ride out bursts while
+//                      the host is busy (default 1MB, SO_RCVBUFFORCE is tried
+//                      first so root can go past rmem_max)
+//   batch=n            frames moved per recvmmsg/sendmmsg call (default 64),
+//                      batch=1 moves one frame per syscall
+//   own=1              also receive frames this socket sent
+//
+// Frames are received in batches with recvmmsg into a per handle array and
+// handed out one per canReceive call. Sends go straight out with write while
+// the kernel queue has room, if it fills (ENOBUFS on a saturated bus) frames
+// are held and flushed with sendmmsg instead of being lost.
+//
+// Receive timestamps come from SO_TIMESTAMPING (hardware if the controller
+// provides them, else the kernel software stamp), the time of the frame last
+// returned by canReceive is available through canLastTimestamp_driver.
+
+#include <string>         // std::string
+#include <cstddef>        // std::size_t
+#include <vector>
+#include <deque>
+#include <mutex>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+#include <termios.h>
+
+extern "C" {
+#include "can_driver.h"
+}
+
+#include "can_enum/can_enum.h"
+
+#define SOCKETCAN_DEFAULT_BATCH 64
+#define SOCKETCAN_MAX_BATCH 1024
+#define SOCKETCAN_DEFAULT_RCVBUF (1024 * 1024)
+#define SOCKETCAN_WAIT_MS 10
+#define SOCKETCAN_TX_QUEUE_MAX 4096
+
+#ifndef SO_TIMESTAMPING
+#define SO_TIMESTAMPING 37
+#endif
+
+#ifndef N_SLCAN
+#define N_SLCAN 17
+#endif
+
+#ifndef SCM_TIMESTAMPING
+#define SCM_TIMESTAMPING SO_TIMESTAMPING
+#endif
+
+// Control buffer big enough for one struct scm_timestamping (3 timespecs)
+#define SOCKETCAN_CMSG_SIZE CMSG_SPACE(sizeof(struct timespec) * 3)
+
+class can_socketcan
+   {
+   public:
+      class error
+        {
+        };
+	  can_socketcan(s_BOARD *board);
+	  ~can_socketcan();
+      bool send(const Message *m);
+      bool receive(Message *m);
+      UNS64 timestamp() const { return m_last_ts; }
+   private:
+      void parse(const std::string &query);
+      bool attach_slcan(const std::string &tty, const char *baud);
+      void release();
+      bool fill();
+      void flush_tx();
+      static UNS64 stamp(struct msghdr *h);
+   private:
+      int m_fd;
+      int m_tty;   // SLCAN adapter we attached, -1 for a plain interface
+      std::string m_ifname;
+      int m_batch;
+      int m_rcvbuf;
+      bool m_own;
+      std::vector<struct can_filter> m_filters;
+
+      // receive batch, m_next frames of m_count already handed out
+      std::vector<struct can_frame> m_rx;
+      std::vector<struct iovec> m_rx_iov;
+      std::vector<struct mmsghdr> m_rx_msgs;
+      std::vector<UNS8> m_rx_cmsg;
+      std::vector<UNS64> m_rx_ts;
+      int m_count;
+      int m_next;
+      UNS64 m_last_ts;
+
+      // frames the kernel had no room for, sent in order before anything new
+      std::mutex m_tx_lock;
+      std::deque<struct can_frame> m_tx;
+      std::vector<struct can_frame> m_tx_batch;
+      std::vector<struct iovec> m_tx_iov;
+      std::vector<struct mmsghdr> m_tx_msgs;
+      UNS64 m_tx_dropped;
+   };
+
+static std::string query_value(const std::string &query, const char *key)
+   {
+   std::string k = std::string(key) + "=";
+   std::size_t pos = 0;
+
+   while (pos < query.size())
+      {
+      std::size_t end = query.find('&', pos);
+      if (end == std::string::npos)
+         end = query.size();
+
+      if (query.compare(pos, k.size(), k) == 0)
+         return query.substr(pos + k.size(), end - pos - k.size());
+
+      pos = end + 1;
+      }
+
+   return "";
+   }
+
+can_socketcan::can_socketcan(s_BOARD *board) : m_fd(-1),
+      m_tty(-1),
+      m_batch(SOCKETCAN_DEFAULT_BATCH),
+      m_rcvbuf(SOCKETCAN_DEFAULT_RCVBUF),
+      m_own(false),
+      m_count(0),
+      m_next(0),
+      m_last_ts(0),
+      m_tx_dropped(0)
+   {
+   std::string bus = board->busname ? board->busname : "";
+
+   if (bus.compare(0, 12, "socketcan://") == 0)
+      bus.erase(0, 12);
+
+   std::size_t q = bus.find('?');
+   if (q != std::string::npos)
+      {
+      parse(bus.substr(q + 1));
+      bus.erase(q);
+      }
+   m_ifname = bus;
+
+   if (bus.compare(0, 5, "/dev/") == 0 && !attach_slcan(bus, board->baudrate))
+      throw error();
+
+   m_fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+   if (m_fd < 0)
+      {
+      fprintf(stderr, "socketcan: socket: %s\n", strerror(errno));
+      release();
+      throw error();
+      }
+
+   struct ifreq ifr;
+   memset(&ifr, 0, sizeof(ifr));
+   snprintf(ifr.ifr_name, IFNAMSIZ, "%s", m_ifname.c_str());
+   if (ioctl(m_fd, SIOCGIFINDEX, &ifr) < 0)
+      {
+      fprintf(stderr, "socketcan: %s: %s\n", m_ifname.c_str(), strerror(errno));
+      release();
+      throw error();
+      }
+
+   if (!m_filters.empty())
+      setsockopt(m_fd, SOL_CAN_RAW, CAN_RAW_FILTER, &m_filters[0], (socklen_t)(m_filters.size() * sizeof(struct can_filter)));
+
+   int own = m_own ? 1 : 0;
+   setsockopt(m_fd, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &own, sizeof(own));
+
+   if (setsockopt(m_fd, SOL_SOCKET, SO_RCVBUFFORCE, &m_rcvbuf, sizeof(m_rcvbuf)) < 0)
+      setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &m_rcvbuf, sizeof(m_rcvbuf));
+
+   int ts = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+            SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+   if (setsockopt(m_fd, SOL_SOCKET, SO_TIMESTAMPING, &ts, sizeof(ts)) < 0)
+      fprintf(stderr, "socketcan: %s: no kernel timestamps: %s\n", m_ifname.c_str(), strerror(errno));
+
+   // canReceive must come back now and then even on a silent bus
+   struct timeval tv;
+   tv.tv_sec = 0;
+   tv.tv_usec = SOCKETCAN_WAIT_MS * 1000;
+   setsockopt(m_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+   struct sockaddr_can addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.can_family = AF_CAN;
+   addr.can_ifindex = ifr.ifr_ifindex;
+   if (bind(m_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      {
+      fprintf(stderr, "socketcan: bind %s: %s\n", m_ifname.c_str(), strerror(errno));
+      release();
+      throw error();
+      }
+
+   // everything recvmmsg/sendmmsg needs is set up once here
+   m_rx.resize(m_batch);
+   m_rx_iov.resize(m_batch);
+   m_rx_msgs.resize(m_batch);
+   m_rx_cmsg.resize(m_batch * SOCKETCAN_CMSG_SIZE);
+   m_rx_ts.resize(m_batch);
+
+   for (int x = 0; x < m_batch; x++)
+      {
+      m_rx_iov[x].iov_base = &m_rx[x];
+      m_rx_iov[x].iov_len = sizeof(struct can_frame);
+      }
+
+   m_tx_batch.resize(m_batch);
+   m_tx_iov.resize(m_batch);
+   m_tx_msgs.resize(m_batch);
+
+   for (int x = 0; x < m_batch; x++)
+      {
+      m_tx_iov[x].iov_base = &m_tx_batch[x];
+      m_tx_iov[x].iov_len = sizeof(struct can_frame);
+      memset(&m_tx_msgs[x], 0, sizeof(struct mmsghdr));
+      m_tx_msgs[x].msg_hdr.msg_iov = &m_tx_iov[x];
+      m_tx_msgs[x].msg_hdr.msg_iovlen = 1;
+      }
+   }
+
+can_socketcan::~can_socketcan()
+   {
+   if (m_tx_dropped)
+      fprintf(stderr, "socketcan %s: %llu frames could not be sent\n", m_ifname.c_str(), (unsigned long long)m_tx_dropped);
+
+   release();
+   }
+
+void can_socketcan::release()
+   {
+   if (m_fd >= 0)
+      ::close(m_fd);
+   m_fd = -1;
+
+   if (m_tty >= 0)
+      {
+      int ldisc = N_TTY;
+      ioctl(m_tty, TIOCSETD, &ldisc);
+      if (write(m_tty, "C\r", 2) < 0)
+         {
+         }
+      ::close(m_tty);
+      m_tty = -1;
+      }
+   }
+
+// What slcand does: set the bitrate, open the channel, hand the tty to the kernel
+bool can_socketcan::attach_slcan(const std::string &tty, const char *baud)
+   {
+   static const char *rates[] = { "10K", "20K", "50K", "100K", "125K", "250K", "500K", "800K", "1M" };
+
+   int speed = 6;
+   for (int x = 0; x < 9; x++)
+      if (baud && strcmp(baud, rates[x]) == 0)
+         speed = x;
+
+   m_tty = ::open(tty.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+   if (m_tty < 0)
+      {
+      fprintf(stderr, "socketcan: %s: %s\n", tty.c_str(), strerror(errno));
+      return false;
+      }
+
+   struct termios t;
+   if (tcgetattr(m_tty, &t) == 0)
+      {
+      cfmakeraw(&t);
+      cfsetispeed(&t, B115200);
+      cfsetospeed(&t, B115200);
+      tcsetattr(m_tty, TCSANOW, &t);
+      }
+
+   char cmd[16];
+   int len = snprintf(cmd, sizeof(cmd), "C\rS%d\rO\r", speed);
+   if (write(m_tty, cmd, len) != len)
+      {
+      fprintf(stderr, "socketcan: %s: %s\n", tty.c_str(), strerror(errno));
+      release();
+      return false;
+      }
+   tcdrain(m_tty);
+
+   int ldisc = N_SLCAN;
+   char name[IFNAMSIZ];
+   memset(name, 0, sizeof(name));
+   if (ioctl(m_tty, TIOCSETD, &ldisc) < 0 || ioctl(m_tty, SIOCGIFNAME, name) < 0)
+      {
+      fprintf(stderr, "socketcan: %s: can't attach slcan: %s\n", tty.c_str(), strerror(errno));
+      release();
+      return false;
+      }
+   m_ifname = name;
+
+   // the new interface starts down
+   int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+   struct ifreq ifr;
+   memset(&ifr, 0, sizeof(ifr));
+   snprintf(ifr.ifr_name, IFNAMSIZ, "%s", name);
+   bool up = fd >= 0 && ioctl(fd, SIOCGIFFLAGS, &ifr) == 0;
+   if (up)
+      {
+      ifr.ifr_flags |= IFF_UP;
+      up = ioctl(fd, SIOCSIFFLAGS, &ifr) == 0;
+      }
+   if (fd >= 0)
+      ::close(fd);
+
+   if (!up)
+      {
+      fprintf(stderr, "socketcan: %s: can't bring up %s: %s\n", tty.c_str(), name, strerror(errno));
+      release();
+      return false;
+      }
+
+   return true;
+   }
+
+void can_socketcan::parse(const std::string &query)
+   {
+   std::string v = query_value(query, "filter");
+
+   for (std::size_t pos = 0; pos < v.size(); )
+      {
+      std::size_t end = v.find(',', pos);
+      if (end == std::string::npos)
+         end = v.size();
+
+      char *p;
+      struct can_filter f;
+      f.can_id = (canid_t)strtoul(v.c_str() + pos, &p, 0);
+      f.can_mask = (*p == ':') ? (canid_t)strtoul(p + 1, NULL, 0) : CAN_SFF_MASK;
+      m_filters.push_back(f);
+
+      pos = end + 1;
+      }
+
+   v = query_value(query, "batch");
+   if (!v.empty())
+      m_batch = std::max(1, std::min(SOCKETCAN_MAX_BATCH, atoi(v.c_str())));
+
+   v = query_value(query, "rcvbuf");
+   if (!v.empty())
+      m_rcvbuf = atoi(v.c_str());
+
+   m_own = atoi(query_value(query, "own").c_str()) != 0;
+   }
+
+// Receive time of a frame, hardware stamp if there is one
+UNS64 can_socketcan::stamp(struct msghdr *h)
+   {
+   for (struct cmsghdr *c = CMSG_FIRSTHDR(h); c != NULL; c = CMSG_NXTHDR(h, c))
+      {
+      if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPING)
+         continue;
+
+      struct timespec ts[3];
+      memcpy(ts, CMSG_DATA(c), sizeof(ts));
+
+      const struct timespec &t = (ts[2].tv_sec || ts[2].tv_nsec) ? ts[2] : ts[0];
+      return (UNS64)t.tv_sec * 1000000000ULL + (UNS64)t.tv_nsec;
+      }
+
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   return (UNS64)now.tv_sec * 1000000000ULL + (UNS64)now.tv_nsec;
+   }
+
+// Pull the next batch from the kernel, waits up to SOCKETCAN_WAIT_MS for the first frame
+bool can_socketcan::fill()
+   {
+   m_count = 0;
+   m_next = 0;
+
+   for (int x = 0; x < m_batch; x++)
+      {
+      struct msghdr &h = m_rx_msgs[x].msg_hdr;
+      h.msg_name = NULL;
+      h.msg_namelen = 0;
+      h.msg_iov = &m_rx_iov[x];
+      h.msg_iovlen = 1;
+      h.msg_control = &m_rx_cmsg[x * SOCKETCAN_CMSG_SIZE];
+      h.msg_controllen = SOCKETCAN_CMSG_SIZE;
+      h.msg_flags = 0;
+      m_rx_msgs[x].msg_len = 0;
+      }
+
+   int n = recvmmsg(m_fd, &m_rx_msgs[0], (unsigned)m_batch, MSG_WAITFORONE, NULL);
+   if (n <= 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+   for (int x = 0; x < n; x++)
+      m_rx_ts[x] = stamp(&m_rx_msgs[x].msg_hdr);
+
+   m_count = n;
+   return true;
+   }
+
+bool can_socketcan::receive(Message *m)
+   {
+   m->len = 0;
+
+   {
+   std::lock_guard<std::mutex> l(m_tx_lock);
+   if (!m_tx.empty())
+      flush_tx();
+   }
+
+   while (m_next >= m_count)
+      {
+      if (!fill())
+         {
+         fprintf(stderr, "socketcan %s: %s\n", m_ifname.c_str(), strerror(errno));
+         return false;
+         }
+      if (m_count == 0)
+         return true; // nothing within SOCKETCAN_WAIT_MS
+      }
+
+   const struct can_frame &f = m_rx[m_next];
+   m_last_ts = m_rx_ts[m_next];
+   m_next++;
+
+   // Message only carries 11 bit ids and has no notion of error frames
+   if (f.can_id & (CAN_EFF_FLAG | CAN_ERR_FLAG))
+      return true;
+
+   m->cob_sender_id = 0;
+   m->cob_id = (UNS16)(f.can_id & CAN_SFF_MASK);
+   m->rtr = (f.can_id & CAN_RTR_FLAG) ? 1 : 0;
+   m->len = f.can_dlc > 8 ? 8 : f.can_dlc;
+   memcpy(m->data, f.data, 8);
+
+   return true;
+   }
+
+// Send what we were holding, called with m_tx_lock held
+void can_socketcan::flush_tx()
+   {
+   while (!m_tx.empty())
+      {
+      int n = 0;
+      while (n < m_batch && n < (int)m_tx.size())
+         {
+         m_tx_batch[n] = m_tx[n];
+         n++;
+         }
+
+      int sent = n == 1 ? (::send(m_fd, &m_tx_batch[0], sizeof(struct can_frame), MSG_DONTWAIT) == sizeof(struct can_frame) ? 1 : -1)
+                        : sendmmsg(m_fd, &m_tx_msgs[0], (unsigned)n, MSG_DONTWAIT);
+      if (sent <= 0)
+         return; // still full, try again on the next send or receive
+
+      m_tx.erase(m_tx.begin(), m_tx.begin() + sent);
+      }
+   }
+
+bool can_socketcan::send(const Message *m)
+   {
+   struct can_frame f;
+   memset(&f, 0, sizeof(f));
+   f.can_id = m->cob_id & CAN_SFF_MASK;
+   if (m->rtr)
+      f.can_id |= CAN_RTR_FLAG;
+   f.can_dlc = m->len > 8 ? 8 : m->len;
+   memcpy(f.data, m->data, 8);
+
+   std::lock_guard<std::mutex> l(m_tx_lock);
+
+   if (m_tx.empty())
+      {
+      ssize_t n = ::send(m_fd, &f, sizeof(f), MSG_DONTWAIT);
+      if (n == sizeof(f))
+         return true;
+
+      if (errno != ENOBUFS && errno != EAGAIN)
+         {
+         fprintf(stderr, "socketcan %s: send: %s\n", m_ifname.c_str(), strerror(errno));
+         return false;
+         }
+      }
+
+   // keep frame order, anything new waits behind what the kernel already refused
+   if (m_tx.size() >= SOCKETCAN_TX_QUEUE_MAX)
+      {
+      m_tx_dropped++;
+      return false;
+      }
+
+   m_tx.push_back(f);
+   flush_tx();
+   return true;
+   }
+
+
+//------------------------------------------------------------------------
+extern "C"
+   UNS8 DLL_CALL(canReceive)(CAN_HANDLE fd0, Message *m)
+   {
+	   return (UNS8)(!(reinterpret_cast<can_socketcan*>(fd0)->receive(m)));
+   }
+
+extern "C"
+   UNS8 DLL_CALL(canSend)(CAN_HANDLE fd0, Message const *m)
+   {
+	   return (UNS8)reinterpret_cast<can_socketcan*>(fd0)->send(m);
+   }
+
+extern "C"
+   CAN_HANDLE DLL_CALL(canOpen)(s_BOARD *board)
+   {
+   try
+      {
+		  return (CAN_HANDLE) new can_socketcan(board);
+      }
+   catch (can_socketcan::error&)
+      {
+      return NULL;
+      }
+   }
+
+extern "C"
+   int DLL_CALL(canClose)(CAN_HANDLE inst)
+   {
+	   delete reinterpret_cast<can_socketcan*>(inst);
+   return 1;
+   }
+
+// The bitrate belongs to the interface (ip link set can0 type can bitrate 125000)
+extern "C"
+	UNS8 DLL_CALL(canChangeBaudRate)( CAN_HANDLE fd, char* baud)
+	{
+	return 0;
+	}
+
+/**
+ * @brief Receive time in ns (CLOCK_REALTIME) of the frame last returned by canReceive_driver
+ */
+extern "C"
+   UNS64 DLL_CALL(canLastTimestamp)(CAN_HANDLE fd0)
+   {
+	   return reinterpret_cast<can_socketcan*>(fd0)->timestamp();
+   }
+
+typedef void(*setStringValuesCB_t) (char *pStringValues[], int nValues);
+static setStringValuesCB_t gSetStringValuesCB;
+
+void NativeCallDelegate(char *pStringValues[], int nValues)
+{
+	if (gSetStringValuesCB)
+		gSetStringValuesCB(pStringValues, nValues);
+}
+
+// SocketCAN interfaces then USB serial ttys that may be SLCAN adapters, both from the
+// can_enum cache so this returns at once however many adapters are plugged in
+extern "C" void canEnumerate2_driver(setStringValuesCB_t callback)
+{
+	can_enum &e = can_enum::instance();
+	std::vector<std::string> names = e.interfaces();
+	std::vector<std::string> ttys = e.serial_ports();
+	names.insert(names.end(), ttys.begin(), ttys.end());
+
+	gSetStringValuesCB = callback;
+	char **Values = (char**)malloc(sizeof(void*) * (names.size() ? names.size() : 1));
+
+	for (std::size_t x = 0; x < names.size(); x++)
+		Values[x] = strdup(names[x].c_str());
+
+	NativeCallDelegate(Values, (int)names.size());
+}
@@ -0,0 +1,608 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Recording tee driver
+//
+// Wraps any other driver and records everything it sends and receives, the
+// application just opens a different busname, eg
+//   tee://can_canusb_win32/COM4?out=/var/log/can.bin
+//   tee://can_socketcan/can0?out=/var/log/can.bin&queue=65536
+//
+// The first path element is the inner driver, loaded as <name>.so from the
+// library search path, the rest is handed to the inner driver as its busname.
+// The query is a list of &-separated key=value pairs, ours are taken out and
+// any others are passed on to the inner driver, eg
+//   tee://can_socketcan/can0?filter=0x700:0x780&out=/var/log/can.bin
+// Our options
+//   out=path  where to record, required (it can't contain a &)
+//   queue=n   frames buffered between the bus and the writer (default 65536)
+//   format=indexed  write an indexed block capture (can_cap.h) instead of
+//             appending can_wire batches, the file is replaced, not appended to
+//   format=archive  indexed capture with compressed blocks (can_pack.h), blocks
+//             are only written once full so a crash loses up to one block
+//   format=pcapng  pcapng with LINKTYPE_CAN_SOCKETCAN for Wireshark (can_pcap.h),
+//             out=- streams it to stdout
+//
+// Frames are copied into single producer rings (one for rx, one for tx) and a
+// background thread drains them into large sequential writes, so the receive
+// path never touches the file. The application may send from several threads,
+// they take turns on the tx ring under m_tx_lock. Sends the inner driver fails
+// are not recorded. If the writer falls behind, frames are dropped
+// rather than blocking the bus and the count is reported on stderr.
+//
+// The output is can_wire.h batches with timestamps (CLOCK_REALTIME ns), frames
+// we transmitted have CAN_WIRE_ID_TX set. can_replay reads either directly.
+// If the inner driver exports canLastTimestamp_driver its receive time is
+// recorded instead of the time we saw the frame.
+
+#include <string>         // std::string
+#include <cstddef>        // std::size_t
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <chrono>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <time.h>
+
+extern "C" {
+#include "can_driver.h"
+#include "can_wire.h"
+}
+
+#include "can_log/can_log.h"
+#include "can_log/can_pack.h"
+#include "can_log/can_pcap.h"
+
+#define TEE_DEFAULT_QUEUE 65536
+#define TEE_WRITE_BUFFER (1024 * 1024)
+#define TEE_FLUSH_MS 100
+
+typedef UNS8 (*canReceive_t)(CAN_HANDLE, Message *);
+typedef UNS8 (*canSendDrv_t)(CAN_HANDLE, Message const *);
+typedef CAN_HANDLE (*canOpen_t)(s_BOARD *);
+typedef int (*canClose_t)(CAN_HANDLE);
+typedef UNS8 (*canChangeBaudRate_t)(CAN_HANDLE, char *);
+typedef UNS64 (*canLastTimestamp_t)(CAN_HANDLE);
+
+// Lock free single producer single consumer ring
+class tee_ring
+   {
+   public:
+      tee_ring(std::size_t size) : m_buf(size), m_mask(size - 1), m_head(0), m_tail(0), m_dropped(0)
+         {
+         }
+
+      bool push(const can_wire_frame &r)
+         {
+         std::size_t head = m_head.load(std::memory_order_relaxed);
+         if (head - m_tail.load(std::memory_order_acquire) > m_mask)
+            {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+            }
+
+         m_buf[head & m_mask] = r;
+         m_head.store(head + 1, std::memory_order_release);
+         return true;
+         }
+
+      bool pop(can_wire_frame &r)
+         {
+         std::size_t tail = m_tail.load(std::memory_order_relaxed);
+         if (tail == m_head.load(std::memory_order_acquire))
+            return false;
+
+         r = m_buf[tail & m_mask];
+         m_tail.store(tail + 1, std::memory_order_release);
+         return true;
+         }
+
+      UNS64 dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+   private:
+      std::vector<can_wire_frame> m_buf;
+      std::size_t m_mask;
+      std::atomic<std::size_t> m_head;
+      std::atomic<std::size_t> m_tail;
+      std::atomic<UNS64> m_dropped;
+   };
+
+class can_tee
+   {
+   public:
+      class error
+        {
+        };
+	  can_tee(s_BOARD *board);
+	  ~can_tee();
+      UNS8 send(const Message *m);
+      UNS8 receive(Message *m);
+      UNS8 baudrate(char *baud);
+   private:
+      bool load_inner(const std::string &name);
+      void record(tee_ring &ring, const Message *m, UNS32 flags, UNS64 ts);
+      void writer();
+      std::size_t drain(tee_ring &ring, std::vector<UNS8> &buf);
+      std::size_t drain(tee_ring &ring, can_cap_writer &cap);
+      std::size_t drain(tee_ring &ring, can_pcap_writer &pcap);
+      void flush(std::vector<UNS8> &buf);
+   private:
+      void *m_lib;
+      CAN_HANDLE m_inner;
+      canReceive_t m_receive;
+      canSendDrv_t m_send;
+      canOpen_t m_open;
+      canClose_t m_close;
+      canChangeBaudRate_t m_baudrate;
+      canLastTimestamp_t m_timestamp;
+
+      int m_fd;
+      can_cap_writer *m_cap;
+      bool m_cap_flush;
+      can_pcap_writer *m_pcap;
+      std::string m_path;
+      tee_ring *m_rx;
+      tee_ring *m_tx;
+      std::mutex m_tx_lock;   // m_tx has a single producer, sends may come from any thread
+      std::atomic<bool> m_run;
+      std::thread m_writer;
+      UNS64 m_reported;
+   };
+
+// Value of key in a &-separated key=value query, or "" if not there
+static std::string query_value(const std::string &query, const char *key)
+   {
+   std::string k = std::string(key) + "=";
+   std::size_t pos = 0;
+
+   while (pos < query.size())
+      {
+      std::size_t end = query.find('&', pos);
+      if (end == std::string::npos)
+         end = query.size();
+
+      if (query.compare(pos, k.size(), k) == 0)
+         return query.substr(pos + k.size(), end - pos - k.size());
+
+      pos = end + 1;
+      }
+
+   return "";
+   }
+
+// Is this key=value pair one of the tee's own options
+static bool tee_option(const std::string &pair)
+   {
+   return pair.compare(0, 4, "out=") == 0 || pair.compare(0, 6, "queue=") == 0 ||
+      pair.compare(0, 7, "format=") == 0;
+   }
+
+static UNS64 tee_now()
+   {
+   struct timespec ts;
+   clock_gettime(CLOCK_REALTIME, &ts);
+   return (UNS64)ts.tv_sec * 1000000000ULL + (UNS64)ts.tv_nsec;
+   }
+
+can_tee::can_tee(s_BOARD *board) : m_lib(NULL),
+      m_inner(NULL),
+      m_fd(-1),
+      m_cap(NULL),
+      m_cap_flush(true),
+      m_pcap(NULL),
+      m_rx(NULL),
+      m_tx(NULL),
+      m_run(true),
+      m_reported(0)
+   {
+   std::string bus = board->busname ? board->busname : "";
+   std::string query;
+
+   if (bus.compare(0, 6, "tee://") == 0)
+      bus.erase(0, 6);
+
+   // the inner driver shares our query, keep our own pairs and hand it the rest
+   std::string inner_query;
+   std::size_t q = bus.find('?');
+   if (q != std::string::npos)
+      {
+      std::string all = bus.substr(q + 1);
+      bus.erase(q);
+
+      for (std::size_t pos = 0; pos < all.size(); )
+         {
+         std::size_t end = all.find('&', pos);
+         if (end == std::string::npos)
+            end = all.size();
+
+         std::string pair = all.substr(pos, end - pos);
+         std::string &to = tee_option(pair) ? query : inner_query;
+         if (!to.empty())
+            to += '&';
+         to += pair;
+
+         pos = end + 1;
+         }
+      }
+
+   m_path = query_value(query, "out");
+   if (m_path.empty())
+      {
+      fprintf(stderr, "tee: no out= given in %s\n", board->busname);
+      throw error();
+      }
+
+   std::size_t queue = TEE_DEFAULT_QUEUE;
+   std::string v = query_value(query, "queue");
+   if (!v.empty())
+      queue = (std::size_t)strtoul(v.c_str(), NULL, 0);
+
+   std::string format = query_value(query, "format");
+   bool archive = format == "archive";
+   bool indexed = archive || format == "indexed";
+
+   std::size_t ring = 1024;
+   while (ring < queue)
+      ring <<= 1;
+
+   std::size_t slash = bus.find('/');
+   std::string driver = bus.substr(0, slash);
+   std::string inner_bus = slash == std::string::npos ? "" : bus.substr(slash + 1);
+   if (!inner_query.empty())
+      inner_bus += "?" + inner_query;
+
+   if (!load_inner(driver))
+      throw error();
+
+   if (format == "pcapng")
+      {
+      m_pcap = new can_pcap_writer();
+      if (!m_pcap->open(m_path.c_str()))
+         {
+         delete m_pcap;
+         dlclose(m_lib);
+         throw error();
+         }
+      }
+   else if (indexed)
+      {
+      m_cap = new can_cap_writer();
+      m_cap_flush = !archive;
+      if (!m_cap->open(m_path.c_str(), archive ? CAN_PACK_DEFAULT_BLOCK : CAN_CAP_DEFAULT_BLOCK,
+            archive ? CAN_CAP_ENC_COLUMNAR : CAN_CAP_ENC_RAW))
+         {
+         delete m_cap;
+         dlclose(m_lib);
+         throw error();
+         }
+      }
+   else
+      {
+      m_fd = ::open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if (m_fd < 0)
+         {
+         fprintf(stderr, "tee: open %s: %s\n", m_path.c_str(), strerror(errno));
+         dlclose(m_lib);
+         throw error();
+         }
+      }
+
+   s_BOARD inner;
+   inner.busname = const_cast<char*>(inner_bus.c_str());
+   inner.baudrate = board->baudrate;
+
+   m_inner = m_open(&inner);
+   if (m_inner == NULL)
+      {
+      if (m_pcap)
+         delete m_pcap;
+      else if (m_cap)
+         delete m_cap;
+      else
+         ::close(m_fd);
+      dlclose(m_lib);
+      throw error();
+      }
+
+   m_rx = new tee_ring(ring);
+   m_tx = new tee_ring(ring);
+   m_writer = std::thread(&can_tee::writer, this);
+   }
+
+can_tee::~can_tee()
+   {
+   m_close(m_inner);
+
+   m_run.store(false);
+   m_writer.join();
+
+   UNS64 dropped = m_rx->dropped() + m_tx->dropped();
+   if (dropped)
+      fprintf(stderr, "tee %s: %llu frames dropped in total\n", m_path.c_str(), (unsigned long long)dropped);
+
+   if (m_pcap)
+      delete m_pcap;
+   else if (m_cap)
+      delete m_cap;
+   else
+      ::close(m_fd);
+   delete m_rx;
+   delete m_tx;
+   dlclose(m_lib);
+   }
+
+bool can_tee::load_inner(const std::string &name)
+   {
+   std::string file = name + ".so";
+
+   m_lib = dlopen(file.c_str(), RTLD_NOW | RTLD_LOCAL);
+   if (m_lib == NULL)
+      {
+      fprintf(stderr, "tee: %s\n", dlerror());
+      return false;
+      }
+
+   m_receive = (canReceive_t)dlsym(m_lib, "canReceive_driver");
+   m_send = (canSendDrv_t)dlsym(m_lib, "canSend_driver");
+   m_open = (canOpen_t)dlsym(m_lib, "canOpen_driver");
+   m_close = (canClose_t)dlsym(m_lib, "canClose_driver");
+   m_baudrate = (canChangeBaudRate_t)dlsym(m_lib, "canChangeBaudRate_driver");
+   // optional, drivers that know when a frame really arrived (can_socketcan)
+   m_timestamp = (canLastTimestamp_t)dlsym(m_lib, "canLastTimestamp_driver");
+
+   if (!m_receive || !m_send || !m_open || !m_close)
+      {
+      fprintf(stderr, "tee: %s is not a can driver\n", file.c_str());
+      dlclose(m_lib);
+      m_lib = NULL;
+      return false;
+      }
+
+   return true;
+   }
+
+void can_tee::record(tee_ring &ring, const Message *m, UNS32 flags, UNS64 ts)
+   {
+   can_wire_frame f;
+   can_wire_from_message(m, &f, 0, ts);
+   f.id |= flags;
+   ring.push(f);
+   }
+
+UNS8 can_tee::send(const Message *m)
+   {
+   // the drivers here return their send() result, non zero once the frame is out
+   UNS8 res = m_send(m_inner, m);
+   if (res == 0)
+      return res;
+
+   std::lock_guard<std::mutex> l(m_tx_lock);
+   record(*m_tx, m, CAN_WIRE_ID_TX, tee_now());
+   return res;
+   }
+
+UNS8 can_tee::receive(Message *m)
+   {
+   UNS8 res = m_receive(m_inner, m);
+   if (res == 0 && m->len != 0)
+      record(*m_rx, m, 0, m_timestamp ? m_timestamp(m_inner) : tee_now());
+   return res;
+   }
+
+UNS8 can_tee::baudrate(char *baud)
+   {
+   return m_baudrate ? m_baudrate(m_inner, baud) : 0;
+   }
+
+// Move whatever is in a ring into the write buffer as batches
+std::size_t can_tee::drain(tee_ring &ring, std::vector<UNS8> &buf)
+   {
+   std::size_t total = 0;
+   const int rec = can_wire_record_size(CAN_WIRE_F_TIMESTAMP);
+
+   for (;;)
+      {
+      std::size_t hdr = buf.size();
+      buf.resize(hdr + CAN_WIRE_HEADER_SIZE + CAN_WIRE_MAX_BATCH * rec);
+
+      UNS8 *p = &buf[hdr + CAN_WIRE_HEADER_SIZE];
+      int count = 0;
+      can_wire_frame r;
+
+      while (count < CAN_WIRE_MAX_BATCH && ring.pop(r))
+         {
+         p += can_wire_put_frame(p, &r, CAN_WIRE_F_TIMESTAMP);
+         count++;
+         }
+
+      if (count == 0)
+         {
+         buf.resize(hdr);
+         return total;
+         }
+
+      can_wire_put_header(&buf[hdr], CAN_WIRE_F_TIMESTAMP, (UNS16)count);
+      buf.resize(hdr + CAN_WIRE_HEADER_SIZE + count * rec);
+      total += count;
+
+      if (buf.size() >= TEE_WRITE_BUFFER)
+         flush(buf);
+      }
+   }
+
+// Indexed captures are blocked up by the writer itself
+std::size_t can_tee::drain(tee_ring &ring, can_cap_writer &cap)
+   {
+   std::size_t total = 0;
+   can_wire_frame r;
+
+   while (ring.pop(r))
+      {
+      cap.add(&r);
+      total++;
+      }
+
+   return total;
+   }
+
+std::size_t can_tee::drain(tee_ring &ring, can_pcap_writer &pcap)
+   {
+   std::size_t total = 0;
+   can_wire_frame r;
+
+   while (ring.pop(r))
+      {
+      pcap.add(&r);
+      total++;
+      }
+
+   return total;
+   }
+
+void can_tee::flush(std::vector<UNS8> &buf)
+   {
+   std::size_t done = 0;
+
+   while (done < buf.size())
+      {
+      ssize_t n = ::write(m_fd, &buf[done], buf.size() - done);
+      if (n < 0)
+         {
+         if (errno == EINTR)
+            continue;
+         fprintf(stderr, "tee: write %s: %s\n", m_path.c_str(), strerror(errno));
+         break;
+         }
+      done += (std::size_t)n;
+      }
+
+   buf.clear();
+   }
+
+void can_tee::writer()
+   {
+   std::vector<UNS8> buf;
+   buf.reserve(TEE_WRITE_BUFFER + CAN_WIRE_MAX_PACKET);
+
+   std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+   for (;;)
+      {
+      bool run = m_run.load();
+      std::size_t n;
+      if (m_pcap)
+         n = drain(*m_rx, *m_pcap) + drain(*m_tx, *m_pcap);
+      else if (m_cap)
+         n = drain(*m_rx, *m_cap) + drain(*m_tx, *m_cap);
+      else
+         n = drain(*m_rx, buf) + drain(*m_tx, buf);
+
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (!run || now - last > std::chrono::milliseconds(TEE_FLUSH_MS))
+         {
+         if (m_pcap)
+            m_pcap->flush();
+         else if (m_cap && m_cap_flush)
+            m_cap->flush();
+         else if (!buf.empty())
+            flush(buf);
+         last = now;
+
+         UNS64 dropped = m_rx->dropped() + m_tx->dropped();
+         if (dropped != m_reported)
+            {
+            fprintf(stderr, "tee %s: %llu frames dropped, writer can't keep up\n", m_path.c_str(), (unsigned long long)(dropped - m_reported));
+            m_reported = dropped;
+            }
+         }
+
+      if (!run)
+         break;
+
+      if (n == 0)
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+   }
+
+
+//------------------------------------------------------------------------
+extern "C"
+   UNS8 DLL_CALL(canReceive)(CAN_HANDLE fd0, Message *m)
+   {
+	   return reinterpret_cast<can_tee*>(fd0)->receive(m);
+   }
+
+extern "C"
+   UNS8 DLL_CALL(canSend)(CAN_HANDLE fd0, Message const *m)
+   {
+	   return reinterpret_cast<can_tee*>(fd0)->send(m);
+   }
+
+extern "C"
+   CAN_HANDLE DLL_CALL(canOpen)(s_BOARD *board)
+   {
+   try
+      {
+		  return (CAN_HANDLE) new can_tee(board);
+      }
+   catch (can_tee::error&)
+      {
+      return NULL;
+      }
+   }
+
+extern "C"
+   int DLL_CALL(canClose)(CAN_HANDLE inst)
+   {
+	   delete reinterpret_cast<can_tee*>(inst);
+   return 1;
+   }
+
+extern "C"
+	UNS8 DLL_CALL(canChangeBaudRate)( CAN_HANDLE fd, char* baud)
+	{
+	return reinterpret_cast<can_tee*>(fd)->baudrate(baud);
+	}
+
+typedef void(*setStringValuesCB_t) (char *pStringValues[], int nValues);
+static setStringValuesCB_t gSetStringValuesCB;
+
+void NativeCallDelegate(char *pStringValues[], int nValues)
+{
+	if (gSetStringValuesCB)
+		gSetStringValuesCB(pStringValues, nValues);
+}
+
+// The inner driver does the real enumeration, we can only offer the pattern
+extern "C" void canEnumerate2_driver(setStringValuesCB_t callback)
+{
+	gSetStringValuesCB = callback;
+	char **Values = (char**)malloc(sizeof(void*));
+	Values[0] = strdup("tee://can_null_win32/null://null1?out=/tmp/can.bin");
+
+	NativeCallDelegate(Values, 1);
+}
@@ -0,0 +1,225 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __can_wire_h__
+#define __can_wire_h__
+
+#include "can.h"
+
+/**
+ * @brief Portable wire format for passing CAN frames between processes
+ *
+ * Everything is little endian regardless of host. A packet is a batch header
+ * followed by count frame records, all frames in a batch share the same flags.
+ *
+ * Batch header (4 bytes)
+ *   0     version  CAN_WIRE_V1, high nibble doubles as a magic so raw struct
+ *                  senders from older drivers can still be told apart. Later
+ *                  minor versions (0xC2-0xCF) keep this header and the record
+ *                  layout and may only add flags that do not change the record
+ *                  size, readers accept any of them (CAN_WIRE_IS_BATCH)
+ *   1     flags    CAN_WIRE_F_xxx
+ *   2-3   count    number of frame records that follow
+ *
+ * Frame record (14 bytes, 22 with CAN_WIRE_F_TIMESTAMP)
+ *   0-3   id       bits 0-28 identifier, bit 29 rtr, bit 30 29 bit (extended) id,
+ *                  bit 31 set on captured frames that this host transmitted
+ *   4     len      data length 0-8
+ *   5     channel  logical bus, 0 unless the transport multiplexes channels
+ *   6-13  data     always 8 bytes, unused bytes are 0
+ *   14-21 time     nanoseconds, sender defined epoch
+ */
+
+#define CAN_WIRE_V1 0xC1
+#define CAN_WIRE_MAGIC_MASK 0xF0
+#define CAN_WIRE_MAGIC 0xC0
+
+/* first byte of a batch of any minor version, 0xC0 itself is not a version */
+#define CAN_WIRE_IS_BATCH(b) (((b) & CAN_WIRE_MAGIC_MASK) == CAN_WIRE_MAGIC && (b) != CAN_WIRE_MAGIC)
+
+#define CAN_WIRE_F_TIMESTAMP 0x01
+
+#define CAN_WIRE_ID_MASK 0x1FFFFFFFUL
+#define CAN_WIRE_ID_RTR 0x20000000UL
+#define CAN_WIRE_ID_EXT 0x40000000UL
+#define CAN_WIRE_ID_TX 0x80000000UL
+
+#define CAN_WIRE_HEADER_SIZE 4
+#define CAN_WIRE_FRAME_SIZE 14
+#define CAN_WIRE_TS_SIZE 8
+#define CAN_WIRE_MAX_BATCH 64
+#define CAN_WIRE_MAX_PACKET (CAN_WIRE_HEADER_SIZE + CAN_WIRE_MAX_BATCH * (CAN_WIRE_FRAME_SIZE + CAN_WIRE_TS_SIZE))
+
+#ifdef _MSC_VER
+#define CAN_WIRE_INLINE static __inline
+#else
+#define CAN_WIRE_INLINE static inline
+#endif
+
+/**
+ * @brief A decoded wire frame, wider than Message so nothing on the wire is lost
+ */
+typedef struct {
+  UNS32 id;       /**< identifier with CAN_WIRE_ID_RTR/CAN_WIRE_ID_EXT flags */
+  UNS8 len;
+  UNS8 channel;
+  UNS8 data[8];
+  UNS64 timestamp;
+} can_wire_frame;
+
+/* Shifts compile down to a plain load/store on little endian targets and
+   do the right thing everywhere else, so there is no endian #ifdef to get wrong */
+
+CAN_WIRE_INLINE void can_wire_put16(UNS8 *p, UNS16 v)
+{
+  p[0] = (UNS8)v; p[1] = (UNS8)(v >> 8);
+}
+
+CAN_WIRE_INLINE void can_wire_put32(UNS8 *p, UNS32 v)
+{
+  p[0] = (UNS8)v; p[1] = (UNS8)(v >> 8); p[2] = (UNS8)(v >> 16); p[3] = (UNS8)(v >> 24);
+}
+
+CAN_WIRE_INLINE void can_wire_put64(UNS8 *p, UNS64 v)
+{
+  can_wire_put32(p, (UNS32)v); can_wire_put32(p + 4, (UNS32)(v >> 32));
+}
+
+CAN_WIRE_INLINE UNS16 can_wire_get16(const UNS8 *p)
+{
+  return (UNS16)(p[0] | (p[1] << 8));
+}
+
+CAN_WIRE_INLINE UNS32 can_wire_get32(const UNS8 *p)
+{
+  return (UNS32)p[0] | ((UNS32)p[1] << 8) | ((UNS32)p[2] << 16) | ((UNS32)p[3] << 24);
+}
+
+CAN_WIRE_INLINE UNS64 can_wire_get64(const UNS8 *p)
+{
+  return (UNS64)can_wire_get32(p) | ((UNS64)can_wire_get32(p + 4) << 32);
+}
+
+CAN_WIRE_INLINE int can_wire_record_size(UNS8 flags)
+{
+  return CAN_WIRE_FRAME_SIZE + (flags & CAN_WIRE_F_TIMESTAMP) * CAN_WIRE_TS_SIZE;
+}
+
+/**
+ * @brief Write a batch header, returns the bytes written
+ */
+CAN_WIRE_INLINE int can_wire_put_header(UNS8 *p, UNS8 flags, UNS16 count)
+{
+  p[0] = CAN_WIRE_V1;
+  p[1] = flags;
+  can_wire_put16(p + 2, count);
+  return CAN_WIRE_HEADER_SIZE;
+}
+
+/**
+ * @brief Encode one Message as a frame record, returns the bytes written
+ */
+CAN_WIRE_INLINE int can_wire_put_message(UNS8 *p, const Message *m, UNS8 channel, UNS8 flags, UNS64 timestamp)
+{
+  can_wire_put32(p, (UNS32)m->cob_id | ((UNS32)(m->rtr != 0) << 29));
+  p[4] = m->len;
+  p[5] = channel;
+  memcpy(p + 6, m->data, 8);
+  if (flags & CAN_WIRE_F_TIMESTAMP)
+    can_wire_put64(p + CAN_WIRE_FRAME_SIZE, timestamp);
+  return can_wire_record_size(flags);
+}
+
+/**
+ * @brief Encode a wire frame as a frame record, returns the bytes written
+ */
+CAN_WIRE_INLINE int can_wire_put_frame(UNS8 *p, const can_wire_frame *f, UNS8 flags)
+{
+  can_wire_put32(p, f->id);
+  p[4] = f->len;
+  p[5] = f->channel;
+  memcpy(p + 6, f->data, 8);
+  if (flags & CAN_WIRE_F_TIMESTAMP)
+    can_wire_put64(p + CAN_WIRE_FRAME_SIZE, f->timestamp);
+  return can_wire_record_size(flags);
+}
+
+/**
+ * @brief Decode one frame record, returns the bytes consumed
+ */
+CAN_WIRE_INLINE int can_wire_get_frame(const UNS8 *p, can_wire_frame *f, UNS8 flags)
+{
+  f->id = can_wire_get32(p);
+  f->len = p[4] > 8 ? 8 : p[4];
+  f->channel = p[5];
+  memcpy(f->data, p + 6, 8);
+  f->timestamp = (flags & CAN_WIRE_F_TIMESTAMP) ? can_wire_get64(p + CAN_WIRE_FRAME_SIZE) : 0;
+  return can_wire_record_size(flags);
+}
+
+/**
+ * @brief Convert a wire frame to a Message
+ * @return 0 if the frame can't be carried by Message (29 bit ids)
+ */
+CAN_WIRE_INLINE int can_wire_to_message(const can_wire_frame *f, Message *m)
+{
+  m->cob_sender_id = 0;
+  m->cob_id = (UNS16)(f->id & 0xFFFF);
+  m->rtr = (UNS8)((f->id & CAN_WIRE_ID_RTR) != 0);
+  m->len = f->len;
+  memcpy(m->data, f->data, 8);
+  return (f->id & (CAN_WIRE_ID_EXT | 0x1FFF0000UL)) == 0;
+}
+
+/**
+ * @brief Convert a Message to a wire frame
+ */
+CAN_WIRE_INLINE void can_wire_from_message(const Message *m, can_wire_frame *f, UNS8 channel, UNS64 timestamp)
+{
+  f->id = (UNS32)m->cob_id | ((UNS32)(m->rtr != 0) << 29);
+  f->len = m->len;
+  f->channel = channel;
+  memcpy(f->data, m->data, 8);
+  f->timestamp = timestamp;
+}
+
+/**
+ * @brief Validate a received packet and return its frame count
+ * @return frame count, or -1 if the packet is not a batch we understand
+ */
+CAN_WIRE_INLINE int can_wire_check(const UNS8 *p, int size, UNS8 *flags)
+{
+  int count;
+
+  if (size < CAN_WIRE_HEADER_SIZE || !CAN_WIRE_IS_BATCH(p[0]))
+    return -1;
+
+  *flags = p[1];
+  count = can_wire_get16(p + 2);
+
+  if (size < CAN_WIRE_HEADER_SIZE + count * can_wire_record_size(*flags))
+    return -1;
+
+  return count;
+}
+
+#endif /* __can_wire_h__ */
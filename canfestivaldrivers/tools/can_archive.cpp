@@ -0,0 +1,91 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Convert any capture can_log_reader understands into an indexed capture
+//
+//   can_archive [-raw] [-block n] <input> <output>
+//
+// By default blocks are compressed columns (can_pack.h) for long term
+// storage, -raw writes plain records which are larger but need no decoding.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/stat.h>
+
+#include "can_log/can_log.h"
+#include "can_log/can_pack.h"
+
+static int usage()
+   {
+   fprintf(stderr, "usage: can_archive [-raw] [-block n] <input> <output>\n");
+   return 2;
+   }
+
+int main(int argc, char **argv)
+   {
+   UNS8 encoding = CAN_CAP_ENC_COLUMNAR;
+   UNS32 block = 0;
+   int arg = 1;
+
+   for (; arg < argc && argv[arg][0] == '-'; arg++)
+      {
+      if (strcmp(argv[arg], "-raw") == 0)
+         encoding = CAN_CAP_ENC_RAW;
+      else if (strcmp(argv[arg], "-block") == 0 && arg + 1 < argc)
+         block = (UNS32)strtoul(argv[++arg], NULL, 0);
+      else
+         return usage();
+      }
+
+   if (argc - arg != 2)
+      return usage();
+
+   if (block == 0)
+      block = encoding == CAN_CAP_ENC_COLUMNAR ? CAN_PACK_DEFAULT_BLOCK : CAN_CAP_DEFAULT_BLOCK;
+
+   can_log_reader in;
+   if (!in.open(argv[arg]))
+      return 1;
+
+   can_cap_writer out;
+   if (!out.open(argv[arg + 1], block, encoding))
+      return 1;
+
+   can_wire_frame f;
+   while (in.next(&f))
+      {
+      if (!out.add(&f))
+         return 1;
+      }
+
+   if (!out.close())
+      return 1;
+
+   struct stat st;
+   if (stat(argv[arg + 1], &st) == 0)
+      fprintf(stderr, "%s: %llu frames, %llu bytes in, %llu bytes out\n", argv[arg + 1],
+         (unsigned long long)out.frames(), (unsigned long long)in.size(), (unsigned long long)st.st_size);
+
+   return 0;
+   }
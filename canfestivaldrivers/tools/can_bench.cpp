@@ -0,0 +1,259 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Latency and throughput of a driver through the normal driver API
+//
+//   can_bench [-r roundtrips] [-n frames] [-w window] <driver.so> <busname> [busname2]
+//
+// Two handles are opened on the same bus (busname2 for the second one if the
+// transport needs a different name on each end, eg a bind and a connect). The
+// round trip test sends 0x601 from the first handle and times the 0x581 the
+// second one answers with, the one way test streams n frames from the first
+// to the second, never more than window frames ahead of the reader so a fast
+// sender can't just lap a ring based driver. eg
+//   can_bench ./can_shm.so shm://bench
+//   can_bench ./can_socketcan.so vcan0?batch=1
+//   can_bench ./can_socketcan.so vcan0?batch=64
+// Drivers that export canOverruns_driver have their lost frame count printed.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include <dlfcn.h>
+
+extern "C" {
+#include "can_driver.h"
+}
+
+typedef UNS8 (*canReceive_t)(CAN_HANDLE, Message *);
+typedef UNS8 (*canSendDrv_t)(CAN_HANDLE, Message const *);
+typedef CAN_HANDLE (*canOpen_t)(s_BOARD *);
+typedef int (*canClose_t)(CAN_HANDLE);
+typedef UNS64 (*canOverruns_t)(CAN_HANDLE);
+
+typedef std::chrono::steady_clock bench_clock;
+
+static canReceive_t drv_receive;
+static canSendDrv_t drv_send;
+
+static int usage()
+   {
+   fprintf(stderr, "usage: can_bench [-r roundtrips] [-n frames] [-w window] <driver.so> <busname> [busname2]\n");
+   return 2;
+   }
+
+static CAN_HANDLE open_bus(canOpen_t open, const char *busname)
+   {
+   s_BOARD board;
+   board.busname = const_cast<char *>(busname);
+   board.baudrate = const_cast<char *>("1M");
+
+   CAN_HANDLE h = open(&board);
+   if (!h)
+      fprintf(stderr, "can_bench: can't open %s\n", busname);
+   return h;
+   }
+
+// Poll until a frame with this id arrives or the bus has been quiet for a second
+static bool wait_for(CAN_HANDLE h, UNS16 cob)
+   {
+   bench_clock::time_point give_up = bench_clock::now() + std::chrono::seconds(1);
+
+   while (bench_clock::now() < give_up)
+      {
+      Message m = Message_Initializer;
+      if (drv_receive(h, &m) == 0 && m.len != 0 && m.cob_id == cob)
+         return true;
+      }
+
+   return false;
+   }
+
+static void round_trips(CAN_HANDLE a, CAN_HANDLE b, int count)
+   {
+   std::atomic<bool> run(true);
+
+   std::thread echo([&]()
+      {
+      while (run.load(std::memory_order_relaxed))
+         {
+         Message m = Message_Initializer;
+         if (drv_receive(b, &m) == 0 && m.len != 0 && m.cob_id == 0x601)
+            {
+            m.cob_id = 0x581;
+            drv_send(b, &m);
+            }
+         }
+      });
+
+   std::vector<double> us;
+   us.reserve(count);
+
+   Message m = Message_Initializer;
+   m.cob_id = 0x601;
+   m.len = 8;
+
+   int lost = 0;
+   for (int i = 0; i < count; i++)
+      {
+      memcpy(m.data, &i, sizeof(i));
+
+      bench_clock::time_point t = bench_clock::now();
+      drv_send(a, &m);
+      if (!wait_for(a, 0x581))
+         {
+         lost++;
+         continue;
+         }
+      us.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - t).count());
+      }
+
+   run = false;
+   echo.join();
+
+   if (us.empty())
+      {
+      printf("round trip: no answers\n");
+      return;
+      }
+
+   std::sort(us.begin(), us.end());
+   printf("round trip: %u frames, p50 %.1fus p99 %.1fus max %.1fus, %d lost\n", (unsigned)us.size(),
+      us[us.size() / 2], us[us.size() * 99 / 100], us.back(), lost);
+   }
+
+static void one_way(CAN_HANDLE a, CAN_HANDLE b, long count, long window)
+   {
+   std::atomic<long> got(0);
+   std::atomic<bool> run(true);
+
+   std::thread reader([&]()
+      {
+      while (run.load(std::memory_order_relaxed))
+         {
+         Message m = Message_Initializer;
+         if (drv_receive(b, &m) == 0 && m.len != 0)
+            got.fetch_add(1, std::memory_order_relaxed);
+         }
+      });
+
+   Message m = Message_Initializer;
+   m.cob_id = 0x181;
+   m.len = 8;
+
+   bench_clock::time_point t0 = bench_clock::now();
+
+   for (long i = 0; i < count; i++)
+      {
+      // keep at most a window of frames in flight, a driver that loses frames
+      // would never let us catch up so give up after a second without progress
+      if (i - got.load(std::memory_order_relaxed) >= window)
+         {
+         bench_clock::time_point stall = bench_clock::now() + std::chrono::seconds(1);
+         while (i - got.load(std::memory_order_relaxed) >= window && bench_clock::now() < stall)
+            std::this_thread::yield();
+         if (i - got.load() >= window)
+            break;
+         }
+
+      drv_send(a, &m);
+      }
+
+   // give stragglers a moment, anything still missing after that was lost
+   bench_clock::time_point give_up = bench_clock::now() + std::chrono::seconds(1);
+   while (got.load() < count && bench_clock::now() < give_up)
+      std::this_thread::yield();
+
+   double s = std::chrono::duration<double>(bench_clock::now() - t0).count();
+   run = false;
+   reader.join();
+
+   printf("one way: %ld of %ld frames in %.2fs, %.2f Mframes/s (%.0f ns/frame), window %ld\n",
+      got.load(), count, s, got.load() / s / 1e6, s * 1e9 / std::max(1L, got.load()), window);
+   }
+
+int main(int argc, char **argv)
+   {
+   int roundtrips = 100000;
+   long frames = 5000000;
+   long window = 2048;
+   int arg = 1;
+
+   for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != 0; arg++)
+      {
+      if (strcmp(argv[arg], "-r") == 0 && arg + 1 < argc)
+         roundtrips = atoi(argv[++arg]);
+      else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc)
+         frames = atol(argv[++arg]);
+      else if (strcmp(argv[arg], "-w") == 0 && arg + 1 < argc)
+         window = std::max(1L, atol(argv[++arg]));
+      else
+         return usage();
+      }
+
+   if (argc - arg != 2 && argc - arg != 3)
+      return usage();
+
+   void *lib = dlopen(argv[arg], RTLD_NOW);
+   if (!lib)
+      {
+      fprintf(stderr, "can_bench: %s\n", dlerror());
+      return 1;
+      }
+
+   drv_receive = (canReceive_t)dlsym(lib, "canReceive_driver");
+   drv_send = (canSendDrv_t)dlsym(lib, "canSend_driver");
+   canOpen_t drv_open = (canOpen_t)dlsym(lib, "canOpen_driver");
+   canClose_t drv_close = (canClose_t)dlsym(lib, "canClose_driver");
+   canOverruns_t drv_overruns = (canOverruns_t)dlsym(lib, "canOverruns_driver");
+
+   if (!drv_receive || !drv_send || !drv_open || !drv_close)
+      {
+      fprintf(stderr, "can_bench: %s is not a CanFestival driver\n", argv[arg]);
+      return 1;
+      }
+
+   CAN_HANDLE a = open_bus(drv_open, argv[arg + 1]);
+   CAN_HANDLE b = a ? open_bus(drv_open, argv[argc - arg == 3 ? arg + 2 : arg + 1]) : NULL;
+   if (!a || !b)
+      return 1;
+
+   if (roundtrips > 0)
+      round_trips(a, b, roundtrips);
+
+   if (frames > 0)
+      one_way(a, b, frames, window);
+
+   if (drv_overruns)
+      printf("overruns: %llu\n", (unsigned long long)drv_overruns(b));
+
+   drv_close(a);
+   drv_close(b);
+   dlclose(lib);
+   return 0;
+   }
@@ -0,0 +1,78 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Convert any capture can_log_reader understands to pcapng for Wireshark
+//
+//   can_pcap [-cob id] <input> <output.pcapng>
+//
+// An output of - writes to stdout, eg can_pcap rig1.ccap - | wireshark -k -i -
+// -cob may be repeated to export only those identifiers.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "can_log/can_log.h"
+#include "can_log/can_pcap.h"
+
+static int usage()
+   {
+   fprintf(stderr, "usage: can_pcap [-cob id] <input> <output.pcapng>\n");
+   return 2;
+   }
+
+int main(int argc, char **argv)
+   {
+   can_log_reader in;
+   std::vector<UNS32> cobs;
+   int arg = 1;
+
+   for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != 0; arg++)
+      {
+      if (strcmp(argv[arg], "-cob") == 0 && arg + 1 < argc)
+         cobs.push_back((UNS32)strtoul(argv[++arg], NULL, 0));
+      else
+         return usage();
+      }
+
+   if (argc - arg != 2)
+      return usage();
+
+   if (!in.open(argv[arg]))
+      return 1;
+
+   for (std::size_t x = 0; x < cobs.size(); x++)
+      in.filter(cobs[x]);
+
+   can_pcap_writer out;
+   if (!out.open(argv[arg + 1]))
+      return 1;
+
+   can_wire_frame f;
+   while (in.next(&f))
+      {
+      if (!out.add(&f))
+         return 1;
+      }
+
+   return out.close() ? 0 : 1;
+   }
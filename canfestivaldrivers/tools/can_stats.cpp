@@ -0,0 +1,478 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+CanFestival Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Offline bus statistics for any capture can_log_reader understands
+//
+//   can_stats [-j threads] [-w window_ms] [-b bitrate] [-loads] <capture>
+//
+// The capture is split into pieces (blocks of indexed captures, line aligned
+// byte ranges of text logs) which are scanned on all cores, the per piece
+// results are merged in file order at the end.
+//
+// Reported
+//   per COB-ID   count, mean period, jitter (standard deviation of the gaps),
+//                min/max gap and DLC histogram
+//   bus load     mean and peak over window_ms windows (default 100), all windows with -loads
+//   per node     heartbeat count, gaps and boot ups, EMCY count and error codes
+//   SDO aborts   count by node and abort code
+//
+// Frames are classified exactly as libCanopenSimple.asyncprocess() does so the
+// offline numbers line up with what the live events report.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "can_log/can_log.h"
+
+#define STATS_STD_IDS 2048
+
+enum cob_class
+   {
+   CLS_NMT,
+   CLS_SYNC,
+   CLS_EMCY,
+   CLS_TIME,
+   CLS_PDO,
+   CLS_SDO_TX,
+   CLS_SDO_RX,
+   CLS_NMT_EC,
+   CLS_LSS,
+   CLS_OTHER,
+   CLS_COUNT,
+   };
+
+static const char *class_names[CLS_COUNT] =
+   {
+   "NMT", "SYNC", "EMCY", "TIME", "PDO", "SDO tx", "SDO rx", "NMT EC", "LSS", "other"
+   };
+
+// Same ranges as libCanopenSimple.asyncprocess()
+static cob_class classify(UNS32 id)
+   {
+   if (id & CAN_WIRE_ID_EXT)
+      return CLS_OTHER;
+
+   UNS32 cob = id & CAN_WIRE_ID_MASK;
+
+   if (cob == 0x000)
+      return CLS_NMT;
+   if (cob == 0x080)
+      return CLS_SYNC;
+   if (cob > 0x080 && cob <= 0x0FF)
+      return CLS_EMCY;
+   if (cob == 0x100)
+      return CLS_TIME;
+   if (cob >= 0x180 && cob <= 0x57F)
+      return CLS_PDO;
+   if (cob >= 0x580 && cob < 0x600)
+      return CLS_SDO_TX;
+   if (cob >= 0x600 && cob < 0x680)
+      return CLS_SDO_RX;
+   if (cob > 0x700 && cob <= 0x77F)
+      return CLS_NMT_EC;
+   if (cob > 0x7E4 && cob <= 0x7E5)
+      return CLS_LSS;
+
+   return CLS_OTHER;
+   }
+
+struct cob_stat
+   {
+   UNS64 count;
+   UNS64 first;
+   UNS64 last;
+   UNS64 min_gap;
+   UNS64 max_gap;
+   double sum_gap;
+   double sum_gap2;
+   UNS64 dlc[9];
+
+   void add(UNS64 ts, UNS8 len)
+      {
+      if (count)
+         gap(ts >= last ? ts - last : 0);
+      else
+         first = ts;
+
+      last = ts;
+      count++;
+      dlc[len > 8 ? 8 : len]++;
+      }
+
+   void gap(UNS64 g)
+      {
+      if (g < min_gap)
+         min_gap = g;
+      if (g > max_gap)
+         max_gap = g;
+      sum_gap += (double)g;
+      sum_gap2 += (double)g * (double)g;
+      }
+
+   // o follows this one in the capture
+   void merge(const cob_stat &o)
+      {
+      if (o.count == 0)
+         return;
+
+      if (count == 0)
+         {
+         *this = o;
+         return;
+         }
+
+      gap(o.first >= last ? o.first - last : 0);
+      if (o.min_gap < min_gap)
+         min_gap = o.min_gap;
+      if (o.max_gap > max_gap)
+         max_gap = o.max_gap;
+      sum_gap += o.sum_gap;
+      sum_gap2 += o.sum_gap2;
+      last = o.last;
+      count += o.count;
+      for (int x = 0; x < 9; x++)
+         dlc[x] += o.dlc[x];
+      }
+   };
+
+struct node_stat
+   {
+   UNS64 bootups;
+   UNS8 state;
+   UNS64 emcy;
+   };
+
+// Everything one piece of the capture contributes, merged in file order
+struct piece_stat
+   {
+   UNS64 frames;
+   UNS64 classes[CLS_COUNT];
+   std::vector<cob_stat> std_ids;
+   std::map<UNS32, cob_stat> ext_ids;
+   node_stat nodes[128];
+   std::map<UNS64, UNS64> window_bits;              // window number -> bits on the bus
+   std::map<std::pair<UNS8, UNS32>, UNS64> aborts;  // (node, abort code) -> count
+   std::map<std::pair<UNS8, UNS16>, UNS64> emcy;    // (node, error code) -> count
+
+   piece_stat() : frames(0), std_ids(STATS_STD_IDS)
+      {
+      memset(classes, 0, sizeof(classes));
+      memset(nodes, 0, sizeof(nodes));
+      memset(&std_ids[0], 0, sizeof(cob_stat) * STATS_STD_IDS);
+      for (int x = 0; x < STATS_STD_IDS; x++)
+         std_ids[x].min_gap = ~(UNS64)0;
+      }
+
+   cob_stat &cob(UNS32 id)
+      {
+      if (!(id & CAN_WIRE_ID_EXT))
+         return std_ids[id & 0x7FF];
+
+      std::map<UNS32, cob_stat>::iterator it = ext_ids.find(id & CAN_WIRE_ID_MASK);
+      if (it == ext_ids.end())
+         {
+         cob_stat s;
+         memset(&s, 0, sizeof(s));
+         s.min_gap = ~(UNS64)0;
+         it = ext_ids.insert(std::make_pair(id & CAN_WIRE_ID_MASK, s)).first;
+         }
+      return it->second;
+      }
+
+   void merge(const piece_stat &o)
+      {
+      frames += o.frames;
+      for (int x = 0; x < CLS_COUNT; x++)
+         classes[x] += o.classes[x];
+
+      for (int x = 0; x < STATS_STD_IDS; x++)
+         std_ids[x].merge(o.std_ids[x]);
+
+      for (std::map<UNS32, cob_stat>::const_iterator it = o.ext_ids.begin(); it != o.ext_ids.end(); ++it)
+         cob(it->first | CAN_WIRE_ID_EXT).merge(it->second);
+
+      for (int x = 0; x < 128; x++)
+         {
+         nodes[x].bootups += o.nodes[x].bootups;
+         nodes[x].emcy += o.nodes[x].emcy;
+         if (o.std_ids[0x700 + x].count)
+            nodes[x].state = o.nodes[x].state;
+         }
+
+      for (std::map<UNS64, UNS64>::const_iterator it = o.window_bits.begin(); it != o.window_bits.end(); ++it)
+         window_bits[it->first] += it->second;
+      for (std::map<std::pair<UNS8, UNS32>, UNS64>::const_iterator it = o.aborts.begin(); it != o.aborts.end(); ++it)
+         aborts[it->first] += it->second;
+      for (std::map<std::pair<UNS8, UNS16>, UNS64>::const_iterator it = o.emcy.begin(); it != o.emcy.end(); ++it)
+         emcy[it->first] += it->second;
+      }
+   };
+
+// Bits a frame occupies on the bus, without stuff bits
+static UNS32 frame_bits(const can_wire_frame &f)
+   {
+   UNS32 data = (f.id & CAN_WIRE_ID_RTR) ? 0 : 8 * (UNS32)f.len;
+   return ((f.id & CAN_WIRE_ID_EXT) ? 67 : 47) + data;
+   }
+
+static void scan(const char *path, std::size_t begin, std::size_t end, UNS64 window, piece_stat *out)
+   {
+   can_log_reader log;
+   if (!log.open(path))
+      return;
+
+   log.range(begin, end);
+
+   piece_stat &s = *out;
+   can_wire_frame f;
+   UNS64 win = ~(UNS64)0;
+   UNS64 bits = 0;
+
+   while (log.next(&f))
+      {
+      s.frames++;
+      s.cob(f.id).add(f.timestamp, f.len);
+
+      // frames come mostly in time order, so only touch the map when the window changes
+      UNS64 w = f.timestamp / window;
+      if (w != win)
+         {
+         if (bits)
+            s.window_bits[win] += bits;
+         win = w;
+         bits = 0;
+         }
+      bits += frame_bits(f);
+
+      cob_class c = classify(f.id);
+      s.classes[c]++;
+
+      UNS8 node = (UNS8)(f.id & 0x7F);
+
+      switch (c)
+         {
+         case CLS_NMT_EC:
+            s.nodes[node].state = f.data[0];
+            if (f.data[0] == 0)
+               s.nodes[node].bootups++;
+            break;
+
+         case CLS_EMCY:
+            s.nodes[node].emcy++;
+            s.emcy[std::make_pair(node, (UNS16)(f.data[0] | (f.data[1] << 8)))]++;
+            break;
+
+         case CLS_SDO_TX:
+         case CLS_SDO_RX:
+            if (f.len == 8 && f.data[0] == 0x80)
+               s.aborts[std::make_pair(node, can_wire_get32(f.data + 4))]++;
+            break;
+
+         default:
+            break;
+         }
+      }
+
+   if (bits)
+      s.window_bits[win] += bits;
+   }
+
+static double ms(double ns)
+   {
+   return ns / 1e6;
+   }
+
+static void print_cob(UNS32 id, const cob_stat &c)
+   {
+   double mean = 0, jitter = 0;
+   if (c.count > 1)
+      {
+      double n = (double)(c.count - 1);
+      mean = c.sum_gap / n;
+      double var = c.sum_gap2 / n - mean * mean;
+      jitter = var > 0 ? sqrt(var) : 0;
+      }
+
+   printf("%8X %-7s %10llu %10.3f %9.3f %10.3f %10.3f ", (unsigned)(id & CAN_WIRE_ID_MASK), class_names[classify(id)],
+      (unsigned long long)c.count, ms(mean), ms(jitter),
+      c.count > 1 ? ms((double)c.min_gap) : 0.0, ms((double)c.max_gap));
+
+   for (int x = 0; x < 9; x++)
+      {
+      if (c.dlc[x])
+         printf(" %d:%llu", x, (unsigned long long)c.dlc[x]);
+      }
+   printf("\n");
+   }
+
+static void report(const piece_stat &s, UNS64 window, UNS32 bitrate, bool loads)
+   {
+   printf("frames %llu\n", (unsigned long long)s.frames);
+   for (int x = 0; x < CLS_COUNT; x++)
+      {
+      if (s.classes[x])
+         printf("  %-7s %llu\n", class_names[x], (unsigned long long)s.classes[x]);
+      }
+
+   printf("\n     COB class        count  period ms jitter ms    min ms     max ms  dlc:count\n");
+   for (UNS32 x = 0; x < STATS_STD_IDS; x++)
+      {
+      if (s.std_ids[x].count)
+         print_cob(x, s.std_ids[x]);
+      }
+   for (std::map<UNS32, cob_stat>::const_iterator it = s.ext_ids.begin(); it != s.ext_ids.end(); ++it)
+      print_cob(it->first | CAN_WIRE_ID_EXT, it->second);
+
+   if (!s.window_bits.empty())
+      {
+      double capacity = (double)bitrate * (double)window / 1e9;
+      double total = 0, peak = 0;
+      UNS64 first = s.window_bits.begin()->first;
+      UNS64 last = s.window_bits.rbegin()->first;
+
+      for (std::map<UNS64, UNS64>::const_iterator it = s.window_bits.begin(); it != s.window_bits.end(); ++it)
+         {
+         double load = (double)it->second / capacity;
+         total += (double)it->second;
+         if (load > peak)
+            peak = load;
+         }
+
+      printf("\nbus load at %u bit/s over %.0f ms windows: mean %.1f%% peak %.1f%%\n", bitrate, ms((double)window),
+         100.0 * total / (capacity * (double)(last - first + 1)), 100.0 * peak);
+
+      if (loads)
+         {
+         for (std::map<UNS64, UNS64>::const_iterator it = s.window_bits.begin(); it != s.window_bits.end(); ++it)
+            printf("  %.3f %.1f%%\n", (double)(it->first * window) / 1e9, 100.0 * (double)it->second / capacity);
+         }
+      }
+
+   printf("\nnode heartbeats      gap ms     max ms  bootups state   emcy\n");
+   for (int x = 1; x < 128; x++)
+      {
+      const cob_stat &hb = s.std_ids[0x700 + x];
+      const node_stat &n = s.nodes[x];
+      if (hb.count == 0 && n.emcy == 0)
+         continue;
+
+      printf("%4d %10llu %10.3f %10.3f %8llu  0x%02X %6llu\n", x, (unsigned long long)hb.count,
+         hb.count > 1 ? ms(hb.sum_gap / (double)(hb.count - 1)) : 0.0, ms((double)hb.max_gap),
+         (unsigned long long)n.bootups, n.state, (unsigned long long)n.emcy);
+      }
+
+   if (!s.emcy.empty())
+      {
+      printf("\nnode EMCY code  count\n");
+      for (std::map<std::pair<UNS8, UNS16>, UNS64>::const_iterator it = s.emcy.begin(); it != s.emcy.end(); ++it)
+         printf("%4d    0x%04X %6llu\n", it->first.first, it->first.second, (unsigned long long)it->second);
+      }
+
+   if (!s.aborts.empty())
+      {
+      printf("\nnode SDO abort  count\n");
+      for (std::map<std::pair<UNS8, UNS32>, UNS64>::const_iterator it = s.aborts.begin(); it != s.aborts.end(); ++it)
+         printf("%4d 0x%08X %6llu\n", it->first.first, it->first.second, (unsigned long long)it->second);
+      }
+   }
+
+static int usage()
+   {
+   fprintf(stderr, "usage: can_stats [-j threads] [-w window_ms] [-b bitrate] [-loads] <capture>\n");
+   return 2;
+   }
+
+int main(int argc, char **argv)
+   {
+   unsigned threads = std::thread::hardware_concurrency();
+   UNS64 window = 100 * 1000000ULL;
+   UNS32 bitrate = 1000000;
+   bool loads = false;
+   int arg = 1;
+
+   for (; arg < argc && argv[arg][0] == '-'; arg++)
+      {
+      if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc)
+         threads = (unsigned)atoi(argv[++arg]);
+      else if (strcmp(argv[arg], "-w") == 0 && arg + 1 < argc)
+         window = (UNS64)(atof(argv[++arg]) * 1e6);
+      else if (strcmp(argv[arg], "-b") == 0 && arg + 1 < argc)
+         bitrate = (UNS32)strtoul(argv[++arg], NULL, 0);
+      else if (strcmp(argv[arg], "-loads") == 0)
+         loads = true;
+      else
+         return usage();
+      }
+
+   if (argc - arg != 1 || window == 0 || bitrate == 0)
+      return usage();
+   if (threads == 0)
+      threads = 1;
+
+   const char *path = argv[arg];
+   can_log_reader log;
+   if (!log.open(path))
+      return 1;
+
+   // a few pieces per thread keeps the cores busy when pieces are uneven
+   std::vector<std::size_t> starts;
+   log.split(threads * 4, starts);
+   starts.push_back(log.size());
+
+   std::size_t pieces = starts.size() - 1;
+   std::vector<piece_stat> stats(pieces);
+   std::vector<std::thread> pool;
+   std::atomic<std::size_t> next(0);
+
+   std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+   for (unsigned t = 0; t < threads && t < pieces; t++)
+      {
+      pool.push_back(std::thread([&]()
+         {
+         std::size_t i;
+         while ((i = next.fetch_add(1)) < pieces)
+            scan(path, starts[i], starts[i + 1], window, &stats[i]);
+         }));
+      }
+
+   for (std::size_t t = 0; t < pool.size(); t++)
+      pool[t].join();
+
+   piece_stat total;
+   for (std::size_t i = 0; i < pieces; i++)
+      total.merge(stats[i]);
+
+   double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+   fprintf(stderr, "%s: %llu bytes in %.3f s (%.0f MB/s) on %u threads\n", path, (unsigned long long)log.size(),
+      secs, (double)log.size() / secs / 1e6, (unsigned)pool.size());
+
+   report(total, window, bitrate, loads);
+   return 0;
+   }
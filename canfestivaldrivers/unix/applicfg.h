@@ -0,0 +1,117 @@
+/*
+This file is part of CanFestival, a library implementing CanOpen Stack.
+
+Copyright (C): Edouard TISSERANT and Francis DUPIN
+
+See COPYING file for copyrights details.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __APPLICFG_UNIX__
+#define __APPLICFG_UNIX__
+
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+// Integers
+#define INTEGER8 int8_t
+#define INTEGER16 int16_t
+#define INTEGER24 int32_t
+#define INTEGER32 int32_t
+#define INTEGER40 int64_t
+#define INTEGER48 int64_t
+#define INTEGER56 int64_t
+#define INTEGER64 int64_t
+
+// Unsigned integers
+#define UNS8   uint8_t
+#define UNS16  uint16_t
+#define UNS32  uint32_t
+#define UNS24  uint32_t
+#define UNS40  uint64_t
+#define UNS48  uint64_t
+#define UNS56  uint64_t
+#define UNS64  uint64_t
+
+// Reals
+#define REAL32 float
+#define REAL64 double
+
+// Custom integer types sizes
+#define sizeof_INTEGER24 3
+#define sizeof_INTEGER40 5
+#define sizeof_INTEGER48 6
+#define sizeof_INTEGER56 7
+
+#define sizeof_UNS24  3
+#define sizeof_UNS40  5
+#define sizeof_UNS48  6
+#define sizeof_UNS56  7
+
+// Non integral integers conversion macros
+#define INT24_2_32(a) (a <= 0x7FFFFF ? a : a|0xFF000000)
+#define INT40_2_64(a) (a <= 0x0000007FFFFFFFFF ? a : a|0xFFFFFF0000000000)
+#define INT48_2_64(a) (a <= 0x00007FFFFFFFFFFF ? a : a|0xFFFF000000000000)
+#define INT56_2_64(a) (a <= 0x007FFFFFFFFFFFFF ? a : a|0xFF00000000000000)
+
+#define INT32_2_24(a) (a&0x00FFFFFF)
+#define INT64_2_40(a) (a&0x000000FFFFFFFFFF)
+#define INT64_2_48(a) (a&0x0000FFFFFFFFFFFF)
+#define INT64_2_56(a) (a&0x00FFFFFFFFFFFFFF)
+
+/// Definition of error and warning macros
+// --------------------------------------
+
+#define MSG(...) \
+  do{printf(__VA_ARGS__);fflush(stdout);}while(0)
+
+#define CANFESTIVAL_DEBUG_MSG(num, str, val)\
+  {unsigned long value = val;\
+   MSG("%s(%d) : 0x%X %s 0x%lX\n",__FILE__, __LINE__,num, str, value); \
+   }
+
+#define CANFESTIVAL_DEBUG_DRV_MSG(...)\
+  MSG(__VA_ARGS__);
+
+/// Definition of MSG_WAR
+// ---------------------
+#ifdef DEBUG_WAR_CONSOLE_ON
+    #define MSG_WAR(num, str, val) CANFESTIVAL_DEBUG_MSG(num, str, val)
+#else
+#    define MSG_WAR(num, str, val)
+#endif
+
+/// Definition of MSG_ERR
+// ---------------------
+#ifdef DEBUG_ERR_CONSOLE_ON
+#    define MSG_ERR(num, str, val) CANFESTIVAL_DEBUG_MSG(num, str, val)
+#else
+#    define MSG_ERR(num, str, val)
+#endif
+
+#ifdef DEBUG_ERR_DRIVER_CONSOLE_ON
+#    define MSG_ERR_DRV(...) CANFESTIVAL_DEBUG_DRV_MSG(__VA_ARGS__)
+#else
+#    define MSG_ERR_DRV(...)
+#endif
+
+
+typedef void* CAN_HANDLE;
+
+typedef void* CAN_PORT;
+
+#endif // __APPLICFG_UNIX__
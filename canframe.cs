@@ -0,0 +1,156 @@
+﻿/*
+    This file is part of libCanopenSimple.
+    libCanopenSimple is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    libCanopenSimple is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with libCanopenSimple.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright(c) 2017 Robin Cornelius <robin.cornelius@gmail.com>
+*/
+
+using System;
+
+namespace libCanopenSimple
+{
+    /// <summary>
+    /// Value type CAN frame, the payload is held inline in a UInt64 (byte 0 in the low bits, the same
+    /// layout as DriverInstance.Message.data) so frames can be queued, dispatched and sent without
+    /// any heap allocation. canpacket remains for existing code and converts to and from this.
+    /// </summary>
+    public struct canframe
+    {
+        public UInt16 cob;
+        public byte len;
+        public bool bridge;
+        public UInt64 payload;
+
+        /// <summary>
+        /// When the frame was received or sent, SimClock.Timestamp units (Stopwatch ticks)
+        /// </summary>
+        public long timestamp;
+
+        /// <summary>
+        /// Construct a frame from a CanFestival message
+        /// </summary>
+        /// <param name="msg">A CanFestival message struct</param>
+        public canframe(DriverInstance.Message msg, bool bridge = false)
+        {
+            cob = msg.cob_id;
+            len = msg.len > 8 ? (byte)8 : msg.len;
+            this.bridge = bridge;
+            payload = msg.data & mask(len);
+            timestamp = 0;
+        }
+
+        /// <summary>
+        /// Construct a frame from up to 8 bytes of data
+        /// </summary>
+        public canframe(UInt16 cob, byte[] data, int offset = 0, int count = -1)
+        {
+            if (count < 0)
+                count = data == null ? 0 : data.Length - offset;
+            if (count > 8)
+                count = 8;
+
+            this.cob = cob;
+            len = (byte)count;
+            bridge = false;
+            payload = 0;
+            timestamp = 0;
+
+            for (int x = 0; x < count; x++)
+                payload |= (UInt64)data[offset + x] << (8 * x);
+        }
+
+        /// <summary>
+        /// Payload byte, reads past len return 0
+        /// </summary>
+        public byte this[int index]
+        {
+            get
+            {
+                return (byte)(payload >> (8 * (index & 7)));
+            }
+            set
+            {
+                int shift = 8 * (index & 7);
+                payload = (payload & ~((UInt64)0xFF << shift)) | ((UInt64)value << shift);
+            }
+        }
+
+        /// <summary>
+        /// Little endian 16 bit value at offset
+        /// </summary>
+        public UInt16 u16(int offset)
+        {
+            return (UInt16)(payload >> (8 * offset));
+        }
+
+        /// <summary>
+        /// Little endian 32 bit value at offset
+        /// </summary>
+        public UInt32 u32(int offset)
+        {
+            return (UInt32)(payload >> (8 * offset));
+        }
+
+        /// <summary>
+        /// Convert to a CanFestival message
+        /// </summary>
+        /// <returns>CanFestival message</returns>
+        public DriverInstance.Message ToMsg()
+        {
+            DriverInstance.Message msg = new DriverInstance.Message();
+            msg.cob_id = cob;
+            msg.len = len;
+            msg.rtr = 0;
+            msg.data = payload;
+            return msg;
+        }
+
+        /// <summary>
+        /// Copy the len payload bytes out to an array
+        /// </summary>
+        public void CopyTo(byte[] dest, int offset = 0)
+        {
+            for (int x = 0; x < len; x++)
+                dest[offset + x] = (byte)(payload >> (8 * x));
+        }
+
+        /// <summary>
+        /// The payload as a new array, for APIs that still want one
+        /// </summary>
+        public byte[] ToArray()
+        {
+            byte[] data = new byte[len];
+            CopyTo(data);
+            return data;
+        }
+
+        static UInt64 mask(int len)
+        {
+            return len >= 8 ? UInt64.MaxValue : (((UInt64)1 << (8 * len)) - 1);
+        }
+
+        /// <summary>
+        /// Dump frame to string
+        /// </summary>
+        /// <returns>Formatted string of the frame</returns>
+        public override string ToString()
+        {
+            string output = string.Format("{0:x3} {1:x1}", cob, len);
+
+            for (int x = 0; x < len; x++)
+            {
+                output += string.Format(" {0:x2}", this[x]);
+            }
+            return output;
+        }
+    }
+}
@@ -0,0 +1,178 @@
+﻿/*
+    This file is part of libCanopenSimple.
+    libCanopenSimple is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    libCanopenSimple is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with libCanopenSimple.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright(c) 2017 Robin Cornelius <robin.cornelius@gmail.com>
+*/
+
+using System;
+using System.Threading;
+
+namespace libCanopenSimple
+{
+    /// <summary>
+    /// Fixed size queue of frames between the driver (and any thread sending with echo on) and the
+    /// worker. All slots are allocated up front so a slow consumer can never make memory grow, a full
+    /// ring is handled by libCanopenSimple according to rxoverflow. Lock free for any number of
+    /// producers and consumers, each slot carries a sequence number saying whose turn it is
+    /// (D. Vyukov's bounded MPMC queue), which also lets a producer throw away the oldest frame.
+    /// </summary>
+    internal class canring
+    {
+        struct slot
+        {
+            public long seq;
+            public canframe frame;
+        }
+
+        readonly slot[] slots;
+        readonly int mask;
+        long enqueuepos = 0;
+        long dequeuepos = 0;
+
+        /// <summary>
+        /// Make a ring, the size is rounded up to a power of two
+        /// </summary>
+        public canring(int size)
+        {
+            int capacity = 2;
+            while (capacity < size && capacity < (1 << 30))
+                capacity <<= 1;
+
+            slots = new slot[capacity];
+            mask = capacity - 1;
+
+            for (int x = 0; x < capacity; x++)
+                slots[x].seq = x;
+        }
+
+        public int Capacity
+        {
+            get { return slots.Length; }
+        }
+
+        /// <summary>
+        /// Frames queued, only a snapshot while producers and consumers are busy
+        /// </summary>
+        public int Count
+        {
+            get
+            {
+                long count = Volatile.Read(ref enqueuepos) - Volatile.Read(ref dequeuepos);
+                return (int)Math.Min(Math.Max(count, 0), slots.Length);
+            }
+        }
+
+        /// <summary>
+        /// True if there is no frame ready to dequeue
+        /// </summary>
+        public bool IsEmpty
+        {
+            get
+            {
+                long pos = Volatile.Read(ref dequeuepos);
+                return Volatile.Read(ref slots[pos & mask].seq) != pos + 1;
+            }
+        }
+
+        /// <summary>
+        /// Add a frame
+        /// </summary>
+        /// <returns>False if the ring is full</returns>
+        public bool TryEnqueue(canframe f)
+        {
+            long pos = Volatile.Read(ref enqueuepos);
+
+            while (true)
+            {
+                int x = (int)(pos & mask);
+                long dif = Volatile.Read(ref slots[x].seq) - pos;
+
+                if (dif == 0)
+                {
+                    long seen = Interlocked.CompareExchange(ref enqueuepos, pos + 1, pos);
+                    if (seen == pos)
+                    {
+                        slots[x].frame = f;
+                        Volatile.Write(ref slots[x].seq, pos + 1);
+                        return true;
+                    }
+                    pos = seen;
+                }
+                else if (dif < 0)
+                {
+                    // the consumer has not freed this slot from the previous lap yet
+                    return false;
+                }
+                else
+                {
+                    pos = Volatile.Read(ref enqueuepos);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Take the oldest frame
+        /// </summary>
+        /// <returns>False if the ring is empty</returns>
+        public bool TryDequeue(out canframe f)
+        {
+            long pos = Volatile.Read(ref dequeuepos);
+
+            while (true)
+            {
+                int x = (int)(pos & mask);
+                long dif = Volatile.Read(ref slots[x].seq) - (pos + 1);
+
+                if (dif == 0)
+                {
+                    long seen = Interlocked.CompareExchange(ref dequeuepos, pos + 1, pos);
+                    if (seen == pos)
+                    {
+                        f = slots[x].frame;
+                        Volatile.Write(ref slots[x].seq, pos + slots.Length);
+                        return true;
+                    }
+                    pos = seen;
+                }
+                else if (dif < 0)
+                {
+                    f = default(canframe);
+                    return false;
+                }
+                else
+                {
+                    pos = Volatile.Read(ref dequeuepos);
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Receive queue figures, see libCanopenSimple.getRxQueueStats()
+    /// </summary>
+    public struct rxqueuestats
+    {
+        /// <summary>Frames the queue holds</summary>
+        public int capacity;
+        /// <summary>Frames queued now</summary>
+        public int count;
+        /// <summary>Most frames that have been queued at once</summary>
+        public int highwater;
+        /// <summary>Frames thrown away because the queue was full</summary>
+        public long dropped;
+        /// <summary>Of those, NMT, heartbeat and EMCY frames</summary>
+        public long droppedpriority;
+        /// <summary>Frames the driver had to wait to queue (OVERFLOW_BLOCK)</summary>
+        public long blocked;
+    }
+}
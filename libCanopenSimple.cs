@@ -17,6 +17,7 @@
 using System;
 using System.Collections.Generic;
 using System.Threading;
+using System.Threading.Tasks;
 using System.Collections.Concurrent;
 using System.Runtime.CompilerServices;
 
@@ -41,9 +42,21 @@ namespace libCanopenSimple
         DEBUG_NONE
     }
 
+    /// <summary>
+    /// What happens to a received frame when the receive queue is full
+    /// </summary>
+    public enum overflowpolicy
+    {
+        OVERFLOW_BLOCK,          // the driver waits for room, nothing is lost in the process
+        OVERFLOW_DROP_OLDEST,    // the oldest queued frame makes way
+        OVERFLOW_DROP_NEWEST,    // the new frame is thrown away
+        OVERFLOW_DROP_BY_CLASS,  // other frames are dropped first so NMT, heartbeat and EMCY frames get through
+    }
+
     /// <summary>
     /// C# representation of a CanPacket, containing the COB the length and the data. RTR is not supported
     /// as its prettly much not used on CanOpen, but this could be added later if necessary
+    /// Internally frames are carried as canframe, this class is kept for the original event and send API
     /// </summary>
     public class canpacket
     {
@@ -61,14 +74,31 @@ namespace libCanopenSimple
         /// </summary>
         /// <param name="msg">A CanFestival message struct</param>
         public canpacket(DriverInstance.Message msg,bool bridge=false)
+            : this(new canframe(msg, bridge))
         {
-            cob = msg.cob_id;
-            len = msg.len;
-            data = new byte[len];
-            this.bridge = bridge;
+        }
 
-            byte[] temp = BitConverter.GetBytes(msg.data);
-            Array.Copy(temp, data, msg.len);
+        /// <summary>
+        /// Construct C# Canpacket from a canframe
+        /// </summary>
+        /// <param name="f">Frame to copy</param>
+        public canpacket(canframe f)
+        {
+            cob = f.cob;
+            len = f.len;
+            data = f.ToArray();
+            bridge = f.bridge;
+        }
+
+        /// <summary>
+        /// Convert to a canframe
+        /// </summary>
+        /// <returns>The equivalent frame</returns>
+        public canframe ToFrame()
+        {
+            canframe f = new canframe(cob, data, 0, len);
+            f.bridge = bridge;
+            return f;
         }
 
         /// <summary>
@@ -77,17 +107,7 @@ namespace libCanopenSimple
         /// <returns>CanFestival message</returns>
         public DriverInstance.Message ToMsg()
         {
-            DriverInstance.Message msg = new DriverInstance.Message();
-            msg.cob_id = cob;
-            msg.len = len;
-            msg.rtr = 0;
-
-            byte[] temp = new byte[8];
-            Array.Copy(data, temp, len);
-            msg.data = BitConverter.ToUInt64(temp, 0);
-
-            return msg;
-
+            return ToFrame().ToMsg();
         }
 
         /// <summary>
@@ -123,7 +143,56 @@ namespace libCanopenSimple
 
         Dictionary<UInt16, NMTState> nmtstate = new Dictionary<ushort, NMTState>();
 
-        private Queue<SDO> sdo_queue = new Queue<SDO>();
+        // Queued SDOs, one FIFO per node so a busy node never holds up the others. sdoready lists the
+        // nodes that have something queued in the order they are offered a slot (round robin)
+        private Queue<SDO>[] sdoqueues = new Queue<SDO>[0x80];
+        private Queue<byte> sdoready = new Queue<byte>();
+        private int sdoqueued = 0;
+        private int sdoinflight = 0;
+        private readonly object sdolock = new object();
+        private List<SDO> sdostarting = new List<SDO>();
+
+        // SDOs whose CancellationToken has fired, the worker cancels them so the SDO state machine stays single threaded
+        private ConcurrentQueue<SDO> sdocancels = new ConcurrentQueue<SDO>();
+
+        /// <summary>
+        /// Most SDO transfers allowed in progress at once across all nodes, limits the bus load a
+        /// large batch of requests can cause
+        /// </summary>
+        public int sdomaxinflight = 32;
+
+        /// <summary>
+        /// Use SDO block transfers, for all reads and for writes of more than 4 bytes. A node that
+        /// turns block mode down is remembered and gets expedited/segmented transfers from then on
+        /// </summary>
+        public bool sdoblock = false;
+
+        /// <summary>
+        /// Segments per block offered to the server (1-127), the server may ask for fewer
+        /// </summary>
+        public byte sdoblocksize = 127;
+
+        // Nodes that have rejected a block transfer, only touched by the worker
+        private bool[] sdonoblock = new bool[0x80];
+
+        /// <summary>
+        /// Longest an SDO waits for a reply. Used as is for writes (the node may take a while to apply them),
+        /// for blocks of segments and for reads from a node whose response time has not been measured yet
+        /// </summary>
+        public TimeSpan sdotimeout = new TimeSpan(0, 0, 1);
+
+        /// <summary>
+        /// Shortest timeout a read request gets however quickly the node has been answering
+        /// </summary>
+        public TimeSpan sdotimeoutmin = TimeSpan.FromMilliseconds(50);
+
+        /// <summary>
+        /// Times a read that gets no reply in time is started again before it fails, writes are never repeated
+        /// </summary>
+        public int sdoretries = 2;
+
+        // Response time of each node, read requests time out after the node's smoothed RTT plus 4 times its variation
+        private SDOrtt[] sdortts = new SDOrtt[0x80];
 
         DriverLoader loader = new DriverLoader();
 
@@ -136,6 +205,7 @@ namespace libCanopenSimple
             {
                 NMTState nmt = new NMTState();
                 nmtstate[x] = nmt;
+                sdortts[x] = new SDOrtt();
             }
         }
 
@@ -155,6 +225,9 @@ namespace libCanopenSimple
             if (driver.open(string.Format("{0}", comport), speed) == false)
                 return false;
 
+            if (packetqueue.Capacity < rxqueuesize || packetqueue.Capacity >= 2 * rxqueuesize)
+                packetqueue = new canring(rxqueuesize);
+
             driver.rxmessage += Driver_rxmessage;
 
             threadrun = true;
@@ -211,13 +284,25 @@ namespace libCanopenSimple
         /// <param name="p"></param>
         public void SendPacket(canpacket p, bool bridge=false)
         {
-            DriverInstance.Message msg = p.ToMsg();
+            SendFrame(p.ToFrame(), bridge);
+        }
+
+        /// <summary>
+        /// Send a Can frame on the bus
+        /// </summary>
+        /// <param name="f">Frame to send</param>
+        public void SendFrame(canframe f, bool bridge=false)
+        {
+            DriverInstance.Message msg = f.ToMsg();
 
-            driver.cansend(msg);
+            driver.cansend(ref msg);
 
             if (echo == true)
             {
-                Driver_rxmessage(msg,bridge);
+                f.bridge = bridge;
+                f.timestamp = SimClock.Timestamp;
+                rxenqueue(f);
+                wake();
             }
         }
 
@@ -227,7 +312,126 @@ namespace libCanopenSimple
         /// <param name="msg">CanOpen message recieved from the bus</param>
         private void Driver_rxmessage(DriverInstance.Message msg,bool bridge=false)
         {
-            packetqueue.Enqueue(new canpacket(msg,bridge));
+            canframe f = new canframe(msg, bridge);
+            f.timestamp = SimClock.Timestamp;
+            rxenqueue(f);
+            wake();
+        }
+
+        /// <summary>
+        /// Queue a frame for the worker, applying rxoverflow if the queue is full
+        /// </summary>
+        void rxenqueue(canframe f)
+        {
+            canring q = packetqueue;
+
+            if (rxoverflow == overflowpolicy.OVERFLOW_DROP_BY_CLASS && !rxpriority(f))
+            {
+                // keep the last quarter of the queue free for the frames that matter
+                if (q.Count >= q.Capacity - q.Capacity / 4 || !q.TryEnqueue(f))
+                {
+                    Interlocked.Increment(ref rxdropped);
+                    return;
+                }
+            }
+            else if (!q.TryEnqueue(f))
+            {
+                switch (rxoverflow)
+                {
+                    case overflowpolicy.OVERFLOW_BLOCK:
+                        // the worker would wait on itself, and after close() nobody is left to make room
+                        if (Thread.CurrentThread == workerthread || !threadrun)
+                        {
+                            Interlocked.Increment(ref rxdropped);
+                            if (rxpriority(f))
+                                Interlocked.Increment(ref rxdroppedpriority);
+                            return;
+                        }
+
+                        Interlocked.Increment(ref rxblocked);
+                        SpinWait spin = new SpinWait();
+                        while (!q.TryEnqueue(f))
+                        {
+                            if (!threadrun)
+                            {
+                                Interlocked.Increment(ref rxdropped);
+                                return;
+                            }
+                            wake();
+                            spin.SpinOnce();
+                        }
+                        break;
+
+                    case overflowpolicy.OVERFLOW_DROP_NEWEST:
+                        Interlocked.Increment(ref rxdropped);
+                        if (rxpriority(f))
+                            Interlocked.Increment(ref rxdroppedpriority);
+                        return;
+
+                    default:
+                        // drop oldest, and a priority frame that found the reserve used up
+                        do
+                        {
+                            canframe old;
+                            if (q.TryDequeue(out old))
+                            {
+                                Interlocked.Increment(ref rxdropped);
+                                if (rxpriority(old))
+                                    Interlocked.Increment(ref rxdroppedpriority);
+                            }
+                        }
+                        while (!q.TryEnqueue(f));
+                        break;
+                }
+            }
+
+            int count = q.Count;
+            int high = Volatile.Read(ref rxhighwater);
+            while (count > high)
+            {
+                int seen = Interlocked.CompareExchange(ref rxhighwater, count, high);
+                if (seen == high)
+                    break;
+                high = seen;
+            }
+        }
+
+        /// <summary>
+        /// NMT, heartbeat and EMCY frames are the last to be dropped under OVERFLOW_DROP_BY_CLASS
+        /// </summary>
+        bool rxpriority(canframe f)
+        {
+            cobclass kind = Volatile.Read(ref cobtable)[f.cob & 0x7FF].kind;
+            return kind == cobclass.NMT || kind == cobclass.NMT_EC || kind == cobclass.EMCY;
+        }
+
+        /// <summary>
+        /// Receive queue size and overflow counters
+        /// </summary>
+        public rxqueuestats getRxQueueStats()
+        {
+            rxqueuestats st;
+            canring q = packetqueue;
+
+            st.capacity = q.Capacity;
+            st.count = q.Count;
+            st.highwater = Volatile.Read(ref rxhighwater);
+            st.dropped = Interlocked.Read(ref rxdropped);
+            st.droppedpriority = Interlocked.Read(ref rxdroppedpriority);
+            st.blocked = Interlocked.Read(ref rxblocked);
+
+            return st;
+        }
+
+        /// <summary>
+        /// Zero the receive queue high water mark and overflow counters
+        /// </summary>
+        public void resetRxQueueStats()
+        {
+            Volatile.Write(ref rxhighwater, 0);
+            Interlocked.Exchange(ref rxdropped, 0);
+            Interlocked.Exchange(ref rxdroppedpriority, 0);
+            Interlocked.Exchange(ref rxblocked, 0);
         }
 
 
@@ -237,6 +441,7 @@ namespace libCanopenSimple
         public void close()
         {
             threadrun = false;
+            workready.Set();
 
             if (driver == null)
                 return;
@@ -248,9 +453,134 @@ namespace libCanopenSimple
 
         #endregion
 
-        Dictionary<UInt16, Action<byte[]>> PDOcallbacks = new Dictionary<ushort, Action<byte[]>>();
-        public Dictionary<UInt16, SDO> SDOcallbacks = new Dictionary<ushort, SDO>();
-        ConcurrentQueue<canpacket> packetqueue = new ConcurrentQueue<canpacket>();
+        /// <summary>
+        /// What a COB-ID is, decided once for all 2048 11 bit identifiers
+        /// </summary>
+        enum cobclass : byte
+        {
+            NONE,
+            NMT,
+            SYNC,
+            EMCY,
+            TIME,
+            PDO,
+            SDO_TX,
+            SDO_RX,
+            NMT_EC,
+            LSS,
+        }
+
+        struct cobentry
+        {
+            public cobclass kind;
+            public Action<canframe> handler;
+        }
+
+        // Indexed by COB-ID, replaced as a whole (copy on write) when a handler is registered so the
+        // worker reads it without locking
+        cobentry[] cobtable = buildcobtable();
+        readonly object cobtablelock = new object();
+
+        static cobentry[] buildcobtable()
+        {
+            cobentry[] table = new cobentry[0x800];
+
+            for (int cob = 0; cob < 0x800; cob++)
+            {
+                cobclass kind = cobclass.NONE;
+
+                if (cob == 0x000)
+                    kind = cobclass.NMT;
+                else if (cob == 0x080)
+                    kind = cobclass.SYNC;
+                else if (cob > 0x080 && cob <= 0x0FF)
+                    kind = cobclass.EMCY;
+                else if (cob == 0x100)
+                    kind = cobclass.TIME;
+                else if (cob >= 0x180 && cob <= 0x57F)
+                    kind = cobclass.PDO;
+                else if (cob >= 0x580 && cob < 0x600)
+                    kind = cobclass.SDO_TX;
+                else if (cob >= 0x600 && cob < 0x680)
+                    kind = cobclass.SDO_RX;
+                else if (cob > 0x700 && cob <= 0x77F)
+                    kind = cobclass.NMT_EC;
+                else if (cob == 0x7E5)
+                    kind = cobclass.LSS;
+
+                table[cob].kind = kind;
+            }
+
+            return table;
+        }
+
+        void setcobhandler(UInt16 cob, Action<canframe> handler)
+        {
+            if (cob >= 0x800)
+                return;
+
+            lock (cobtablelock)
+            {
+                cobentry[] table = (cobentry[])cobtable.Clone();
+                table[cob].handler = handler;
+                Volatile.Write(ref cobtable, table);
+            }
+        }
+
+        // The transfer in progress with each node, replies for node n go straight to sdoslots[n].
+        // Only changed under sdolock, read by the worker without it
+        SDO[] sdoslots = new SDO[0x80];
+
+        // Transfers in progress across every libCanopenSimple, only kept for the obsolete SDO.isEmpty()
+        internal static int sdoactive = 0;
+
+        /// <summary>
+        /// Snapshot of the transfer in progress with each node, keyed by its reply COB (0x580 + node)
+        /// </summary>
+        [Obsolete("SDOs are held in per node slots by the worker, this is a copy and changing it has no effect")]
+        public Dictionary<UInt16, SDO> SDOcallbacks
+        {
+            get
+            {
+                Dictionary<UInt16, SDO> active = new Dictionary<UInt16, SDO>();
+
+                lock (sdolock)
+                {
+                    for (int node = 0; node < sdoslots.Length; node++)
+                    {
+                        if (sdoslots[node] != null)
+                            active.Add((UInt16)(0x580 + node), sdoslots[node]);
+                    }
+                }
+
+                return active;
+            }
+        }
+
+        // Response deadlines of the transfers in sdoslots, only touched by the worker
+        SDOdeadlines sdodeadlines = new SDOdeadlines();
+        canring packetqueue = new canring(16384);
+
+        /// <summary>
+        /// Frames the receive queue between the driver and the worker holds, takes effect on open()
+        /// (rounded up to a power of two). The queue never grows so slow event handlers can not run
+        /// the process out of memory, what happens when it is full is set by rxoverflow.
+        /// </summary>
+        public int rxqueuesize = 16384;
+
+        /// <summary>
+        /// What to do with received frames when the receive queue is full
+        /// </summary>
+        public overflowpolicy rxoverflow = overflowpolicy.OVERFLOW_BLOCK;
+
+        // Receive queue counters, see getRxQueueStats()
+        int rxhighwater = 0;
+        long rxdropped = 0;
+        long rxdroppedpriority = 0;
+        long rxblocked = 0;
+
+        // The worker's thread, it must never block on its own queue when it sends with echo on
+        volatile Thread workerthread;
 
         public delegate void ConnectionEvent(object sender, EventArgs e);
         public event ConnectionEvent connectionevent;
@@ -282,8 +612,85 @@ namespace libCanopenSimple
         public delegate void SYNCEvent(canpacket p, DateTime dt);
         public event SYNCEvent syncevent;
 
+        /// <summary>
+        /// Allocation free counterparts of the events above, the frame is passed by value.
+        /// pdoframeevent fires once per PDO rather than with an array of the batch.
+        /// </summary>
+        public delegate void FrameEvent(canframe f, DateTime dt);
+        public event FrameEvent frameevent;
+        public event FrameEvent sdoframeevent;
+        public event FrameEvent nmtframeevent;
+        public event FrameEvent nmtecframeevent;
+        public event FrameEvent pdoframeevent;
+        public event FrameEvent emcyframeevent;
+        public event FrameEvent lssframeevent;
+        public event FrameEvent timeframeevent;
+        public event FrameEvent syncframeevent;
+
         bool threadrun = true;
 
+        // Set when a queued SDO can be issued, lets the simulated clock know we are not idle
+        // without having to take sdolock from inside the clock
+        volatile bool sdowork = false;
+
+        // Signalled whenever the worker has something to do, it sleeps on this rather than polling
+        AutoResetEvent workready = new AutoResetEvent(false);
+        int parked = 0;
+
+        // Longest the worker parks without a wake, so a switch to simulated time is noticed
+        const int PARK_MAX_MS = 100;
+
+        /// <summary>
+        /// Number of times the worker checks for new frames, with a short busy wait in between, before it blocks,
+        /// 0 blocks at once. Spinning a little cuts the wake up latency at the cost of CPU while the bus is quiet,
+        /// it is skipped on a single CPU where it would only hold up the driver thread.
+        /// </summary>
+        public int wakespin = 0;
+
+        /// <summary>
+        /// Hand the worker new work, frames, queued SDOs or a close
+        /// </summary>
+        void wake()
+        {
+            // pairs with the exchange in park(), either we see parked or the worker sees our work
+            Thread.MemoryBarrier();
+            if (Volatile.Read(ref parked) != 0)
+                workready.Set();
+            SimClock.Wake();
+        }
+
+        /// <summary>
+        /// Block the worker until there is work or the earliest SDO needs attention
+        /// </summary>
+        void park()
+        {
+            // not SpinWait.SpinOnce(), after a few rounds that sleeps for a whole ms and is slower than parking
+            if (Environment.ProcessorCount > 1)
+            {
+                for (int x = 0; x < wakespin && packetqueue.IsEmpty; x++)
+                    Thread.SpinWait(20);
+            }
+
+            Interlocked.Exchange(ref parked, 1);
+
+            // anything queued before parked was seen set has not signalled, so look again first
+            if (threadrun && packetqueue.IsEmpty && !sdowork)
+            {
+                DateTime deadline = sdonextdeadline();
+                int ms = PARK_MAX_MS;
+
+                if (deadline == DateTime.MinValue)
+                    ms = 0;
+                else if (deadline != DateTime.MaxValue)
+                    ms = (int)Math.Min(Math.Max(Math.Ceiling((deadline - SimClock.Now).TotalMilliseconds) + 1, 0), PARK_MAX_MS);
+
+                if (ms != 0)
+                    workready.WaitOne(ms);
+            }
+
+            Volatile.Write(ref parked, 0);
+        }
+
         /// <summary>
         /// Register a parser handler for a PDO, if a PDO is recieved with a matching COB this function will be called
         /// so that additional messages can be added for bus decoding and monitoring
@@ -292,7 +699,17 @@ namespace libCanopenSimple
         /// <param name="handler">function(byte[] data]{} function to invoke</param>
         public void registerPDOhandler(UInt16 cob, Action<byte[]> handler)
         {
-            PDOcallbacks[cob] = handler;
+            setcobhandler(cob, f => handler(f.ToArray()));
+        }
+
+        /// <summary>
+        /// Register a parser handler for a PDO that takes the frame itself, no array is allocated per PDO
+        /// </summary>
+        /// <param name="cob">COB to match</param>
+        /// <param name="handler">function(canframe f){} function to invoke</param>
+        public void registerPDOframehandler(UInt16 cob, Action<canframe> handler)
+        {
+            setcobhandler(cob, handler);
         }
 
         /// <summary>
@@ -302,133 +719,422 @@ namespace libCanopenSimple
         /// </summary>
         void asyncprocess()
         {
+            SimClock.Participant clock = SimClock.Join(() => !packetqueue.IsEmpty || sdowork);
+            workerthread = Thread.CurrentThread;
+            List<canpacket> pdos = new List<canpacket>();
+            DateTime pdotime = DateTime.MinValue;
+
             while (threadrun)
             {
-                canpacket cp;
-                List<canpacket> pdos = new List<canpacket>();
+                canframe cf;
+
+                // We are idle whenever nothing can progress until a frame arrives or an SDO times out
+                lock (sdolock)
+                    sdowork = sdoissuable() || !sdocancels.IsEmpty;
 
-                while (threadrun && packetqueue.IsEmpty && pdos.Count==0 && sdo_queue.Count==0 && SDO.isEmpty())
+                if (SimClock.simulated)
                 {
-                    System.Threading.Thread.Sleep(0);
+                    if (packetqueue.IsEmpty && !sdowork)
+                        SimClock.Wait(clock, sdonextdeadline(), 1);
                 }
+                else if (threadrun && packetqueue.IsEmpty && !sdowork)
+                {
+                    park();
+                }
+
+                cobentry[] table = Volatile.Read(ref cobtable);
 
-                while (packetqueue.TryDequeue(out cp))
+                while (packetqueue.TryDequeue(out cf))
                 {
+                    // the class based events share one canpacket per frame, made only if one of them is subscribed
+                    canpacket cp = null;
 
-                    if (cp.bridge == false)
+                    // every consumer of this frame sees the time it was received
+                    DateTime dt = SimClock.ToDateTime(cf.timestamp);
+
+                    if (cf.bridge == false)
                     {
-                        if(packetevent!=null)
-                            packetevent(cp, DateTime.Now);
+                        if (frameevent != null)
+                            frameevent(cf, dt);
+                        if (packetevent != null)
+                            packetevent(cp = new canpacket(cf), dt);
                     }
 
-                    //PDO 0x180 -- 0x57F
-                    if (cp.cob >= 0x180 && cp.cob <= 0x57F)
+                    if (cf.cob >= 0x800)
+                        continue;
+
+                    cobentry entry = table[cf.cob];
+
+                    switch (entry.kind)
                     {
+                        //PDO 0x180 -- 0x57F
+                        case cobclass.PDO:
+                            if (entry.handler != null)
+                                entry.handler(cf);
 
-                        if (PDOcallbacks.ContainsKey(cp.cob))
-                            PDOcallbacks[cp.cob](cp.data);
+                            if (pdoframeevent != null)
+                                pdoframeevent(cf, dt);
 
-                        pdos.Add(cp);
-                    }
+                            if (pdoevent != null)
+                            {
+                                pdos.Add(cp ?? (cp = new canpacket(cf)));
+                                pdotime = dt;
+                            }
+                            break;
 
-                    //SDO replies 0x601-0x67F
-                    if (cp.cob >= 0x580 && cp.cob < 0x600)
-                    {
-                        if (cp.len != 8)
-                            return;
+                        //SDO replies 0x580-0x5FF
+                        case cobclass.SDO_TX:
+                            if (cf.len != 8)
+                                break;
 
-                        lock (sdo_queue)
-                        {
-                            if (SDOcallbacks.ContainsKey(cp.cob))
                             {
-                                if (SDOcallbacks[cp.cob].SDOProcess(cp))
-                                {
-                                    SDOcallbacks.Remove(cp.cob);
-                                }
+                                SDO sdo = Volatile.Read(ref sdoslots[cf.cob - 0x580]);
+                                if (sdo != null && (sdo.SDOProcess(cf) || sdo.done))
+                                    sdo.SDOFinish();
                             }
+                            if (sdoframeevent != null)
+                                sdoframeevent(cf, dt);
                             if (sdoevent != null)
-                                sdoevent(cp, DateTime.Now);
-                        }
-                    }
+                                sdoevent(cp ?? (cp = new canpacket(cf)), dt);
+                            break;
 
-                    if (cp.cob >= 0x600 && cp.cob < 0x680)
-                    {
-                        if (sdoevent != null)
-                            sdoevent(cp,DateTime.Now);
-                    }
+                        //SDO requests 0x600-0x67F
+                        case cobclass.SDO_RX:
+                            if (sdoframeevent != null)
+                                sdoframeevent(cf, dt);
+                            if (sdoevent != null)
+                                sdoevent(cp ?? (cp = new canpacket(cf)), dt);
+                            break;
 
-                    //NMT
-                    if (cp.cob > 0x700 && cp.cob <= 0x77f)
-                    {
-                        byte node = (byte)(cp.cob & 0x07F);
+                        //NMT error control 0x701-0x77F
+                        case cobclass.NMT_EC:
+                            {
+                                byte node = (byte)(cf.cob & 0x07F);
 
-                        nmtstate[node].changestate((NMTState.e_NMTState)cp.data[0]);
-                        nmtstate[node].lastping = DateTime.Now;
+                                nmtstate[node].changestate((NMTState.e_NMTState)cf[0]);
+                                nmtstate[node].lastping = dt;
 
-                        if (nmtecevent != null)
-                            nmtecevent(cp, DateTime.Now);
+                                if (nmtecframeevent != null)
+                                    nmtecframeevent(cf, dt);
+                                if (nmtecevent != null)
+                                    nmtecevent(cp ?? (cp = new canpacket(cf)), dt);
+                            }
+                            break;
+
+                        case cobclass.NMT:
+                            if (nmtframeevent != null)
+                                nmtframeevent(cf, dt);
+                            if (nmtevent != null)
+                                nmtevent(cp ?? (cp = new canpacket(cf)), dt);
+                            break;
+
+                        case cobclass.SYNC:
+                            if (syncframeevent != null)
+                                syncframeevent(cf, dt);
+                            if (syncevent != null)
+                                syncevent(cp ?? (cp = new canpacket(cf)), dt);
+                            break;
+
+                        case cobclass.EMCY:
+                            if (emcyframeevent != null)
+                                emcyframeevent(cf, dt);
+                            if (emcyevent != null)
+                                emcyevent(cp ?? (cp = new canpacket(cf)), dt);
+                            break;
+
+                        case cobclass.TIME:
+                            if (timeframeevent != null)
+                                timeframeevent(cf, dt);
+                            if (timeevent != null)
+                                timeevent(cp ?? (cp = new canpacket(cf)), dt);
+                            break;
+
+                        case cobclass.LSS:
+                            if (lssframeevent != null)
+                                lssframeevent(cf, dt);
+                            if (lssevent != null)
+                                lssevent(cp ?? (cp = new canpacket(cf)), dt);
+                            break;
                     }
+                }
 
-                    if (cp.cob == 000)
-                    {
+                if (pdos.Count > 0)
+                {
+                    if (pdoevent != null)
+                        pdoevent(pdos.ToArray(),pdotime);
+                    pdos.Clear();
+                }
 
-                        if (nmtevent != null)
-                            nmtevent(cp, DateTime.Now);
-                    }
-                    if (cp.cob == 0x80)
-                    {
-                        if (syncevent != null)
-                            syncevent(cp, DateTime.Now);
-                    }
+                sdoexpire();
 
-                    if (cp.cob > 0x080 && cp.cob <= 0xFF)
-                    {
-                        if (emcyevent != null)
-                        {
-                            emcyevent(cp, DateTime.Now);
-                        }
-                    }
+                sdocancelpending();
 
-                    if (cp.cob == 0x100)
-                    {
-                        if (timeevent != null)
-                            timeevent(cp, DateTime.Now);
-                    }
+                sdoissue();
+            }
 
-                    if (cp.cob > 0x7E4 && cp.cob <= 0x7E5)
-                    {
-                        if (lssevent != null)
-                            lssevent(cp, DateTime.Now);
-                    }
-                }
+            SimClock.Leave(clock);
+        }
 
-                if (pdos.Count > 0)
+
+        #region SDOHelpers
+
+        /// <summary>
+        /// An SDO has set a new response deadline, called from the worker
+        /// </summary>
+        internal void sdotimer(SDO sdo)
+        {
+            sdodeadlines.Push(sdo);
+        }
+
+        /// <summary>
+        /// Timeout for a read request to this node, called from the worker
+        /// </summary>
+        internal TimeSpan sdonodetimeout(byte node)
+        {
+            long rto = sdortts[node & 0x7F].rto;
+            return rto == 0 ? sdotimeout : new TimeSpan(rto);
+        }
+
+        /// <summary>
+        /// A read request to this node was answered after rtt, called from the worker
+        /// </summary>
+        internal void sdortt(byte node, TimeSpan rtt)
+        {
+            sdortts[node & 0x7F].Sample(rtt.Ticks, sdotimeoutmin.Ticks, sdotimeout.Ticks);
+        }
+
+        /// <summary>
+        /// A read to this node has been started again, called from the worker
+        /// </summary>
+        internal void sdoretried(byte node)
+        {
+            sdortts[node & 0x7F].retries++;
+        }
+
+        /// <summary>
+        /// SDO response times and timeout counters of a node. Read while transfers run the figures may be
+        /// a moment out of step with each other
+        /// </summary>
+        /// <param name="node">Node ID</param>
+        public SDOnodestats getSDOstats(byte node)
+        {
+            SDOrtt r = sdortts[node & 0x7F];
+            SDOnodestats st;
+
+            st.srtt = new TimeSpan(r.srtt);
+            st.rttvar = new TimeSpan(r.rttvar);
+            st.timeout = sdonodetimeout(node);
+            st.samples = r.samples;
+            st.timeouts = r.timeouts;
+            st.retries = r.retries;
+
+            return st;
+        }
+
+        /// <summary>
+        /// Should a transfer with this node try block mode
+        /// </summary>
+        internal bool sdoblockallowed(byte node)
+        {
+            return sdoblock && !sdonoblock[node & 0x7F];
+        }
+
+        /// <summary>
+        /// The node has turned block mode down, use expedited/segmented transfers with it from now on
+        /// </summary>
+        internal void sdorejectedblock(byte node)
+        {
+            sdonoblock[node & 0x7F] = true;
+        }
+
+        /// <summary>
+        /// Free the node's slot if this SDO holds it
+        /// </summary>
+        internal void sdorelease(SDO sdo)
+        {
+            bool queued;
+
+            lock (sdolock)
+            {
+                if (sdoslots[sdo.node & 0x7F] == sdo)
                 {
-                    if (pdoevent != null)
-                        pdoevent(pdos.ToArray(),DateTime.Now);
+                    sdoslots[sdo.node & 0x7F] = null;
+                    sdoinflight--;
+                    Interlocked.Decrement(ref sdoactive);
                 }
+                queued = sdoqueued > 0;
+            }
+
+            // SDOFinish() may be called from outside the worker
+            if (queued)
+                wake();
+        }
+
+        /// <summary>
+        /// Queue an SDO behind any others for the same node
+        /// </summary>
+        internal void sdoenqueue(SDO sdo)
+        {
+            int node = sdo.node & 0x7F;
+
+            lock (sdolock)
+            {
+                sdo.queued = true;
+
+                if (sdoqueues[node] == null)
+                    sdoqueues[node] = new Queue<SDO>();
 
-                SDO.kick_SDO();
+                if (sdoqueues[node].Count == 0)
+                    sdoready.Enqueue((byte)node);
 
-                lock (sdo_queue)
+                sdoqueues[node].Enqueue(sdo);
+                sdoqueued++;
+            }
+
+            sdowork = true;
+            wake();
+        }
+
+        /// <summary>
+        /// Ask the worker to cancel an SDO, safe from any thread
+        /// </summary>
+        void sdocancel(SDO sdo)
+        {
+            sdocancels.Enqueue(sdo);
+            sdowork = true;
+            wake();
+        }
+
+        /// <summary>
+        /// Cancel the SDOs asked for by sdocancel(), one in progress is aborted on the bus and frees
+        /// its node's slot, a queued one is finished where it is and dropped when it reaches the front
+        /// </summary>
+        void sdocancelpending()
+        {
+            SDO sdo;
+
+            while (sdocancels.TryDequeue(out sdo))
+            {
+                if (sdo.isfinished)
+                    continue;
+
+                sdo.cancel();
+                sdo.SDOFinish();
+            }
+        }
+
+        /// <summary>
+        /// Is there a queued SDO for a node with a free slot and room under sdomaxinflight, called with sdolock held
+        /// </summary>
+        bool sdoissuable()
+        {
+            if (sdoqueued == 0 || sdoinflight >= sdomaxinflight)
+                return false;
+
+            foreach (byte node in sdoready)
+            {
+                if (sdoslots[node] == null)
+                    return true;
+            }
+
+            return false;
+        }
+
+        /// <summary>
+        /// Start the next queued SDO of each free node in turn, up to sdomaxinflight transfers in progress
+        /// </summary>
+        void sdoissue()
+        {
+            lock (sdolock)
+            {
+                int rounds = sdoready.Count;
+
+                while (rounds-- > 0 && sdoinflight < sdomaxinflight)
                 {
-                    if (sdo_queue.Count > 0)
+                    byte node = sdoready.Dequeue();
+                    Queue<SDO> q = sdoqueues[node];
+
+                    // SDOs cancelled while they waited have already been finished, just drop them
+                    while (q.Count > 0 && q.Peek().isfinished)
                     {
-                        SDO sdoobj = sdo_queue.Peek();
+                        q.Dequeue();
+                        sdoqueued--;
+                    }
 
-                        if (!SDOcallbacks.ContainsKey((UInt16)(sdoobj.node + 0x580)))
-                        {
-                            sdoobj = sdo_queue.Dequeue();
-                            SDOcallbacks.Add((UInt16)(sdoobj.node + 0x580), sdoobj);
-                            sdoobj.sendSDO();
-                        }
+                    if (sdoslots[node] == null && q.Count > 0)
+                    {
+                        SDO sdo = q.Dequeue();
+                        sdoqueued--;
+                        sdoslots[node] = sdo;
+                        sdoinflight++;
+                        Interlocked.Increment(ref sdoactive);
+                        sdostarting.Add(sdo);
                     }
+
+                    // still has work, go to the back of the line
+                    if (q.Count > 0)
+                        sdoready.Enqueue(node);
                 }
             }
+
+            // the first request goes out without holding the lock
+            foreach (SDO sdo in sdostarting)
+                sdo.start();
+            sdostarting.Clear();
         }
 
+        /// <summary>
+        /// A heap entry is stale once its SDO has finished or moved on to a later deadline
+        /// </summary>
+        bool sdodeadlinestale(SDO sdo, long ticks)
+        {
+            return sdo.done || sdo.timeout.Ticks != ticks || Volatile.Read(ref sdoslots[sdo.node & 0x7F]) != sdo;
+        }
 
-        #region SDOHelpers
+        /// <summary>
+        /// Earliest time an active SDO will time out
+        /// </summary>
+        /// <returns>The deadline or DateTime.MaxValue if no SDO is waiting on a reply</returns>
+        DateTime sdonextdeadline()
+        {
+            SDO sdo;
+            long ticks;
+
+            while (sdodeadlines.Peek(out sdo, out ticks))
+            {
+                if (!sdodeadlinestale(sdo, ticks))
+                    return new DateTime(ticks);
+                sdodeadlines.Pop();
+            }
+
+            return DateTime.MaxValue;
+        }
+
+        /// <summary>
+        /// Retry or fail every SDO whose deadline has passed, only looks at the top of the heap
+        /// </summary>
+        void sdoexpire()
+        {
+            long now = SimClock.Now.Ticks;
+            SDO sdo;
+            long ticks;
+
+            while (sdodeadlines.Peek(out sdo, out ticks) && ticks < now)
+            {
+                sdodeadlines.Pop();
+
+                if (sdodeadlinestale(sdo, ticks))
+                    continue;
+
+                sdortts[sdo.node & 0x7F].Backoff(sdotimeout.Ticks);
+
+                if (sdo.retry())
+                    continue;
+
+                sdo.expire();
+                sdo.SDOFinish();
+            }
+        }
 
         /// <summary>
         /// Write to a node via SDO
@@ -581,8 +1287,7 @@ namespace libCanopenSimple
         {
 
             SDO sdo = new SDO(this, node, index, subindex, SDO.direction.SDO_WRITE, completedcallback, data);
-            lock(sdo_queue)
-                sdo_queue.Enqueue(sdo);
+            sdoenqueue(sdo);
             return sdo;
         }
 
@@ -597,18 +1302,131 @@ namespace libCanopenSimple
         public SDO SDOread(byte node, UInt16 index, byte subindex, Action<SDO> completedcallback)
         {
             SDO sdo = new SDO(this, node, index, subindex, SDO.direction.SDO_READ, completedcallback, null);
-            lock (sdo_queue)
-                sdo_queue.Enqueue(sdo);
+            sdoenqueue(sdo);
             return sdo;
         }
 
+        /// <summary>
+        /// Read from a remote node via SDO without blocking a thread
+        /// </summary>
+        /// <param name="node">Node ID to read from</param>
+        /// <param name="index">Object Dictionary Index</param>
+        /// <param name="subindex">Object Dictionary sub index</param>
+        /// <param name="ct">Cancels the read, a transfer in progress is aborted on the bus</param>
+        /// <returns>Completes with the finished SDO, check its state for errors, or is cancelled</returns>
+        public Task<SDO> SDOreadAsync(byte node, UInt16 index, byte subindex, CancellationToken ct = default(CancellationToken))
+        {
+            return sdoasync(new SDO(this, node, index, subindex, SDO.direction.SDO_READ, null, null), ct);
+        }
+
+        /// <summary>
+        /// Write to a node via SDO without blocking a thread
+        /// </summary>
+        /// <param name="node">Node ID</param>
+        /// <param name="index">Object Dictionary Index</param>
+        /// <param name="subindex">Object Dictionary sub index</param>
+        /// <param name="data">byte[] of data to send</param>
+        /// <param name="ct">Cancels the write, a transfer in progress is aborted on the bus</param>
+        /// <returns>Completes with the finished SDO, check its state for errors, or is cancelled</returns>
+        public Task<SDO> SDOwriteAsync(byte node, UInt16 index, byte subindex, byte[] data, CancellationToken ct = default(CancellationToken))
+        {
+            return sdoasync(new SDO(this, node, index, subindex, SDO.direction.SDO_WRITE, null, data), ct);
+        }
+
+        /// <summary>
+        /// Read many objects via SDO, the reads are queued at once and run side by side across nodes
+        /// </summary>
+        /// <param name="objects">Node, index and subindex of each object to read</param>
+        /// <param name="progress">Optional, called with each SDO as it finishes (on the worker thread, keep it short)</param>
+        /// <param name="ct">Cancels every read not yet finished</param>
+        /// <returns>Completes with the SDOs in the same order as objects once all have finished, or is cancelled</returns>
+        public Task<SDO[]> SDOreadBatchAsync(IList<(byte node, UInt16 index, byte subindex)> objects, Action<SDO> progress = null, CancellationToken ct = default(CancellationToken))
+        {
+            if (ct.IsCancellationRequested)
+                return Task.FromCanceled<SDO[]>(ct);
+
+            SDO[] results = new SDO[objects.Count];
+            TaskCompletionSource<SDO[]> tcs = new TaskCompletionSource<SDO[]>(TaskCreationOptions.RunContinuationsAsynchronously);
+            CancellationTokenRegistration reg = default(CancellationTokenRegistration);
+            int left = results.Length;
+
+            if (left == 0)
+            {
+                tcs.SetResult(results);
+                return tcs.Task;
+            }
+
+            Action<SDO> finished = sdo =>
+            {
+                if (progress != null && !sdo.cancelled)
+                    progress(sdo);
+
+                if (Interlocked.Decrement(ref left) != 0)
+                    return;
+
+                reg.Dispose();
+                if (ct.IsCancellationRequested)
+                    tcs.TrySetCanceled(ct);
+                else
+                    tcs.TrySetResult(results);
+            };
+
+            for (int x = 0; x < results.Length; x++)
+            {
+                results[x] = new SDO(this, objects[x].node, objects[x].index, objects[x].subindex, SDO.direction.SDO_READ, null, null);
+                results[x].onfinish = finished;
+            }
+
+            if (ct.CanBeCanceled)
+            {
+                reg = ct.Register(() =>
+                {
+                    foreach (SDO sdo in results)
+                        sdocancel(sdo);
+                });
+            }
+
+            foreach (SDO sdo in results)
+                sdoenqueue(sdo);
+
+            return tcs.Task;
+        }
+
+        /// <summary>
+        /// Queue an SDO and hand back a task that completes with it
+        /// </summary>
+        Task<SDO> sdoasync(SDO sdo, CancellationToken ct)
+        {
+            if (ct.IsCancellationRequested)
+                return Task.FromCanceled<SDO>(ct);
+
+            // continuations must not run on the worker thread
+            TaskCompletionSource<SDO> tcs = new TaskCompletionSource<SDO>(TaskCreationOptions.RunContinuationsAsynchronously);
+            CancellationTokenRegistration reg = default(CancellationTokenRegistration);
+
+            sdo.onfinish = s =>
+            {
+                reg.Dispose();
+                if (s.cancelled)
+                    tcs.TrySetCanceled(ct);
+                else
+                    tcs.TrySetResult(s);
+            };
+
+            if (ct.CanBeCanceled)
+                reg = ct.Register(() => sdocancel(sdo));
+
+            sdoenqueue(sdo);
+            return tcs.Task;
+        }
+
         /// <summary>
         /// Get the current length of Enqueued items
         /// </summary>
         /// <returns></returns>
         public int getSDOQueueSize()
         {
-            return sdo_queue.Count;
+            return Volatile.Read(ref sdoqueued);
         }
 
         /// <summary>
@@ -616,8 +1434,32 @@ namespace libCanopenSimple
         /// </summary>
         public void flushSDOqueue()
         {
-            lock (sdo_queue)
-                sdo_queue.Clear();
+            List<SDO> flushed = new List<SDO>();
+
+            lock (sdolock)
+            {
+                foreach (Queue<SDO> q in sdoqueues)
+                {
+                    if (q != null)
+                    {
+                        flushed.AddRange(q);
+                        q.Clear();
+                    }
+                }
+                sdoready.Clear();
+                sdoqueued = 0;
+            }
+
+            // never started, so nothing to tell the nodes, but anyone waiting on them must hear
+            foreach (SDO sdo in flushed)
+            {
+                if (sdo.isfinished)
+                    continue;
+
+                sdo.cancelled = true;
+                sdo.state = SDO.SDO_STATE.SDO_ERROR;
+                sdo.SDOFinish();
+            }
         }
 
         #endregion
@@ -626,59 +1468,54 @@ namespace libCanopenSimple
 
         public void NMT_start(byte nodeid = 0)
         {
-            canpacket p = new canpacket();
-            p.cob = 000;
-            p.len = 2;
-            p.data = new byte[2];
-            p.data[0] = 0x01;
-            p.data[1] = nodeid;
-            SendPacket(p);
+            canframe f = new canframe();
+            f.cob = 000;
+            f.len = 2;
+            f[0] = 0x01;
+            f[1] = nodeid;
+            SendFrame(f);
         }
 
         public void NMT_preop(byte nodeid = 0)
         {
-            canpacket p = new canpacket();
-            p.cob = 000;
-            p.len = 2;
-            p.data = new byte[2];
-            p.data[0] = 0x80;
-            p.data[1] = nodeid;
-            SendPacket(p);
+            canframe f = new canframe();
+            f.cob = 000;
+            f.len = 2;
+            f[0] = 0x80;
+            f[1] = nodeid;
+            SendFrame(f);
         }
 
         public void NMT_stop(byte nodeid = 0)
         {
-            canpacket p = new canpacket();
-            p.cob = 000;
-            p.len = 2;
-            p.data = new byte[2];
-            p.data[0] = 0x02;
-            p.data[1] = nodeid;
-            SendPacket(p);
+            canframe f = new canframe();
+            f.cob = 000;
+            f.len = 2;
+            f[0] = 0x02;
+            f[1] = nodeid;
+            SendFrame(f);
         }
 
         public void NMT_ResetNode(byte nodeid = 0)
         {
-            canpacket p = new canpacket();
-            p.cob = 000;
-            p.len = 2;
-            p.data = new byte[2];
-            p.data[0] = 0x81;
-            p.data[1] = nodeid;
+            canframe f = new canframe();
+            f.cob = 000;
+            f.len = 2;
+            f[0] = 0x81;
+            f[1] = nodeid;
 
-            SendPacket(p);
+            SendFrame(f);
         }
 
         public void NMT_ResetComms(byte nodeid = 0)
         {
-            canpacket p = new canpacket();
-            p.cob = 000;
-            p.len = 2;
-            p.data = new byte[2];
-            p.data[0] = 0x82;
-            p.data[1] = nodeid;
+            canframe f = new canframe();
+            f.cob = 000;
+            f.len = 2;
+            f[0] = 0x82;
+            f[1] = nodeid;
 
-            SendPacket(p);
+            SendFrame(f);
         }
 
         public void NMT_SetStateTransitionCallback(byte node, Action<NMTState.e_NMTState> callback)
@@ -693,19 +1530,18 @@ namespace libCanopenSimple
 
         public void NMT_ReseCommunication(byte nodeid = 0)
         {
-            canpacket p = new canpacket();
-            p.cob = 000;
-            p.len = 2;
-            p.data = new byte[2];
-            p.data[0] = 0x81;
-            p.data[1] = nodeid;
+            canframe f = new canframe();
+            f.cob = 000;
+            f.len = 2;
+            f[0] = 0x81;
+            f[1] = nodeid;
 
-            SendPacket(p);
+            SendFrame(f);
         }
 
         public bool checkguard(int node, TimeSpan maxspan)
         {
-            if (DateTime.Now - nmtstate[(ushort)node].lastping > maxspan)
+            if (SimClock.Now - nmtstate[(ushort)node].lastping > maxspan)
                 return false;
 
             return true;
@@ -717,14 +1553,7 @@ namespace libCanopenSimple
 
         public void writePDO(UInt16 cob, byte[] payload)
         {
-            canpacket p = new canpacket();
-            p.cob = cob;
-            p.len = (byte)payload.Length;
-            p.data = new byte[p.len];
-            for (int x = 0; x < payload.Length; x++)
-                p.data[x] = payload[x];
-
-            SendPacket(p);
+            SendFrame(new canframe(cob, payload));
         }
 
         #endregion